@@ -0,0 +1,36 @@
+// Copyright (c) 2020
+//
+#include "db/bloom_filter.h"
+
+#include <algorithm>
+
+namespace dbwheel {
+
+BloomFilter::BloomFilter(size_t capacity, uint32_t bitsPerKey, uint64_t minTxID):
+  capacity_(capacity),
+  blockCount_(std::max<size_t>(1, (capacity * bitsPerKey + kBlockWords * 64 - 1) / (kBlockWords * 64))),
+  // ln(2) bits per key is the best
+  probes_(std::min<uint32_t>(30, std::max<uint32_t>(1, bitsPerKey * 69 / 100))),
+  minTxID_(minTxID),
+  added_(0),
+  blocks_(new std::atomic<uint64_t>[blockCount_ * kBlockWords]) {
+
+  for (size_t i = 0; i < blockCount_ * kBlockWords; i++) {
+    blocks_[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+void BloomFilter::add(std::string_view key) {
+
+  uint64_t h = hash(key);
+  std::atomic<uint64_t>* block = blocks_.get() + blockOf(h) * kBlockWords;
+  uint32_t bits = static_cast<uint32_t>(h), delta = (bits >> 17) | (bits << 15);
+  for (uint32_t i = 0; i < probes_; i++, bits += delta) {
+    uint32_t bit = bits & (kBlockWords * 64 - 1);
+    block[bit / 64].fetch_or(uint64_t(1) << (bit % 64), std::memory_order_relaxed);
+  }
+
+  added_.fetch_add(1, std::memory_order_relaxed);
+}
+
+}  // namespace dbwheel
@@ -0,0 +1,80 @@
+// Copyright (c) 2020
+//
+#ifndef DB_BLOOM_FILTER_H_
+#define DB_BLOOM_FILTER_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+
+namespace dbwheel {
+
+// BloomFilter is a blocked bloom filter of the keys of a bucket, all the
+// probes of a key fall into one cache line. The keys are only added, so it
+// holds every key of the snapshots since it's built, and it's read by the
+// readers while the writer adds the keys.
+class BloomFilter {
+ public:
+  // Sized for 'capacity' keys, and holds the keys of the snapshots not
+  // older than 'minTxID'.
+  BloomFilter(size_t capacity, uint32_t bitsPerKey, uint64_t minTxID);
+
+  void add(std::string_view key);
+
+  // Returns false if 'key' is surely absent.
+  bool mayContain(std::string_view key) const {
+
+    uint64_t h = hash(key);
+    const std::atomic<uint64_t>* block = blocks_.get() + blockOf(h) * kBlockWords;
+    uint32_t bits = static_cast<uint32_t>(h), delta = (bits >> 17) | (bits << 15);
+    for (uint32_t i = 0; i < probes_; i++, bits += delta) {
+      uint32_t bit = bits & (kBlockWords * 64 - 1);
+      if ((block[bit / 64].load(std::memory_order_relaxed) & (uint64_t(1) << (bit % 64))) == 0) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  // Whether more keys are added than it's sized for.
+  bool full() const { return added_.load(std::memory_order_relaxed) > capacity_; }
+  uint64_t minTxID() const { return minTxID_; }
+  size_t memoryUsage() const { return blockCount_ * kBlockWords * sizeof(uint64_t); }
+
+ private:
+  // 512 bits, a cache line
+  static const size_t kBlockWords = 8;
+
+  static uint64_t hash(std::string_view key) {
+
+    // FNV-1a, mixed by the finalizer of MurmurHash3
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (unsigned char c : key) {
+      h = (h ^ c) * 0x100000001b3ull;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+
+    return h;
+  }
+
+  size_t blockOf(uint64_t h) const {
+    return static_cast<size_t>(((h >> 32) * blockCount_) >> 32);
+  }
+
+  size_t capacity_;
+  size_t blockCount_;
+  uint32_t probes_;
+  uint64_t minTxID_;
+  std::atomic<size_t> added_;
+  std::unique_ptr<std::atomic<uint64_t>[]> blocks_;
+};
+
+}  // namespace dbwheel
+
+#endif  // DB_BLOOM_FILTER_H_
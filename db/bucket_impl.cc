@@ -2,21 +2,1240 @@
 //
 #include "db/bucket_impl.h"
 
+#include <cstring>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "db/assert.h"
+#include "db/freelist.h"
+#include "db/inode.h"
+#include "db/node.h"
+#include "db/page.h"
+#include "db/page_ele.h"
+#include "db/statistics.h"
+#include "db/tx_impl.h"
+#include "db/value_reader.h"
+#include "db/wal.h"
+
 namespace dbwheel {
 
+// The maximum length of a value.
+static const size_t kMaxValueSize = 0x7FFFFFFF;
+
+static const double kDefaultFillPercent = 0.5;
+
+// The partitions of a parallel scan per thread, so the threads finishing
+// early take the rest.
+static const size_t kScanPartitionsPerThread = 4;
+
+template <class T>
+static inline std::string_view keyOf(T* e) {
+  return std::string_view(reinterpret_cast<char*>(e) + e->pos, e->ksize);
+}
+
+// Compares the decoded key of the search with the 8 byte keys of the pages.
+struct Uint64KeyLess {
+  bool operator()(uint64_t a, std::string_view b) const { return a < Uint64Less::decode(b); }
+  bool operator()(std::string_view a, uint64_t b) const { return Uint64Less::decode(a) < b; }
+};
+
+// Returns the index of the child to find 'key' in the branch 'pn' from 'from',
+// which is the last key not greater than 'key'.
+template <class K, class Less>
+static size_t childIndexOf(const BucketImpl::pageOrNode& pn, size_t from, const K& key,
+    const Less& less) {
+
+  size_t lo = from, hi = pn.count();
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (less(key, pn.key(mid))) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+
+  return lo == 0 ? 0 : lo - 1;
+}
+
+// Returns the index of the first key not less than 'key' in the leaf 'pn' from 'from'.
+template <class K, class Less>
+static size_t lowerBoundOf(const BucketImpl::pageOrNode& pn, size_t from, const K& key,
+    const Less& less) {
+
+  size_t lo = from, hi = pn.count();
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (less(pn.key(mid), key)) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+// The integer keys are decoded once per search, and compared without memcmp.
+// The bytewise order is the same for them, so the keys of the other sizes are
+// compared by the bytes. The empty key starts from the first key, which it's
+// not compared with, since it's not the smallest one in every order.
+static size_t childIndexOf(const BucketImpl::pageOrNode& pn, size_t from,
+    const std::string& key, const KeyOrder& order) {
+
+  if (key.empty()) {
+    return from == 0 ? 0 : from - 1;
+  }
+
+  switch (order.kind()) {
+    case KeyOrder::kUint64:
+      if (key.size() == sizeof(uint64_t)) {
+        return childIndexOf(pn, from, Uint64Less::decode(key), Uint64KeyLess());
+      }
+      return childIndexOf(pn, from, std::string_view(key), BytewiseLess());
+    case KeyOrder::kComparator:
+      return childIndexOf(pn, from, std::string_view(key), ComparatorLess{order.comparator()});
+    default:
+      return childIndexOf(pn, from, std::string_view(key), BytewiseLess());
+  }
+}
+
+// Searches the dense array of the 8 byte keys of a fixed width leaf by the
+// index arithmetic, without going through the page elements.
+static size_t denseLowerBoundOf(const char* keys, size_t from, size_t count, uint64_t key) {
+
+  size_t lo = from, hi = count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (Uint64Less::decode(std::string_view(keys + mid * 8, 8)) < key) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+static size_t lowerBoundOf(const BucketImpl::pageOrNode& pn, size_t from,
+    const std::string& key, const KeyOrder& order) {
+
+  if (key.empty()) {
+    return from;
+  }
+
+  // the bytewise and the uint64 orders are the same for the 8 byte keys
+  const char* keys = pn.denseKeys8();
+  if (keys != nullptr && key.size() == 8 && order.kind() != KeyOrder::kComparator) {
+    return denseLowerBoundOf(keys, from, pn.count(), Uint64Less::decode(key));
+  }
+
+  switch (order.kind()) {
+    case KeyOrder::kUint64:
+      if (key.size() == sizeof(uint64_t)) {
+        return lowerBoundOf(pn, from, Uint64Less::decode(key), Uint64KeyLess());
+      }
+      return lowerBoundOf(pn, from, std::string_view(key), BytewiseLess());
+    case KeyOrder::kComparator:
+      return lowerBoundOf(pn, from, std::string_view(key), ComparatorLess{order.comparator()});
+    default:
+      return lowerBoundOf(pn, from, std::string_view(key), BytewiseLess());
+  }
+}
+
+BucketImpl::BucketImpl(TXImpl* tx, const struct bucket& b, std::string_view inlinePage,
+    const KeyOrder& order):
+  tx_(tx),
+  bucket_(b),
+  order_(order),
+  keySize_(0),
+  valueSize_(0),
+  inlinePage_((inlinePage.size() + sizeof(uint64_t) - 1) / sizeof(uint64_t)),
+  fillPercent_(kDefaultFillPercent),
+  rootNode_(nullptr) {
+
+  if (!inlinePage.empty()) {
+    memcpy(inlinePage_.data(), inlinePage.data(), inlinePage.size());
+  }
+}
+
+BucketImpl::~BucketImpl() {
+
+  for (auto& e : buckets_) {
+    delete e.second;
+  }
+
+  // deletes the children too
+  delete rootNode_;
+}
+
 Status BucketImpl::put(const std::string& k, const std::string& v) {
-  // TODO
+
+  if (!tx_->writable()) {
+    return Status::invalidArgument("tx not writable");
+  }
+
+  if (k.empty()) {
+    return Status::invalidArgument("key required");
+  }
+
+  if (k.size() > kMaxKeySize) {
+    return Status::invalidArgument("key too large");
+  }
+
+  if (!order_.valid(k)) {
+    return Status::invalidArgument("invalid key");
+  }
+
+  if (v.size() > kMaxValueSize) {
+    return Status::invalidArgument("value too large");
+  }
+
+  if (keySize_ > 0 && (k.size() != keySize_ || v.size() != valueSize_)) {
+    return Status::invalidArgument("not fixed width");
+  }
+
+  Status s = tx_->spillIfOverBudget();
+  if (!s.ok()) {
+    return s;
+  }
+
+  // the old value is read by the same search only if it's indexed
+  uint32_t flags;
+  std::string old;
+  bool found = search(k, &flags, indexes_.empty() ? nullptr : &old);
+  if (found && (flags & leafPageElement::kBucketLeafFlag) != 0) {
+    return Status::invalidArgument("incompatible value");
+  }
+
+  if (!indexes_.empty()) {
+    std::vector<std::pair<IndexWriter*, WriteBatch::Op>> ops;
+    s = indexOps(k, found ? &old : nullptr, &v, &ops);
+    if (!s.ok()) {
+      return s;
+    }
+    addIndexOps(ops);
+  }
+
+  if (filter_ != nullptr) {
+    filter_->add(k);
+  }
+
+  if (tx_->wal() != nullptr) {
+    tx_->wal()->put(path_, k, v);
+  }
+
+  seekNode(k)->put(k, k, v, 0, 0);
+  tx_->charge(Inodes::kOverhead + k.size() + v.size());
+
   return Status::OK();
 }
 
 Status BucketImpl::get(const std::string& k, std::string* v) {
-  // TODO
+
+  if (filter_ != nullptr && !filter_->mayContain(k)) {
+    recordTick(DBStats::kFilterNegatives);
+    return Status::notFound(k);
+  }
+
+  uint32_t flags;
+  if (!search(k, &flags, v) || (flags & leafPageElement::kBucketLeafFlag) != 0) {
+    return Status::notFound(k);
+  }
+
   return Status::OK();
 }
 
 Status BucketImpl::del(const std::string& k) {
-  // TODO
+
+  if (!tx_->writable()) {
+    return Status::invalidArgument("tx not writable");
+  }
+
+  Status s = tx_->spillIfOverBudget();
+  if (!s.ok()) {
+    return s;
+  }
+
+  uint32_t flags;
+  std::string old;
+  if (!search(k, &flags, indexes_.empty() ? nullptr : &old)) {
+    return Status::OK();
+  }
+
+  if ((flags & leafPageElement::kBucketLeafFlag) != 0) {
+    return Status::invalidArgument("incompatible value");
+  }
+
+  if (!indexes_.empty()) {
+    std::vector<std::pair<IndexWriter*, WriteBatch::Op>> ops;
+    indexOps(k, &old, nullptr, &ops);
+    addIndexOps(ops);
+  }
+
+  if (tx_->wal() != nullptr) {
+    tx_->wal()->del(path_, k);
+  }
+
+  Node* n = seekNode(k);
+  n->del(k);
+  unbalanced_.insert(n->pageID());
+
+  return Status::OK();
+}
+
+uint64_t BucketImpl::sequence() {
+  return bucket_.sequence;
+}
+
+Status BucketImpl::setSequence(uint64_t v) {
+
+  if (!tx_->writable()) {
+    return Status::invalidArgument("tx not writable");
+  }
+
+  // the header is written only if the root is materialized
+  if (rootNode_ == nullptr) {
+    node(bucket_.rootPageID, nullptr);
+  }
+
+  bucket_.sequence = v;
+
+  if (tx_->wal() != nullptr) {
+    tx_->wal()->sequence(path_, v);
+  }
+
+  return Status::OK();
+}
+
+Status BucketImpl::nextSequence(uint64_t* v) {
+
+  Status s = setSequence(bucket_.sequence + 1);
+  if (s.ok()) {
+    *v = bucket_.sequence;
+  }
+
+  return s;
+}
+
+Status BucketImpl::write(const WriteBatch& batch) {
+
+  if (!tx_->writable()) {
+    return Status::invalidArgument("tx not writable");
+  }
+
+  auto& ops = batch.ops();
+  for (auto& op : ops) {
+    if (op.key.empty()) {
+      return Status::invalidArgument("key required");
+    }
+
+    if (op.key.size() > kMaxKeySize) {
+      return Status::invalidArgument("key too large");
+    }
+
+    if (!order_.valid(op.key)) {
+      return Status::invalidArgument("invalid key");
+    }
+
+    if (op.value.size() > kMaxValueSize) {
+      return Status::invalidArgument("value too large");
+    }
+
+    if (keySize_ > 0 && (op.key.size() != keySize_ || (!op.del && op.value.size() != valueSize_))) {
+      return Status::invalidArgument("not fixed width");
+    }
+  }
+
+  if (ops.empty()) {
+    return Status::OK();
+  }
+
+  Status s = tx_->spillIfOverBudget();
+  if (!s.ok()) {
+    return s;
+  }
+
+  std::vector<const WriteBatch::Op*> sorted;
+  sorted.reserve(ops.size());
+  for (auto& op : ops) {
+    sorted.push_back(&op);
+  }
+  std::stable_sort(sorted.begin(), sorted.end(),
+      [this](const WriteBatch::Op* a, const WriteBatch::Op* b) { return order_.less(a->key, b->key); });
+
+  // keeps the last write of every key
+  size_t n = 0;
+  for (size_t i = 0; i < sorted.size(); i++) {
+    if (n > 0 && sorted[n - 1]->key == sorted[i]->key) {
+      n--;
+    }
+    sorted[n++] = sorted[i];
+  }
+  sorted.resize(n);
+
+  // the leaves with the first op falling into each
+  std::vector<std::pair<Node*, const WriteBatch::Op* const*>> leaves;
+  Node* root = rootNode_ != nullptr ? rootNode_ : node(bucket_.rootPageID, nullptr);
+  seekLeaves(root, sorted.data(), sorted.data() + n, &leaves);
+  leaves.emplace_back(nullptr, sorted.data() + n);
+
+  // checks all before changing any leaf, and collects the index entries
+  // replaced by the old values found on the way
+  std::vector<std::pair<IndexWriter*, WriteBatch::Op>> indexed;
+  std::string old;
+  for (size_t i = 0; i + 1 < leaves.size(); i++) {
+    auto& inodes = leaves[i].first->inodes();
+    size_t pos = 0;
+    for (auto it = leaves[i].second; it != leaves[i + 1].second; it++) {
+      while (pos < inodes.size() && order_.less(inodes.key(pos), (*it)->key)) {
+        pos++;
+      }
+      bool found = pos < inodes.size() && inodes.key(pos) == (*it)->key;
+      if (found && (inodes.flags(pos) & leafPageElement::kBucketLeafFlag) != 0) {
+        return Status::invalidArgument("incompatible value");
+      }
+
+      if (indexes_.empty() || (!found && (*it)->del)) {
+        continue;
+      }
+      if (found) {
+        readValue(inodes.flags(pos), inodes.value(pos), &old);
+      }
+      s = indexOps((*it)->key, found ? &old : nullptr,
+          (*it)->del ? nullptr : &(*it)->value, &indexed);
+      if (!s.ok()) {
+        return s;
+      }
+    }
+  }
+  addIndexOps(indexed);
+
+  if (filter_ != nullptr) {
+    for (size_t i = 0; i < n; i++) {
+      if (!sorted[i]->del) {
+        filter_->add(sorted[i]->key);
+      }
+    }
+  }
+
+  if (tx_->wal() != nullptr) {
+    for (size_t i = 0; i < n; i++) {
+      if (sorted[i]->del) {
+        tx_->wal()->del(path_, sorted[i]->key);
+      } else {
+        tx_->wal()->put(path_, sorted[i]->key, sorted[i]->value);
+      }
+    }
+  }
+
+  for (size_t i = 0; i + 1 < leaves.size(); i++) {
+    Node* leaf = leaves[i].first;
+    if (leaf->merge(leaves[i].second, leaves[i + 1].second)) {
+      unbalanced_.insert(leaf->pageID());
+    }
+  }
+
+  size_t bytes = 0;
+  for (size_t i = 0; i < n; i++) {
+    bytes += Inodes::kOverhead + sorted[i]->key.size() + sorted[i]->value.size();
+  }
+  tx_->charge(bytes);
+
+  return Status::OK();
+}
+
+std::string indexEntryPrefix(const std::string& indexKey) {
+
+  std::string prefix;
+  prefix.reserve(2 + indexKey.size());
+  prefix.push_back(static_cast<char>(indexKey.size() >> 8));
+  prefix.push_back(static_cast<char>(indexKey.size()));
+  prefix.append(indexKey);
+
+  return prefix;
+}
+
+std::string indexEntryKey(const std::string& indexKey, const std::string& key) {
+  return indexEntryPrefix(indexKey) + key;
+}
+
+// Collects the index entries to delete and to put into *ops for replacing
+// 'oldValue' of 'k' by 'newValue', either may be null. Nothing is collected
+// for an index if the index key stays the same.
+Status BucketImpl::indexOps(const std::string& k, const std::string* oldValue,
+    const std::string* newValue, std::vector<std::pair<IndexWriter*, WriteBatch::Op>>* ops) {
+
+  std::string oldKey, newKey;
+  for (auto w : indexes_) {
+    bool hadKey = oldValue != nullptr && (*w->keyOf)(k, *oldValue, &oldKey);
+    bool hasKey = newValue != nullptr && (*w->keyOf)(k, *newValue, &newKey);
+    if (hadKey && hasKey && oldKey == newKey) {
+      continue;
+    }
+
+    if (hasKey && indexEntryPrefix(newKey).size() + k.size() > kMaxKeySize) {
+      return Status::invalidArgument("index key too large");
+    }
+
+    if (hadKey) {
+      ops->push_back(std::make_pair(w, WriteBatch::Op{true, indexEntryKey(oldKey, k), std::string()}));
+    }
+    if (hasKey) {
+      ops->push_back(std::make_pair(w, WriteBatch::Op{false, indexEntryKey(newKey, k), k}));
+    }
+  }
+
+  return Status::OK();
+}
+
+void BucketImpl::addIndexOps(const std::vector<std::pair<IndexWriter*, WriteBatch::Op>>& ops) {
+
+  for (auto& e : ops) {
+    if (e.second.del) {
+      e.first->batch.del(e.second.key);
+    } else {
+      e.first->batch.put(e.second.key, e.second.value);
+    }
+  }
+}
+
+Status BucketImpl::indexLookup(const std::string& indexKey, std::vector<std::string>* keys) {
+
+  keys->clear();
+  std::string prefix = indexEntryPrefix(indexKey);
+  scan(prefix, [&](const std::string& k, const std::string& v) {
+    if (k.compare(0, prefix.size(), prefix) != 0) {
+      return false;
+    }
+    keys->push_back(v);
+    return true;
+  });
+
+  return Status::OK();
+}
+
+void BucketImpl::scan(const std::string& from,
+    const std::function<bool(const std::string& k, const std::string& v)>& f) {
+  scanRange(from, std::string(), f);
+}
+
+size_t BucketImpl::leaves(std::vector<pageOrNode>* leaves) {
+
+  size_t count = 0;
+  walkLeaves(root(), std::string(), [&](const pageOrNode& pn) {
+    leaves->push_back(pn);
+    count += pn.count();
+    return true;
+  });
+
+  return count;
+}
+
+// Calls 'f' with the entries in ['begin', 'end'), returns false if 'f' stops it.
+bool BucketImpl::scanRange(const std::string& begin, const std::string& end, const ScanFunc& f) {
+
+  std::string k, v;
+  bool stopped = false;
+  walkLeaves(root(), begin, [&](const pageOrNode& pn) {
+    for (size_t i = lowerBoundOf(pn, 0, begin, order_); i < pn.count(); i++) {
+      if (!end.empty() && !order_.less(pn.key(i), end)) {
+        return false;
+      }
+
+      uint32_t flags = pn.flags(i);
+      if ((flags & leafPageElement::kBucketLeafFlag) != 0) {
+        continue;
+      }
+
+      k.assign(pn.key(i).data(), pn.key(i).size());
+      readValue(flags, pn.value(i), &v);
+      if (!f(k, v)) {
+        stopped = true;
+        return false;
+      }
+    }
+    return true;
+  });
+
+  return !stopped;
+}
+
+// Stores at most 'n' - 1 keys splitting ['begin', 'end') into *splits in the
+// order, which are the first keys of the children of the highest level of
+// the branches having enough of them in the range.
+void BucketImpl::splitRange(const std::string& begin, const std::string& end, size_t n,
+    std::vector<std::string>* splits) {
+
+  std::vector<pageOrNode> level{root()};
+  std::vector<std::string> keys;
+  for (;;) {
+    std::vector<pageOrNode> next;
+    std::vector<std::string> found;
+    for (auto& pn : level) {
+      if (pn.isLeaf()) {
+        continue;
+      }
+      for (size_t i = childIndexOf(pn, 0, begin, order_); i < pn.count(); i++) {
+        if (!end.empty() && !order_.less(pn.key(i), end)) {
+          break;
+        }
+        if (begin.empty() || order_.less(begin, pn.key(i))) {
+          found.emplace_back(pn.key(i));
+        }
+        next.push_back(child(pn.pageID(i)));
+      }
+    }
+
+    // the level is of the leaves
+    if (next.empty()) {
+      break;
+    }
+    keys.swap(found);
+    if (keys.size() + 1 >= n) {
+      break;
+    }
+    level.swap(next);
+  }
+
+  // the keys are spread evenly over the partitions
+  size_t m = std::min(keys.size() + 1, n);
+  for (size_t j = 1; j < m; j++) {
+    splits->push_back(keys[j * (keys.size() + 1) / m - 1]);
+  }
+}
+
+Status BucketImpl::parallelScan(const std::string& begin, const std::string& end, int threads,
+    const ScanFunc& f, bool ordered) {
+
+  if (threads < 1) {
+    return Status::invalidArgument("no threads");
+  }
+
+  if (!begin.empty() && !end.empty() && !order_.less(begin, end)) {
+    return Status::OK();
+  }
+
+  if (threads == 1) {
+    scanRange(begin, end, f);
+    return Status::OK();
+  }
+
+  std::vector<std::string> bounds{begin};
+  splitRange(begin, end, threads * kScanPartitionsPerThread, &bounds);
+  bounds.push_back(end);
+  size_t n = bounds.size() - 1;
+
+  // the threads take the partitions in the order, at most twice as many as
+  // the threads ahead of the one returned last if ordered
+  std::mutex mu;
+  std::condition_variable cv;
+  size_t next = 0, returned = 0, window = ordered ? threads * 2 : n;
+  std::atomic<bool> stop(false);
+  std::vector<std::vector<std::pair<std::string, std::string>>> entries(ordered ? n : 0);
+  std::vector<bool> done(n);
+
+  auto scan = [&]() {
+    for (;;) {
+      size_t i;
+      {
+        std::unique_lock<std::mutex> lock(mu);
+        cv.wait(lock, [&] { return stop || next >= n || next < returned + window; });
+        if (stop || next >= n) {
+          return;
+        }
+        i = next++;
+      }
+
+      bool more = scanRange(bounds[i], bounds[i + 1], [&](const std::string& k, const std::string& v) {
+        if (!ordered) {
+          return !stop && f(k, v);
+        }
+        entries[i].emplace_back(k, v);
+        return true;
+      });
+
+      std::lock_guard<std::mutex> lock(mu);
+      done[i] = true;
+      if (!more) {
+        stop = true;
+      }
+      cv.notify_all();
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (int t = ordered ? 0 : 1; t < threads; t++) {
+    workers.emplace_back(scan);
+  }
+
+  if (!ordered) {
+    scan();
+  }
+
+  for (size_t i = 0; ordered && i < n; i++) {
+    {
+      std::unique_lock<std::mutex> lock(mu);
+      cv.wait(lock, [&] { return done[i]; });
+    }
+
+    bool more = true;
+    for (auto& e : entries[i]) {
+      if (!(more = f(e.first, e.second))) {
+        break;
+      }
+    }
+    entries[i].clear();
+    entries[i].shrink_to_fit();
+
+    std::lock_guard<std::mutex> lock(mu);
+    returned = i + 1;
+    stop = !more;
+    cv.notify_all();
+    if (stop) {
+      break;
+    }
+  }
+
+  for (auto& w : workers) {
+    w.join();
+  }
+
   return Status::OK();
 }
 
+// Materializes the leaves of the subtree 'n' which the sorted ops in
+// [begin, end) fall into, the keys before the same separator share the descent.
+void BucketImpl::seekLeaves(
+    Node* n,
+    const WriteBatch::Op* const* begin,
+    const WriteBatch::Op* const* end,
+    std::vector<std::pair<Node*, const WriteBatch::Op* const*>>* leaves) {
+
+  if (n->isLeaf()) {
+    leaves->emplace_back(n, begin);
+    return;
+  }
+
+  size_t i = 0;
+  while (begin != end) {
+    i = childIndexOf(pageOrNode{nullptr, n}, i, (*begin)->key, order_);
+
+    auto mid = end;
+    if (i + 1 < n->inodes().size()) {
+      std::string_view separator = n->inodes().key(i + 1);
+      mid = std::lower_bound(begin, end, separator,
+          [this](const WriteBatch::Op* op, std::string_view sep) { return order_.less(op->key, sep); });
+    }
+
+    Node* child = node(n->inodes().pageID(i), n);
+    child->index(i);
+    seekLeaves(child, begin, mid, leaves);
+    begin = mid;
+  }
+}
+
+Node* BucketImpl::get(uint64_t pageID) {
+
+  auto it = nodes_.find(pageID);
+  return it == nodes_.end() ? nullptr : it->second;
+}
+
+Node* BucketImpl::node(uint64_t pageID, Node* parent) {
+
+  Node* n = get(pageID);
+  if (n != nullptr) {
+    return n;
+  }
+
+  Page* p = page(pageID);
+  n = new Node(parent, pageID, false, order_);
+  n->fixedWidth(keySize_, valueSize_);
+  n->readPage(p);
+  tx_->charge((p->overflow() + 1) * tx_->pageSize() + p->count() * Inodes::kOverhead);
+
+  if (parent == nullptr) {
+    rootNode_ = n;
+  } else {
+    parent->addChild(n);
+  }
+
+  nodes_[pageID] = n;
+
+  return n;
+}
+
+void BucketImpl::remove(uint64_t pageID) {
+  nodes_.erase(pageID);
+}
+
+BucketImpl* BucketImpl::bucket(const std::string& name) {
+
+  auto it = buckets_.find(name);
+  if (it != buckets_.end()) {
+    return it->second;
+  }
+
+  uint32_t flags;
+  std::string value;
+  if (!search(name, &flags, &value) || (flags & leafPageElement::kBucketLeafFlag) == 0) {
+    return nullptr;
+  }
+
+  const Comparator* comparator = tx_->comparator(
+      (flags & leafPageElement::kComparatorMask) >> leafPageElement::kComparatorShift);
+  if (comparator == nullptr) {
+    return nullptr;
+  }
+
+  struct bucket b;
+  memcpy(&b, value.data(), sizeof(b));
+
+  auto child = new BucketImpl(tx_, b, std::string_view(value).substr(sizeof(b)), KeyOrder(comparator));
+  child->keySize_ = (flags >> leafPageElement::kKeyWidthShift) & 0xff;
+  child->valueSize_ = (flags >> leafPageElement::kValueWidthShift) & 0xff;
+  if (tx_->wal() != nullptr) {
+    child->path_ = WalBatch::subPath(path_, name);
+  }
+  buckets_[name] = child;
+
+  return child;
+}
+
+BucketImpl* BucketImpl::createBucket(const std::string& name, const Comparator* comparator,
+    uint8_t keySize, uint8_t valueSize) {
+
+  if (!tx_->writable() || name.empty() || name.size() > kMaxKeySize) {
+    return nullptr;
+  }
+
+  if (!tx_->spillIfOverBudget().ok()) {
+    return nullptr;
+  }
+
+  uint32_t flags;
+  if (search(name, &flags, nullptr)) {
+    return nullptr;
+  }
+
+  struct bucket b{0, 0};
+  auto child = new BucketImpl(tx_, b, std::string_view(), KeyOrder(comparator));
+  child->keySize_ = keySize;
+  child->valueSize_ = keySize > 0 ? valueSize : 0;
+  child->rootNode_ = new Node(nullptr, 0, true, child->order_);
+  child->rootNode_->fixedWidth(child->keySize_, child->valueSize_);
+  buckets_[name] = child;
+
+  if (tx_->wal() != nullptr) {
+    tx_->wal()->createBucket(path_, name, child->order_.id(), child->keySize_, child->valueSize_);
+    child->path_ = WalBatch::subPath(path_, name);
+  }
+
+  // the header is updated when spilling
+  seekNode(name)->put(name, name, std::string(reinterpret_cast<char*>(&b), sizeof(b)), 0,
+      child->flags());
+
+  return child;
+}
+
+// Merges the nodes deleting inodes if they are too small.
+void BucketImpl::rebalance() {
+
+  for (auto id : unbalanced_) {
+    // it may be merged already
+    Node* n = get(id);
+    if (n != nullptr) {
+      n->reblance(tx_->pageSize(), *this, *tx_, tx_->rebalancePolicy());
+    }
+  }
+  unbalanced_.clear();
+
+  for (auto& e : buckets_) {
+    e.second->rebalance();
+  }
+}
+
+size_t BucketImpl::defrag(const Freelist& freelist, std::string* cursor, size_t budget, size_t limit) {
+
+  // nothing to move in an inline bucket
+  if (bucket_.rootPageID == 0) {
+    cursor->clear();
+    return 0;
+  }
+
+  auto distance = [](uint64_t a, uint64_t b) { return a > b ? a - b : b - a; };
+
+  size_t scanned = 0;
+  // the page right after the previous leaf
+  uint64_t next = 0;
+  std::vector<std::pair<std::string, uint64_t>> moves;
+
+  bool end = walkLeaves(root(), *cursor, [&](const pageOrNode& pn) {
+    if (pn.count() == 0) {
+      return true;
+    }
+    *cursor = std::string(pn.key(pn.count() - 1));
+
+    // the dirty ones are spilled next to their left siblings anyway
+    if (pn.node != nullptr) {
+      next = 0;
+      return true;
+    }
+
+    uint64_t id = pn.page->id(), count = pn.page->overflow() + 1;
+    if (next > 0 && id != next) {
+      uint64_t to = freelist.nearest(count, next);
+      if (to != 0 && distance(to, next) < distance(id, next)) {
+        moves.emplace_back(std::string(pn.key(0)), next);
+        id = to;
+      }
+    }
+    next = id + count;
+
+    return moves.size() < budget && ++scanned < limit;
+  });
+
+  if (end) {
+    cursor->clear();
+  }
+
+  for (auto& m : moves) {
+    seekNode(m.first)->allocHint(m.second);
+  }
+
+  return moves.size();
+}
+
+bool BucketImpl::nextBucket(const std::string& name, std::string* next) {
+
+  bool found = false;
+  walkLeaves(root(), name, [&](const pageOrNode& pn) {
+    for (size_t i = lowerBoundOf(pn, 0, name, order_); i < pn.count(); i++) {
+      if (order_.less(name, pn.key(i)) && (pn.flags(i) & leafPageElement::kBucketLeafFlag) != 0) {
+        *next = std::string(pn.key(i));
+        found = true;
+        return false;
+      }
+    }
+    return true;
+  });
+
+  return found;
+}
+
+// Calls 'f' with the leaves from the one containing 'from' in the key order
+// until it returns false, returns whether all the leaves are visited.
+bool BucketImpl::walkLeaves(const pageOrNode& pn, const std::string& from,
+    const std::function<bool(const pageOrNode&)>& f) {
+
+  if (pn.isLeaf()) {
+    return f(pn);
+  }
+
+  for (size_t i = childIndexOf(pn, 0, from, order_); i < pn.count(); i++) {
+    if (!walkLeaves(child(pn.pageID(i)), from, f)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// Writes the changed nodes to the dirty pages, and the headers of the changed
+// sub buckets into this bucket before spilling itself.
+void BucketImpl::spill() {
+  spillBuckets();
+  spillNodes();
+}
+
+// Writes the changed sub buckets, and their headers with the inline pages
+// of the small ones into this bucket.
+void BucketImpl::spillBuckets() {
+
+  for (auto& e : buckets_) {
+    auto child = e.second;
+    // the changed sub buckets materialize the root of the child
+    child->spillBuckets();
+    if (child->rootNode_ == nullptr) {
+      continue;
+    }
+
+    std::string page;
+    if (child->inlineable()) {
+      page = child->spillInline();
+    } else {
+      child->spillNodes();
+    }
+
+    auto& name = e.first;
+    auto& b = child->bucket_;
+    seekNode(name)->put(name, name, std::string(reinterpret_cast<char*>(&b), sizeof(b)) + page, 0,
+        child->flags());
+  }
+}
+
+// The flags of the element of the bucket in its parent.
+uint32_t BucketImpl::flags() const {
+  return leafPageElement::kBucketLeafFlag |
+      (uint32_t(order_.id()) << leafPageElement::kComparatorShift) |
+      (uint32_t(keySize_) << leafPageElement::kKeyWidthShift) |
+      (uint32_t(valueSize_) << leafPageElement::kValueWidthShift);
+}
+
+bool BucketImpl::inlineable() {
+  // the value of the bucket is not moved out of the leaf
+  return rootNode_->inlineable(tx_->pageSize(), tx_->pageSize() / 4 - sizeof(struct bucket));
+}
+
+// Returns the root page of the inline bucket.
+std::string BucketImpl::spillInline() {
+
+  std::string page;
+  rootNode_->spillInline(tx_->pageSize(), *tx_, *tx_, &page);
+  nodes_.clear();
+
+  bucket_.rootPageID = 0;
+  inlinePage_.assign((page.size() + sizeof(uint64_t) - 1) / sizeof(uint64_t), 0);
+  memcpy(inlinePage_.data(), page.data(), page.size());
+
+  return page;
+}
+
+void BucketImpl::spillNodes() {
+
+  if (rootNode_ == nullptr) {
+    return;
+  }
+
+  // the nodes except the root are released by spilling
+  rootNode_ = rootNode_->spill(tx_->pageSize(), fillPercent_, *tx_, *tx_);
+  nodes_.clear();
+
+  bucket_.rootPageID = rootNode_->pageID();
+}
+
+void BucketImpl::unload() {
+
+  for (auto& e : buckets_) {
+    e.second->unload();
+  }
+
+  // the root is the only node left by spilling
+  delete rootNode_;
+  rootNode_ = nullptr;
+  nodes_.clear();
+}
+
+// Finds the 'key' from the cached nodes or the pages, stores the flags and
+// the value into *flags and *value if 'value' is not null.
+bool BucketImpl::search(const std::string& key, uint32_t* flags, std::string* value) {
+
+  pageOrNode pn = root();
+
+  while (!pn.isLeaf()) {
+    pn = child(pn.pageID(childIndexOf(pn, 0, key, order_)));
+  }
+
+  size_t i = lowerBoundOf(pn, 0, key, order_);
+  if (i == pn.count() || pn.key(i) != key) {
+    return false;
+  }
+
+  *flags = pn.flags(i);
+  if (value != nullptr) {
+    readValue(*flags, pn.value(i), value);
+  }
+
+  return true;
+}
+
+void BucketImpl::multiGet(
+    const std::vector<std::string>& keys,
+    std::vector<std::string>* values,
+    std::vector<Status>* statuses) {
+
+  values->assign(keys.size(), std::string());
+  statuses->assign(keys.size(), Status::OK());
+
+  std::vector<size_t> sorted(keys.size());
+  for (size_t i = 0; i < sorted.size(); i++) {
+    sorted[i] = i;
+  }
+  std::stable_sort(sorted.begin(), sorted.end(),
+      [this, &keys](size_t a, size_t b) { return order_.less(keys[a], keys[b]); });
+
+  multiSearch(root(), keys, sorted.data(), sorted.data() + sorted.size(), values, statuses);
+}
+
+// Searches the sorted keys indexed by [begin, end) in the subtree of 'pn',
+// the keys falling into the same child share the descent, so every page
+// on the paths is visited once.
+void BucketImpl::multiSearch(
+    const pageOrNode& pn,
+    const std::vector<std::string>& keys,
+    const size_t* begin,
+    const size_t* end,
+    std::vector<std::string>* values,
+    std::vector<Status>* statuses) {
+
+  if (pn.isLeaf()) {
+    size_t i = 0;
+    for (auto it = begin; it != end; it++) {
+      auto& key = keys[*it];
+      i = lowerBoundOf(pn, i, key, order_);
+
+      if (i == pn.count() || pn.key(i) != key ||
+          (pn.flags(i) & leafPageElement::kBucketLeafFlag) != 0) {
+        (*statuses)[*it] = Status::notFound(key);
+        continue;
+      }
+
+      readValue(pn.flags(i), pn.value(i), &(*values)[*it]);
+    }
+    return;
+  }
+
+  size_t i = 0;
+  while (begin != end) {
+    i = childIndexOf(pn, i, keys[*begin], order_);
+
+    // the keys before the next separator belong to the same child
+    auto mid = end;
+    if (i + 1 < pn.count()) {
+      auto separator = pn.key(i + 1);
+      mid = std::lower_bound(begin, end, separator,
+          [this, &keys](size_t k, std::string_view sep) { return order_.less(keys[k], sep); });
+    }
+
+    multiSearch(child(pn.pageID(i)), keys, begin, mid, values, statuses);
+    begin = mid;
+  }
+}
+
+BucketImpl::pageOrNode BucketImpl::root() {
+
+  if (rootNode_ != nullptr) {
+    return pageOrNode{nullptr, rootNode_};
+  }
+
+  return child(bucket_.rootPageID);
+}
+
+BucketImpl::pageOrNode BucketImpl::child(uint64_t pageID) {
+
+  Node* n = get(pageID);
+  if (n != nullptr) {
+    return pageOrNode{nullptr, n};
+  }
+
+  return pageOrNode{page(pageID), nullptr};
+}
+
+Page* BucketImpl::page(uint64_t pageID) {
+
+  if (bucket_.rootPageID == 0) {
+    ASSERTM(pageID == 0, "inline bucket has only the root");
+    return reinterpret_cast<Page*>(inlinePage_.data());
+  }
+
+  return tx_->page(pageID);
+}
+
+void BucketImpl::readValue(uint32_t flags, std::string_view v, std::string* value) {
+
+  if ((flags & leafPageElement::kOverflowValueFlag) == 0) {
+    value->assign(v.data(), v.size());
+    return;
+  }
+
+  overflowValue ov;
+  memcpy(&ov, v.data(), sizeof(ov));
+  ValueReader r(tx_->page(ov.pageID), ov.size);
+  value->clear();
+  value->reserve(ov.size);
+  r.readAll(value);
+}
+
+bool BucketImpl::pageOrNode::isLeaf() const {
+  return node != nullptr ? node->isLeaf() : (page->flags() & Page::kLeafPageFlag) != 0;
+}
+
+size_t BucketImpl::pageOrNode::count() const {
+  return node != nullptr ? node->inodes().size() : page->count();
+}
+
+std::string_view BucketImpl::pageOrNode::key(size_t i) const {
+
+  if (node != nullptr) {
+    return node->inodes().key(i);
+  }
+
+  if ((page->flags() & Page::kDenseLeafPageFlag) != 0) {
+    return std::string_view(page->denseKeyOf(i), page->denseLeaf()->ksize);
+  }
+
+  if ((page->flags() & Page::kLeafPageFlag) != 0) {
+    return keyOf(page->leafPageElementOf(i));
+  }
+
+  return keyOf(page->branchPageElementOf(i));
+}
+
+uint64_t BucketImpl::pageOrNode::pageID(size_t i) const {
+  return node != nullptr ? node->inodes().pageID(i) : page->branchPageElementOf(i)->pageID;
+}
+
+uint32_t BucketImpl::pageOrNode::flags(size_t i) const {
+
+  if (node != nullptr) {
+    return node->inodes().flags(i);
+  }
+
+  return (page->flags() & Page::kDenseLeafPageFlag) != 0 ? 0 : page->leafPageElementOf(i)->flags;
+}
+
+std::string_view BucketImpl::pageOrNode::value(size_t i) const {
+
+  if (node != nullptr) {
+    return node->inodes().value(i);
+  }
+
+  if ((page->flags() & Page::kDenseLeafPageFlag) != 0) {
+    return std::string_view(page->denseValueOf(i), page->denseLeaf()->vsize);
+  }
+
+  auto e = page->leafPageElementOf(i);
+  return std::string_view(reinterpret_cast<char*>(e) + e->pos + e->ksize, e->vsize);
+}
+
+const char* BucketImpl::pageOrNode::denseKeys8() const {
+
+  if (page == nullptr || (page->flags() & Page::kDenseLeafPageFlag) == 0 ||
+      page->denseLeaf()->ksize != 8) {
+    return nullptr;
+  }
+
+  return page->denseKeyOf(0);
+}
+
+// Returns the leaf node for 'key', materializes the nodes on the path.
+Node* BucketImpl::seekNode(const std::string& key) {
+
+  Node* n = rootNode_ != nullptr ? rootNode_ : node(bucket_.rootPageID, nullptr);
+
+  while (!n->isLeaf()) {
+    size_t i = childIndexOf(pageOrNode{nullptr, n}, 0, key, order_);
+    n = node(n->inodes().pageID(i), n);
+    n->index(i);
+  }
+
+  return n;
+}
+
 }  // namespace dbwheel
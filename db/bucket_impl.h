@@ -4,34 +4,194 @@
 #define DB_BUCKET_IMPL_H_
 
 #include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <set>
 #include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
 #include "include/dbwheel/bucket.h"
+#include "include/dbwheel/db.h"
+#include "db/bloom_filter.h"
+#include "db/key_order.h"
+#include "db/node_cache.h"
 
 namespace dbwheel {
 
+class Freelist;
+class Node;
+class Page;
+class TXImpl;
+
+// The maximum length of a key.
+static const size_t kMaxKeySize = 32768;
+
+// IndexWriter collects the entries of an index in a write transaction, the
+// key of an entry is indexEntryKey of the index key and the key, and its
+// value is the key.
+struct IndexWriter {
+  std::string index;
+  const IndexKeyFunc* keyOf;
+  WriteBatch batch;
+};
+
+// The prefix of the index entries of 'indexKey', which is its length in two
+// bytes big endian followed by it, so no index key is the prefix of another.
+std::string indexEntryPrefix(const std::string& indexKey);
+// The key of the index entry of 'key' under 'indexKey'.
+std::string indexEntryKey(const std::string& indexKey, const std::string& key);
+
 // bucket represents the on-file representation of a bucket.
 // it's stored as the "value" of a bucket key. If the bucket is small enough,
 // then its root page can be stored inline in the "value", after the bucker header.
 // In the case of inline bucket, the "rootPageID" will be 0.
+// A bucket is inline if its root is a leaf without sub buckets, which is not
+// larger than a quarter of the page, it's moved to a page once it's larger.
 struct bucket {
   uint64_t rootPageID;
   uint64_t sequence; // monotonically incrementing
 };
 
-class BucketImpl : public Bucket {
-
-  class DBImpl;
+// BucketImpl reads the pages of the bucket directly, and materializes the
+// nodes from the root to the leaves when writing, which are cached until
+// spilling in the commit.
+class BucketImpl : public Bucket, public NodeCache {
 
  public:
+  // 'inlinePage' is the root page of an inline bucket.
+  BucketImpl(TXImpl* tx, const bucket& b, std::string_view inlinePage = std::string_view(),
+      const KeyOrder& order = KeyOrder());
+  ~BucketImpl();
 
   Status put(const std::string& k, const std::string& v) override;
   Status get(const std::string& k, std::string* v) override;
   Status del(const std::string& k) override;
+  uint64_t sequence() override;
+  Status setSequence(uint64_t v) override;
+  Status nextSequence(uint64_t* v) override;
+  void multiGet(
+      const std::vector<std::string>& keys,
+      std::vector<std::string>* values,
+      std::vector<Status>* statuses) override;
+  Status write(const WriteBatch& batch) override;
+  Status indexLookup(const std::string& indexKey, std::vector<std::string>* keys) override;
+  Status parallelScan(const std::string& begin, const std::string& end, int threads,
+      const ScanFunc& f, bool ordered = false) override;
+
+  Node* get(uint64_t pageID) override;
+  Node* node(uint64_t pageID, Node* parent) override;
+  void remove(uint64_t pageID) override;
+
+  // Returns the sub bucket 'name', null if not found, or its comparator
+  // is not known by the transaction.
+  BucketImpl* bucket(const std::string& name);
+  // Returns the new sub bucket 'name' ordered by 'comparator', or by the
+  // bytes if it's null. Its keys and values are of 'keySize' and 'valueSize'
+  // bytes if 'keySize' is not 0. Returns null if the key exists.
+  BucketImpl* createBucket(const std::string& name, const Comparator* comparator = nullptr,
+      uint8_t keySize = 0, uint8_t valueSize = 0);
+
+  void rebalance();
+  void spill();
+  // Drops the nodes of this bucket and its sub buckets after spilling, so
+  // they are read from the spilled pages again.
+  void unload();
+
+  // Moves at most 'budget' leaves from the one containing *cursor next to
+  // their left neighbours, if the freelist has pages closer to them, by
+  // materializing them, so they are reallocated by spilling. Scans at most
+  // 'limit' leaves, stores the key to continue from into *cursor, which is
+  // cleared at the end of the bucket. Returns the count of the moved leaves.
+  size_t defrag(const Freelist& freelist, std::string* cursor, size_t budget, size_t limit);
+  // Stores the first sub bucket after 'name' into *next, false if not found.
+  bool nextBucket(const std::string& name, std::string* next);
+
+  const struct bucket& header() const { return bucket_; }
+  // The indexes updated by the writes of this bucket.
+  void indexes(const std::vector<IndexWriter*>& writers) { indexes_ = writers; }
+  // The filter of the keys, which the puts add to.
+  void filter(const std::shared_ptr<BloomFilter>& filter) { filter_ = filter; }
+  bool changed() const { return rootNode_ != nullptr; }
+  // Calls 'f' with the keys and the values from 'from' in the key order
+  // until it returns false, skipping the sub buckets.
+  void scan(const std::string& from,
+      const std::function<bool(const std::string& k, const std::string& v)>& f);
+
+  // pageOrNode reads the cached node of a page if any, or the page itself.
+  struct pageOrNode {
+    Page* page;
+    Node* node;
+
+    bool isLeaf() const;
+    size_t count() const;
+    std::string_view key(size_t i) const;
+    uint64_t pageID(size_t i) const;
+    uint32_t flags(size_t i) const;
+    std::string_view value(size_t i) const;
+    // The array of the keys if it's a dense leaf page of the 8 byte keys, or null.
+    const char* denseKeys8() const;
+  };
+
+  // Stores the leaves into *leaves in the key order, returns the count of
+  // their entries. Only the headers of the leaves are read.
+  size_t leaves(std::vector<pageOrNode>* leaves);
 
  private:
-  bucket bucket_;
-  DBImpl* db_;
+  bool search(const std::string& key, uint32_t* flags, std::string* value);
+  void multiSearch(
+      const pageOrNode& pn,
+      const std::vector<std::string>& keys,
+      const size_t* begin,
+      const size_t* end,
+      std::vector<std::string>* values,
+      std::vector<Status>* statuses);
+  void seekLeaves(
+      Node* n,
+      const WriteBatch::Op* const* begin,
+      const WriteBatch::Op* const* end,
+      std::vector<std::pair<Node*, const WriteBatch::Op* const*>>* leaves);
+  bool walkLeaves(const pageOrNode& pn, const std::string& from,
+      const std::function<bool(const pageOrNode&)>& f);
+  bool scanRange(const std::string& begin, const std::string& end, const ScanFunc& f);
+  void splitRange(const std::string& begin, const std::string& end, size_t n,
+      std::vector<std::string>* splits);
+  void spillBuckets();
+  void spillNodes();
+  bool inlineable();
+  uint32_t flags() const;
+  std::string spillInline();
+  Page* page(uint64_t pageID);
+  pageOrNode root();
+  pageOrNode child(uint64_t pageID);
+  void readValue(uint32_t flags, std::string_view v, std::string* value);
+  Node* seekNode(const std::string& key);
+  Status indexOps(const std::string& k, const std::string* oldValue, const std::string* newValue,
+      std::vector<std::pair<IndexWriter*, WriteBatch::Op>>* ops);
+  void addIndexOps(const std::vector<std::pair<IndexWriter*, WriteBatch::Op>>& ops);
+
+  TXImpl* tx_;
+  struct bucket bucket_;
+  KeyOrder order_;
+  // the widths of a fixed width bucket, 0 if not fixed
+  uint8_t keySize_;
+  uint8_t valueSize_;
+  // the root page if the bucket is inline, which is 8 bytes aligned
+  std::vector<uint64_t> inlinePage_;
+  double fillPercent_;
+  // null if nothing changed
+  Node* rootNode_;
+  std::map<uint64_t, Node*> nodes_;
+  // the pages of the nodes deleting inodes
+  std::set<uint64_t> unbalanced_;
+  std::map<std::string, BucketImpl*> buckets_;
+  std::vector<IndexWriter*> indexes_;
+  // null if the bucket has no filter
+  std::shared_ptr<BloomFilter> filter_;
+  // the names from the root bucket, by which the writes are logged
+  std::string path_;
 };
 
 }  // namespace dbwheel
@@ -0,0 +1,479 @@
+// Copyright (c) 2020
+//
+#include "db/checker.h"
+
+#include <cstring>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include "db/bucket_impl.h"
+#include "db/meta.h"
+#include "db/page.h"
+#include "db/page_ele.h"
+#include "db/tx_impl.h"
+
+namespace dbwheel {
+
+// The subtrees queued per thread, beyond which the threads walk them by
+// themselves.
+static const size_t kQueuedTasksPerThread = 4;
+
+// The problems described in CheckStats::errors.
+static const size_t kMaxErrors = 100;
+
+Checker::Checker(TXImpl* tx, uint64_t end, int threads):
+  tx_(tx),
+  pageSize_(tx->pageSize()),
+  end_(std::min(end, tx->meta().pageID)),
+  threads_(threads),
+  checkKeys_(true),
+  noFreelist_(tx->meta().freelistPageID == kNoFreelist),
+  reached_((end_ + 63) / 64),
+  free_(end_),
+  busy_(0),
+  pages_(0),
+  doubles_(0),
+  keys_(0),
+  buckets_(0),
+  problems_(0),
+  freePages_(0),
+  leakedPages_(0) {}
+
+Checker::~Checker() {}
+
+Status Checker::run(CheckStats* stats) {
+
+  auto begin = std::chrono::steady_clock::now();
+
+  const Meta& m = tx_->meta();
+  if (end_ < m.pageID) {
+    problem(m.pageID, "is the end of the pages, the file ends at page " + std::to_string(end_));
+  }
+
+  checkFreelist();
+  walkTree();
+  checkLeaks();
+
+  if (stats != nullptr) {
+    stats->pages = pages_;
+    stats->freePages = freePages_;
+    stats->leakedPages = leakedPages_;
+    stats->doubleReferencedPages = doubles_;
+    stats->keys = keys_;
+    stats->buckets = buckets_;
+    stats->problems = problems_;
+    stats->errors = errors_;
+    stats->micros = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - begin).count();
+  }
+
+  if (problems_ > 0) {
+    return Status::dataError(std::to_string(problems_) + " problems, the first: " + errors_[0]);
+  }
+
+  return Status::OK();
+}
+
+Status Checker::unreached(std::vector<uint64_t>* ids) {
+
+  checkKeys_ = false;
+  walkTree();
+
+  if (problems_ > 0) {
+    return Status::dataError(std::to_string(problems_) + " problems, the first: " + errors_[0]);
+  }
+
+  for (uint64_t id = 2; id < end_; id++) {
+    if (((reached_[id / 64].load(std::memory_order_relaxed) >> (id % 64)) & 1) == 0) {
+      ids->push_back(id);
+    }
+  }
+
+  return Status::OK();
+}
+
+// Walks the tree of the meta by the threads.
+void Checker::walkTree() {
+
+  mark(0, 2);
+  tasks_.push_back(Task{tx_->meta().root.rootPageID, KeyOrder(), true, 0, 0, false, false, "", ""});
+
+  std::vector<std::thread> workers;
+  for (int i = 1; i < threads_; i++) {
+    workers.emplace_back(&Checker::worker, this);
+  }
+  worker();
+  for (auto& t : workers) {
+    t.join();
+  }
+}
+
+void Checker::worker() {
+
+  std::unique_lock<std::mutex> lock(mu_);
+  while (true) {
+    cv_.wait(lock, [&] { return !tasks_.empty() || busy_ == 0; });
+    // nothing is queued, and nobody walking would queue more
+    if (tasks_.empty()) {
+      break;
+    }
+
+    // the front is the highest subtree queued
+    Task t = std::move(tasks_.front());
+    tasks_.pop_front();
+    busy_++;
+    lock.unlock();
+
+    walk(t);
+
+    lock.lock();
+    busy_--;
+    if (busy_ == 0 && tasks_.empty()) {
+      cv_.notify_all();
+    }
+  }
+}
+
+bool Checker::push(const Task& t) {
+
+  std::lock_guard<std::mutex> lock(mu_);
+  if (tasks_.size() >= static_cast<size_t>(threads_) * kQueuedTasksPerThread) {
+    return false;
+  }
+
+  tasks_.push_back(t);
+  cv_.notify_one();
+
+  return true;
+}
+
+void Checker::walk(const Task& t) {
+
+  Page* p = page(t.pageID);
+  if (p != nullptr) {
+    checkNode(p, (p->overflow() + 1) * pageSize_, t);
+  }
+}
+
+// Checks the branch or leaf 'p' of 'size' bytes, which is the page of an
+// inline bucket if its id is 0.
+void Checker::checkNode(Page* p, size_t size, const Task& t) {
+
+  uint16_t flags = p->flags();
+  if (flags == Page::kBranchPageFlag) {
+    checkBranch(p, size, t);
+  } else if (flags == Page::kLeafPageFlag) {
+    checkLeaf(p, size, t);
+  } else if (flags == (Page::kLeafPageFlag | Page::kDenseLeafPageFlag)) {
+    checkDenseLeaf(p, size, t);
+  } else {
+    problem(p->id(), "has the flags " + std::to_string(flags) + " in a bucket");
+  }
+}
+
+void Checker::checkBranch(Page* p, size_t size, const Task& t) {
+
+  uint32_t count = p->count();
+  if (count == 0) {
+    problem(p->id(), "is an empty branch");
+    return;
+  }
+
+  if (Page::kPageHeaderSize + count * Page::kBranchPageElementSize > size) {
+    problem(p->id(), "has more elements than the page holds");
+    return;
+  }
+
+  std::vector<std::string_view> keys(count);
+  for (uint32_t i = 0; i < count; i++) {
+    auto e = p->branchPageElementOf(i);
+    if (Page::kPageHeaderSize + i * Page::kBranchPageElementSize + e->pos + e->ksize > size) {
+      problem(p->id(), "has the key " + std::to_string(i) + " out of the page");
+      return;
+    }
+
+    keys[i] = std::string_view(reinterpret_cast<char*>(e) + e->pos, e->ksize);
+    checkKey(p, t, i, i > 0 ? keys[i - 1] : std::string_view(), keys[i]);
+  }
+
+  // the keys of a child are from its key to the key of the next one
+  for (uint32_t i = 0; i < count; i++) {
+    Task c = t;
+    c.pageID = p->branchPageElementOf(i)->pageID;
+    c.hasLo = true;
+    c.lo = std::string(keys[i]);
+    if (i + 1 < count) {
+      c.hasHi = true;
+      c.hi = std::string(keys[i + 1]);
+    }
+
+    if (!push(c)) {
+      walk(c);
+    }
+  }
+}
+
+void Checker::checkLeaf(Page* p, size_t size, const Task& t) {
+
+  uint32_t count = p->count();
+  if (Page::kPageHeaderSize + count * Page::kLeafPageElementSize > size) {
+    problem(p->id(), "has more elements than the page holds");
+    return;
+  }
+
+  std::string_view prev;
+  for (uint32_t i = 0; i < count; i++) {
+    auto e = p->leafPageElementOf(i);
+    if (Page::kPageHeaderSize + i * Page::kLeafPageElementSize +
+        (uint64_t) e->pos + e->ksize + e->vsize > size) {
+      problem(p->id(), "has the element " + std::to_string(i) + " out of the page");
+      return;
+    }
+
+    const char* k = reinterpret_cast<char*>(e) + e->pos;
+    std::string_view key(k, e->ksize);
+    std::string_view value(k + e->ksize, e->vsize);
+    checkKey(p, t, i, prev, key);
+    prev = key;
+    keys_++;
+
+    uint32_t kind = e->flags & (leafPageElement::kBucketLeafFlag | leafPageElement::kOverflowValueFlag);
+    if (kind == leafPageElement::kBucketLeafFlag) {
+      checkBucket(p, i, e->flags, value);
+    } else if (kind == leafPageElement::kOverflowValueFlag) {
+      checkValue(p, i, value);
+    } else if (kind != 0) {
+      problem(p->id(), "has the element " + std::to_string(i) + " of a bucket and a large value");
+    }
+  }
+}
+
+void Checker::checkDenseLeaf(Page* p, size_t size, const Task& t) {
+
+  auto h = p->denseLeaf();
+  if (t.keySize == 0) {
+    problem(p->id(), "is a dense leaf of a bucket not fixed width");
+    return;
+  }
+
+  if (h->ksize != t.keySize || h->vsize != t.valueSize) {
+    problem(p->id(), "has the widths " + std::to_string(h->ksize) + "/" + std::to_string(h->vsize) +
+        " instead of " + std::to_string(t.keySize) + "/" + std::to_string(t.valueSize));
+    return;
+  }
+
+  uint32_t count = p->count();
+  if (Page::kPageHeaderSize + Page::kDenseLeafHeaderSize +
+      (uint64_t) count * (h->ksize + h->vsize) > size) {
+    problem(p->id(), "has more elements than the page holds");
+    return;
+  }
+
+  std::string_view prev;
+  for (uint32_t i = 0; i < count; i++) {
+    std::string_view key(p->denseKeyOf(i), h->ksize);
+    checkKey(p, t, i, prev, key);
+    prev = key;
+  }
+  keys_ += count;
+}
+
+// Checks the key 'i' against the previous one and the bounds of the parent.
+void Checker::checkKey(Page* p, const Task& t, uint32_t i, std::string_view prev,
+    std::string_view key) {
+
+  if (!t.ordered || !checkKeys_) {
+    return;
+  }
+
+  if (!t.order.valid(key)) {
+    problem(p->id(), "has the key " + std::to_string(i) + " invalid for the bucket");
+  } else if (i > 0 && !t.order.less(prev, key)) {
+    problem(p->id(), "has the key " + std::to_string(i) + " out of the order");
+  } else if (t.hasLo && t.order.less(key, t.lo)) {
+    problem(p->id(), "has the key " + std::to_string(i) + " below its parent key");
+  } else if (t.hasHi && !t.order.less(key, t.hi)) {
+    problem(p->id(), "has the key " + std::to_string(i) + " not below the next parent key");
+  }
+}
+
+// Checks the sub bucket of the element 'i' of 'p', whose inline page is
+// checked right away, otherwise its root is walked as a new subtree.
+void Checker::checkBucket(Page* p, uint32_t i, uint32_t flags, std::string_view value) {
+
+  if (value.size() < sizeof(bucket)) {
+    problem(p->id(), "has the bucket " + std::to_string(i) + " without the header");
+    return;
+  }
+
+  buckets_++;
+  struct bucket b;
+  memcpy(&b, value.data(), sizeof(b));
+
+  uint8_t id = (flags & leafPageElement::kComparatorMask) >> leafPageElement::kComparatorShift;
+  const Comparator* comparator = tx_->comparator(id);
+  Task t{b.rootPageID, KeyOrder(comparator), comparator != nullptr,
+      static_cast<uint8_t>(flags >> leafPageElement::kKeyWidthShift),
+      static_cast<uint8_t>(flags >> leafPageElement::kValueWidthShift), false, false, "", ""};
+
+  if (b.rootPageID != 0) {
+    if (!push(t)) {
+      walk(t);
+    }
+    return;
+  }
+
+  size_t size = value.size() - sizeof(b);
+  if (size < Page::kPageHeaderSize) {
+    problem(p->id(), "has the inline bucket " + std::to_string(i) + " without the page");
+    return;
+  }
+
+  // the inline page is accessed by the aligned fields
+  std::vector<uint64_t> inlinePage((size + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+  memcpy(inlinePage.data(), value.data() + sizeof(b), size);
+  checkNode(reinterpret_cast<Page*>(inlinePage.data()), size, t);
+}
+
+// Checks the extent of the large value of the element 'i' of 'p'.
+void Checker::checkValue(Page* p, uint32_t i, std::string_view value) {
+
+  if (value.size() != sizeof(overflowValue)) {
+    problem(p->id(), "has the large value " + std::to_string(i) + " of " +
+        std::to_string(value.size()) + " bytes");
+    return;
+  }
+
+  overflowValue ov;
+  memcpy(&ov, value.data(), sizeof(ov));
+  Page* v = page(ov.pageID);
+  if (v == nullptr) {
+    return;
+  }
+
+  if (v->flags() != Page::kValuePageFlag) {
+    problem(v->id(), "has the flags " + std::to_string(v->flags()) + " for a large value");
+  } else if (Page::kPageHeaderSize + ov.size > (v->overflow() + 1) * pageSize_) {
+    problem(v->id(), "is shorter than its value of " + std::to_string(ov.size) + " bytes");
+  }
+}
+
+void Checker::checkFreelist() {
+
+  uint64_t id = tx_->meta().freelistPageID;
+  if (noFreelist_) {
+    return;
+  }
+
+  Page* p = page(id);
+  if (p == nullptr) {
+    return;
+  }
+
+  if (p->flags() != Page::kFreeListPageFlag) {
+    problem(id, "has the flags " + std::to_string(p->flags()) + " for the freelist");
+    return;
+  }
+
+  auto ids = reinterpret_cast<uint64_t*>(p->ptr_);
+  uint64_t count = p->count();
+  if (count == 0xFFFF) {
+    count = ids[0];
+    ids++;
+  }
+
+  uint64_t size = (p->overflow() + 1) * pageSize_;
+  if (Page::kPageHeaderSize + (count + (ids != reinterpret_cast<uint64_t*>(p->ptr_))) *
+      sizeof(uint64_t) > size) {
+    problem(id, "has more free pages than the page holds");
+    return;
+  }
+
+  uint64_t pageID = tx_->meta().pageID;
+  for (uint64_t i = 0; i < count; i++) {
+    if (ids[i] < 2 || ids[i] >= pageID) {
+      problem(id, "frees the page " + std::to_string(ids[i]) + " out of the file");
+    } else if (ids[i] >= end_) {
+      // past the end of the file, reported already
+    } else if (free_[ids[i]]) {
+      problem(id, "frees the page " + std::to_string(ids[i]) + " twice");
+    } else {
+      free_[ids[i]] = true;
+      freePages_++;
+    }
+  }
+}
+
+// Finds the pages reached and free, or neither.
+void Checker::checkLeaks() {
+
+  for (uint64_t id = 2; id < end_; id++) {
+    bool reached = (reached_[id / 64].load(std::memory_order_relaxed) >> (id % 64)) & 1;
+    if (reached && free_[id]) {
+      doubles_++;
+      problem(id, "is reached and free");
+    } else if (!reached && noFreelist_) {
+      freePages_++;
+    } else if (!reached && !free_[id]) {
+      leakedPages_++;
+      problem(id, "is neither reached nor free");
+    }
+  }
+}
+
+Page* Checker::page(uint64_t pageID) {
+
+  if (pageID < 2 || pageID >= end_) {
+    problem(pageID, "is pointed to out of the file");
+    return nullptr;
+  }
+
+  Page* p = tx_->page(pageID);
+  if (p->id() != pageID) {
+    problem(pageID, "has the id " + std::to_string(p->id()));
+    return nullptr;
+  }
+
+  if (pageID + p->overflow() >= end_) {
+    problem(pageID, "overflows the file by " + std::to_string(p->overflow()) + " pages");
+    return nullptr;
+  }
+
+  // a page reached again is not walked again, which stops the cycles
+  return mark(pageID, p->overflow() + 1) ? p : nullptr;
+}
+
+// Marks 'count' pages from 'pageID' reached, returns false if any of them
+// is reached before.
+bool Checker::mark(uint64_t pageID, uint64_t count) {
+
+  uint64_t again = 0;
+  for (uint64_t id = pageID; id < pageID + count; id++) {
+    uint64_t bit = uint64_t(1) << (id % 64);
+    if ((reached_[id / 64].fetch_or(bit, std::memory_order_relaxed) & bit) != 0) {
+      again++;
+    }
+  }
+
+  pages_ += count - again;
+  if (again > 0) {
+    doubles_ += again;
+    problem(pageID, "is reached more than once");
+    return false;
+  }
+
+  return true;
+}
+
+void Checker::problem(uint64_t pageID, const std::string& msg) {
+
+  problems_++;
+  std::lock_guard<std::mutex> lock(mu_);
+  if (errors_.size() < kMaxErrors) {
+    errors_.push_back("page " + std::to_string(pageID) + " " + msg);
+  }
+}
+
+}  // namespace dbwheel
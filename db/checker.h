@@ -0,0 +1,108 @@
+// Copyright (c) 2020
+//
+#ifndef DB_CHECKER_H_
+#define DB_CHECKER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "include/dbwheel/stats.h"
+#include "include/dbwheel/status.h"
+#include "db/key_order.h"
+
+namespace dbwheel {
+
+class Page;
+class TXImpl;
+
+// Checker verifies the snapshot of a read transaction. The subtrees are
+// tasks of a shared queue, which the threads take from its front, and
+// split further while it's short. Every page reached is marked in a bitmap,
+// which finds the pages reached twice, and the pages neither reached nor in
+// the freelist once the tree is walked.
+class Checker {
+ public:
+  // The pages from 'end' are not in the file, which is reported if they are
+  // below the end of the pages of the meta.
+  Checker(TXImpl* tx, uint64_t end, int threads);
+  ~Checker();
+
+  Status run(CheckStats* stats);
+  // Stores the sorted pages not reached from the meta into *ids without
+  // checking the keys, returns a data error if the tree is broken.
+  Status unreached(std::vector<uint64_t>* ids);
+
+ private:
+  // A subtree, whose keys are not below 'lo' if 'hasLo', and below 'hi' if
+  // 'hasHi'.
+  struct Task {
+    uint64_t pageID;
+    KeyOrder order;
+    // false if the comparator of the bucket is not known
+    bool ordered;
+    // the widths of a fixed width bucket, 0 if not fixed
+    uint8_t keySize;
+    uint8_t valueSize;
+    bool hasLo;
+    bool hasHi;
+    std::string lo;
+    std::string hi;
+  };
+
+  void walkTree();
+  void worker();
+  // Queues 't' unless the queue is long enough, returns false if not queued.
+  bool push(const Task& t);
+  void walk(const Task& t);
+  void checkNode(Page* p, size_t size, const Task& t);
+  void checkBranch(Page* p, size_t size, const Task& t);
+  void checkLeaf(Page* p, size_t size, const Task& t);
+  void checkDenseLeaf(Page* p, size_t size, const Task& t);
+  void checkKey(Page* p, const Task& t, uint32_t i, std::string_view prev, std::string_view key);
+  void checkBucket(Page* p, uint32_t i, uint32_t flags, std::string_view value);
+  void checkValue(Page* p, uint32_t i, std::string_view value);
+  void checkFreelist();
+  void checkLeaks();
+  // Returns the page 'pageID' after marking its extent, null if it's out of
+  // the file or reached before.
+  Page* page(uint64_t pageID);
+  bool mark(uint64_t pageID, uint64_t count);
+  void problem(uint64_t pageID, const std::string& msg);
+
+  TXImpl* tx_;
+  size_t pageSize_;
+  uint64_t end_;
+  int threads_;
+  bool checkKeys_;
+  // set if the meta has no freelist, whose free pages are the ones not reached
+  bool noFreelist_;
+  // a bit per page reached
+  std::vector<std::atomic<uint64_t>> reached_;
+  std::vector<bool> free_;
+
+  // protects the fields below
+  std::mutex mu_;
+  std::condition_variable cv_;
+  std::deque<Task> tasks_;
+  // the threads walking a task
+  int busy_;
+  std::vector<std::string> errors_;
+
+  std::atomic<uint64_t> pages_;
+  std::atomic<uint64_t> doubles_;
+  std::atomic<uint64_t> keys_;
+  std::atomic<uint64_t> buckets_;
+  std::atomic<uint64_t> problems_;
+  uint64_t freePages_;
+  uint64_t leakedPages_;
+};
+
+}  // namespace dbwheel
+
+#endif  // DB_CHECKER_H_
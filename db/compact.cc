@@ -0,0 +1,323 @@
+// Copyright (c) 2020
+//
+#include "db/compact.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <algorithm>
+#include <chrono>
+
+#include <unistd.h>
+
+#include "db/bucket_impl.h"
+#include "db/inode.h"
+#include "db/meta.h"
+#include "db/node.h"
+#include "db/page.h"
+#include "db/page_ele.h"
+#include "db/tx_impl.h"
+#include "db/value_reader.h"
+
+namespace dbwheel {
+
+// The pages are written when the buffer is larger than this.
+static const size_t kWriteBufferSize = 4 << 20;
+
+// The size of the chunk of a large value written at a time.
+static const size_t kValueChunkSize = 1 << 20;
+
+static Status writeAll(int fd, const char* buf, size_t size, off_t offset) {
+
+  while (size > 0) {
+    ssize_t n = pwrite(fd, buf, size, offset);
+    if (n == -1) {
+      return Status::ioError(strerror(errno));
+    }
+
+    buf += n;
+    size -= n;
+    offset += n;
+  }
+
+  return Status::OK();
+}
+
+Compactor::Compactor(TXImpl* tx, int fd, double fillPercent):
+  tx_(tx),
+  fd_(fd),
+  pageSize_(tx->pageSize()),
+  fillPercent_(fillPercent),
+  status_(Status::OK()),
+  // the meta pages and the freelist page are written at last
+  firstID_(3),
+  nextID_(3) {}
+
+Compactor::~Compactor() {}
+
+Status Compactor::run(CompactStats* stats) {
+
+  auto begin = std::chrono::steady_clock::now();
+
+  const Meta& src = tx_->meta();
+  std::string root = compact(src.root, tx_->page(src.root.rootPageID), true, 0);
+  if (status_.ok()) {
+    status_ = flushBuffer();
+  }
+
+  if (!status_.ok()) {
+    return status_;
+  }
+
+  // the data is durable before the meta pointing to it
+  if (ftruncate(fd_, nextID_ * pageSize_) == -1 || fsync(fd_) == -1) {
+    return Status::ioError(strerror(errno));
+  }
+
+  Meta m = src;
+  memcpy(&m.root, root.data(), sizeof(m.root));
+  m.freelistPageID = 2;
+  m.pageID = nextID_;
+
+  std::vector<char> buf(pageSize_ * 3);
+  for (uint64_t i = 0; i < 2; i++) {
+    Page* p = new (buf.data() + i * pageSize_) Page{i, static_cast<uint16_t>(Page::kMetaPageFlag)};
+    *p->meta() = m;
+    p->meta()->calcChecksum();
+  }
+  new (buf.data() + 2 * pageSize_) Page{2, static_cast<uint16_t>(Page::kFreeListPageFlag)};
+
+  Status s = writeAll(fd_, buf.data(), buf.size(), 0);
+  if (!s.ok()) {
+    return s;
+  }
+
+  if (fsync(fd_) == -1) {
+    return Status::ioError(strerror(errno));
+  }
+
+  if (stats != nullptr) {
+    stats->dstSize = nextID_ * pageSize_;
+    stats->pages = nextID_;
+    stats->micros = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - begin).count();
+  }
+
+  return Status::OK();
+}
+
+size_t Compactor::headerSize(Node* n) {
+  return Page::kPageHeaderSize + (n->isLeaf() && n->keySize() > 0 ? Page::kDenseLeafHeaderSize : 0);
+}
+
+// Rewrites the bucket 'b' whose root page is 'root', returns its new value,
+// which is the header followed by the root page if it's small enough to be
+// inline, and it's not the root bucket of the database. 'flags' are of the
+// element of the bucket in its parent.
+std::string Compactor::compact(const bucket& b, Page* root, bool isRoot, uint32_t flags) {
+
+  // the leaves of a fixed width bucket stay dense
+  Node* leaf = new Node(nullptr, 0, true);
+  leaf->fixedWidth((flags >> leafPageElement::kKeyWidthShift) & 0xff,
+      (flags >> leafPageElement::kValueWidthShift) & 0xff);
+
+  std::vector<Level> levels{Level{leaf, headerSize(leaf), 0}};
+  walk(root, &levels);
+
+  struct bucket h{0, b.sequence};
+  std::string page;
+  for (size_t l = 0; status_.ok(); l++) {
+    // the only node of the top level is the root
+    if (levels[l].pages == 0 && l + 1 == levels.size()) {
+      Node* n = levels[l].node;
+      if (!isRoot && l == 0 && n->inlineable(pageSize_, pageSize_ / 4 - sizeof(h))) {
+        n->spillInline(pageSize_, *this, *this, &page);
+      } else {
+        h.rootPageID = write(levels[l]);
+      }
+      break;
+    }
+
+    flush(&levels, l);
+  }
+
+  for (auto& level : levels) {
+    delete level.node;
+  }
+
+  return std::string(reinterpret_cast<char*>(&h), sizeof(h)) + page;
+}
+
+// Adds the elements of the leaves under 'p' in the key order.
+void Compactor::walk(Page* p, std::vector<Level>* levels) {
+
+  if ((p->flags() & Page::kBranchPageFlag) != 0) {
+    for (uint32_t i = 0; i < p->count() && status_.ok(); i++) {
+      walk(tx_->page(p->branchPageElementOf(i)->pageID), levels);
+    }
+    return;
+  }
+
+  if ((p->flags() & Page::kDenseLeafPageFlag) != 0) {
+    auto h = p->denseLeaf();
+    for (uint32_t i = 0; i < p->count() && status_.ok(); i++) {
+      add(levels, 0, std::string(p->denseKeyOf(i), h->ksize),
+          std::string(p->denseValueOf(i), h->vsize), 0, 0);
+    }
+    return;
+  }
+
+  for (uint32_t i = 0; i < p->count() && status_.ok(); i++) {
+    auto e = p->leafPageElementOf(i);
+    std::string key = e->key();
+
+    if ((e->flags & leafPageElement::kBucketLeafFlag) != 0) {
+      std::string value = e->value();
+      struct bucket b;
+      memcpy(&b, value.data(), sizeof(b));
+
+      // the inline page is accessed by the aligned fields
+      std::vector<uint64_t> inlinePage;
+      Page* root;
+      if (b.rootPageID == 0) {
+        inlinePage.resize((value.size() - sizeof(b) + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+        memcpy(inlinePage.data(), value.data() + sizeof(b), value.size() - sizeof(b));
+        root = reinterpret_cast<Page*>(inlinePage.data());
+      } else {
+        root = tx_->page(b.rootPageID);
+      }
+
+      add(levels, 0, key, compact(b, root, false, e->flags), 0, e->flags);
+      continue;
+    }
+
+    if ((e->flags & leafPageElement::kOverflowValueFlag) != 0) {
+      overflowValue ov;
+      memcpy(&ov, reinterpret_cast<char*>(e) + e->pos + e->ksize, sizeof(ov));
+      ov.pageID = copyValue(tx_->page(ov.pageID), ov.size);
+      add(levels, 0, key, std::string(reinterpret_cast<char*>(&ov), sizeof(ov)), 0, e->flags);
+      continue;
+    }
+
+    add(levels, 0, key, e->value(), 0, e->flags);
+  }
+}
+
+// Appends the element to the node of 'level', writes the node first if the
+// element would fill it over the fill percent.
+void Compactor::add(std::vector<Level>* levels, size_t level, const std::string& key,
+    const std::string& value, uint64_t pageID, uint32_t flags) {
+
+  bool isLeaf = level == 0;
+  if (levels->size() == level) {
+    levels->push_back(Level{new Node(nullptr, 0, isLeaf), Page::kPageHeaderSize, 0});
+  }
+
+  bool dense = isLeaf && (*levels)[0].node->keySize() > 0;
+  size_t sz = (isLeaf ? (dense ? 0 : Page::kLeafPageElementSize) : Page::kBranchPageElementSize) +
+      key.size() + value.size();
+  if ((*levels)[level].size + sz > fillPercent_ * pageSize_ &&
+      (size_t) (*levels)[level].node->count() >= Page::kMinKeys) {
+    flush(levels, level);
+  }
+
+  // the levels may be reallocated by flushing
+  Level& l = (*levels)[level];
+  // the keys come in the order of the bucket, which may not be the bytewise one
+  l.node->append(key, value, pageID, flags);
+  l.size += sz;
+}
+
+// Writes the node of 'level' and adds it to the upper level.
+void Compactor::flush(std::vector<Level>* levels, size_t level) {
+
+  Level& l = (*levels)[level];
+  if (l.node->count() == 0) {
+    return;
+  }
+
+  uint64_t pageID = write(l);
+  std::string key(l.node->inodes().key(0));
+  bool isLeaf = l.node->isLeaf();
+
+  Node* n = new Node(nullptr, 0, isLeaf);
+  n->fixedWidth(l.node->keySize(), l.node->valueSize());
+  delete l.node;
+  l.node = n;
+  l.size = headerSize(n);
+  l.pages++;
+
+  add(levels, level + 1, key, "", pageID, 0);
+}
+
+uint64_t Compactor::write(const Level& level) {
+
+  Page* p = alloc(pageSize_, (level.size + pageSize_ - 1) / pageSize_);
+  uint64_t pageID = p->id();
+  level.node->writePage(p);
+  p->id(pageID);
+
+  return pageID;
+}
+
+Page* Compactor::alloc(size_t sz, size_t count) {
+
+  if (!buf_.empty() && buf_.size() + sz * count > kWriteBufferSize) {
+    Status s = flushBuffer();
+    if (!s.ok()) {
+      status_ = s;
+    }
+  }
+
+  size_t offset = buf_.size();
+  buf_.resize(offset + sz * count);
+
+  Page* p = new (buf_.data() + offset) Page(nextID_, static_cast<uint32_t>(count - 1));
+  nextID_ += count;
+
+  return p;
+}
+
+// Writes the value of 'size' bytes in the value pages from 'p' to the new
+// extent straight from the mmap, returns its first page.
+uint64_t Compactor::copyValue(Page* p, uint64_t size) {
+
+  status_ = flushBuffer();
+  if (!status_.ok()) {
+    return 0;
+  }
+
+  uint64_t count = (Page::kPageHeaderSize + size + pageSize_ - 1) / pageSize_;
+  uint64_t pageID = nextID_;
+  nextID_ += count;
+  firstID_ = nextID_;
+
+  Page header(pageID, static_cast<uint32_t>(count - 1));
+  header.flags(Page::kValuePageFlag);
+  header.count(0);
+
+  off_t offset = pageID * pageSize_;
+  status_ = writeAll(fd_, reinterpret_cast<char*>(&header), Page::kPageHeaderSize, offset);
+  offset += Page::kPageHeaderSize;
+
+  ValueReader r(p, size);
+  const char* data;
+  size_t n;
+  while (status_.ok() && (n = r.next(kValueChunkSize, &data)) > 0) {
+    status_ = writeAll(fd_, data, n, offset);
+    offset += n;
+  }
+
+  return pageID;
+}
+
+Status Compactor::flushBuffer() {
+
+  Status s = writeAll(fd_, buf_.data(), buf_.size(), firstID_ * pageSize_);
+  buf_.clear();
+  firstID_ = nextID_;
+
+  return s;
+}
+
+}  // namespace dbwheel
@@ -0,0 +1,72 @@
+// Copyright (c) 2020
+//
+#ifndef DB_COMPACT_H_
+#define DB_COMPACT_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "include/dbwheel/stats.h"
+#include "include/dbwheel/status.h"
+#include "db/page_alloc.h"
+#include "db/page_free.h"
+
+namespace dbwheel {
+
+class Node;
+class Page;
+class TXImpl;
+struct bucket;
+
+// Compactor rewrites the snapshot of a read transaction into a new file.
+// Every bucket is built bottom-up from its elements in the key order, the
+// pages are appended to the file as soon as they are full, so only one page
+// per level of the buckets being built is kept in the memory, and the large
+// values are streamed from the mmap.
+class Compactor : public PageAlloc, public PageFree {
+ public:
+  Compactor(TXImpl* tx, int fd, double fillPercent);
+  ~Compactor();
+
+  Status run(CompactStats* stats);
+
+  // Appends the pages to the write buffer.
+  Page* alloc(size_t sz, size_t count) override;
+  // Nothing is freed in the new file.
+  void free(uint64_t /*pageID*/) override {}
+
+ private:
+  // The nodes being built of a bucket from the leaves up.
+  struct Level {
+    Node* node;
+    size_t size;
+    // pages written in the level
+    uint64_t pages;
+  };
+
+  // The size of the page header of the level of 'n'.
+  static size_t headerSize(Node* n);
+  std::string compact(const bucket& b, Page* root, bool isRoot, uint32_t flags);
+  void walk(Page* p, std::vector<Level>* levels);
+  void add(std::vector<Level>* levels, size_t level, const std::string& key,
+      const std::string& value, uint64_t pageID, uint32_t flags);
+  void flush(std::vector<Level>* levels, size_t level);
+  uint64_t write(const Level& level);
+  uint64_t copyValue(Page* p, uint64_t size);
+  Status flushBuffer();
+
+  TXImpl* tx_;
+  int fd_;
+  size_t pageSize_;
+  double fillPercent_;
+  Status status_;
+  // the pages not written yet, from firstID_
+  std::vector<char> buf_;
+  uint64_t firstID_;
+  uint64_t nextID_;
+};
+
+}  // namespace dbwheel
+
+#endif  // DB_COMPACT_H_
@@ -3,20 +3,32 @@
 
 #include "db/db_impl.h"
 
+#include <algorithm>
 #include <cerrno>
 #include <cstdio>
 #include <cstring>
 
+#include <chrono>
+#include <thread>
+
 #include <fcntl.h>
 #include <sys/file.h>
 #include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "include/dbwheel/bucket.h"
+#include "include/dbwheel/tx.h"
+#include "db/checker.h"
+#include "db/compact.h"
 #include "db/crc32c.h"
 #include "db/bucket_impl.h"
+#include "db/meta.h"
 #include "db/page.h"
+#include "db/statistics.h"
+#include "db/tx_impl.h"
 
 namespace dbwheel {
 
@@ -35,28 +47,31 @@ static const uint64_t kMaxMapSize = 0xFFFFFFFFFFFF;
 // The size creating array pointer.
 static const uint64_t kMaxAllocSize = 0x7FFFFFFF;
 
-// The largest step that can be token when remapping the mmap.
-static const uint32_t kMaxMapStep = 1 << 30;
+// The largest step that can be token when remapping the mmap, unless
+// Options::mmapGrowthStep says otherwise.
+static const uint64_t kMaxMapStep = 1 << 30;
+
+// The size of the chunk copied at a time by backupTo.
+static const uint64_t kBackupChunkSize = 4 << 20;
+
+// The number of the ids reserved at a time by nextSequence.
+static const uint64_t kSequenceLeaseSize = 1024;
+
+// The pages kept in the memory in the wal mode before checkpointing, unless
+// Options::walCheckpointPages says otherwise.
+static const uint64_t kWalCheckpointPages = 4096;
+
+// The interval of Options::kSyncPeriodic, unless Options::syncIntervalMs says
+// otherwise.
+static const uint64_t kSyncIntervalMs = 100;
+
+// The file is extended by this much at a time for Options::writableMmap.
+static const uint64_t kMappedGrowthChunk = 16 << 20;
 
 inline static Status ioError() {
     return Status::ioError(strerror(errno));
 }
 
-struct Meta {
-  uint32_t magic;
-  uint32_t version;
-  uint32_t pageSize;
-  uint32_t flags;
-  bucket root;
-  uint64_t freelistPageID;
-  uint64_t pageID;
-  uint64_t txID;
-  uint64_t checksum;
-
-  void calcChecksum();
-  bool validate();
-};
-
 void Meta::calcChecksum() {
 
     checksum = crc32c::Value(
@@ -88,14 +103,118 @@ Status DB::open(const Options& options, const std::string& dbname, DB** dbptr) {
   return s;
 }
 
+Status DB::compact(const std::string& src, const std::string& dst,
+    double fillPercent, CompactStats* stats) {
+
+  if (fillPercent <= 0) {
+    fillPercent = 1.0;
+  }
+  fillPercent = std::min(std::max(fillPercent, 0.1), 1.0);
+
+  Options options{};
+  options.readOnly = true;
+  DB* db;
+  Status s = DB::open(options, src, &db);
+  if (!s.ok()) {
+    return s;
+  }
+
+  int fd = openFileFunc(dst.data(), O_CREAT|O_TRUNC|O_RDWR, S_IROTH|S_IRGRP|S_IRUSR|S_IWUSR);
+  if (fd == -1) {
+    s = ioError();
+  } else {
+    s = static_cast<DBImpl*>(db)->compactTo(fd, fillPercent, stats);
+    if (closeFileFunc(fd) == -1 && s.ok()) {
+      s = ioError();
+    }
+  }
+
+  struct stat sb;
+  if (s.ok() && stats != nullptr && stat(src.data(), &sb) == 0) {
+    stats->srcSize = sb.st_size;
+  }
+
+  Status cs = db->close();
+  delete db;
+
+  return s.ok() ? cs : s;
+}
+
+Status DB::check(const Options& options, const std::string& path, int metaPage,
+    int threads, CheckStats* stats) {
+
+  if (metaPage < -1 || metaPage > 1) {
+    return Status::invalidArgument("no meta page " + std::to_string(metaPage));
+  }
+
+  if (threads <= 0) {
+    threads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+  }
+
+  Options o = options;
+  o.readOnly = true;
+  DB* db;
+  Status s = DB::open(o, path, &db);
+  if (!s.ok()) {
+    return s;
+  }
+
+  s = static_cast<DBImpl*>(db)->checkTo(metaPage, threads, stats);
+
+  Status cs = db->close();
+  delete db;
+
+  return s.ok() ? cs : s;
+}
+
+DBImpl::DBImpl(const Options& options, const std::string& dbname):
+  name_(dbname),
+  options_(options),
+  open_(true),
+  fd_(-1),
+  lockFd_(-1),
+  data_(nullptr),
+  dataSize_(0),
+  mmapStep_(options.mmapGrowthStep > 0 ? options.mmapGrowthStep : kMaxMapStep),
+  stats_(options.enableStatistics ? new Statistics() : nullptr),
+  deferMeta_(false),
+  latestMeta_{},
+  fileTxID_(0) {
+
+  if (options.rebalanceLowWatermark > 0) {
+    rebalancePolicy_.lowWatermark = options.rebalanceLowWatermark;
+  }
+
+  if (options.rebalanceHighWatermark > 0) {
+    rebalancePolicy_.highWatermark = options.rebalanceHighWatermark;
+  }
+
+  rebalancePolicy_.highWatermark = std::max(
+      rebalancePolicy_.highWatermark, rebalancePolicy_.lowWatermark * 2);
+}
+
 Status DBImpl::open() {
 
+  StatisticsScope scope(stats_);
+
+  if (options_.walMode && options_.multiProcess) {
+    return Status::invalidArgument("wal mode with multiple processes");
+  }
+
+  if (options_.syncMode == Options::kSyncPeriodic && options_.multiProcess) {
+    return Status::invalidArgument("periodic sync with multiple processes");
+  }
+
+  if (options_.writableMmap && options_.walMode) {
+    return Status::invalidArgument("writable mmap in wal mode");
+  }
+
   Status status = openFile();
   if (!status.ok()) {
     return status;
   }
 
-  status = mmapFile();
+  status = mmapFile(options_.initialMmapSize);
   if (!status.ok()) {
     return status;
   }
@@ -105,9 +224,198 @@ Status DBImpl::open() {
     return status;
   }
 
+  if (options_.readOnly) {
+    return Status::OK();
+  }
+
+  status = readFreelist();
+  if (!status.ok()) {
+    return status;
+  }
+
+  if (table_ != nullptr) {
+    table_->commit(meta()->txID);
+  }
+
+  if (options_.fileGrowthChunk > 0) {
+    struct stat sb;
+    if (fstat(fd_, &sb) == -1) {
+      return ioError();
+    }
+
+    preallocator_.reset(new Preallocator(fd_, options_.fileGrowthChunk, sb.st_size, stats_));
+    preallocator_->reserve(meta()->pageID * pageSize_);
+  }
+
+  if (options_.walMode || options_.syncMode == Options::kSyncPeriodic) {
+    latestMeta_ = *fileMeta();
+    fileTxID_ = latestMeta_.txID;
+    deferMeta_ = true;
+  }
+
+  if (options_.walMode) {
+    status = recover();
+    if (!status.ok()) {
+      return status;
+    }
+  }
+
+  if (options_.syncMode == Options::kSyncPeriodic) {
+    syncer_.reset(new Syncer([this] { return wal_ != nullptr ? wal_->sync() : syncMeta(); },
+        options_.syncIntervalMs > 0 ? options_.syncIntervalMs : kSyncIntervalMs,
+        options_.syncBytes, stats_));
+  }
+
+  return Status::OK();
+}
+
+// Reads the freelist of the meta, or finds the pages not reached from the
+// meta if it has none.
+Status DBImpl::readFreelist() {
+
+  Meta m = *meta();
+  if (m.freelistPageID != kNoFreelist) {
+    freelist_.read(page(m.freelistPageID));
+    return Status::OK();
+  }
+
+  struct stat sb;
+  if (fstat(fd_, &sb) == -1) {
+    return ioError();
+  }
+
+  TXImpl tx(this, m);
+  Checker checker(&tx, std::min(static_cast<uint64_t>(sb.st_size), dataSize_) / pageSize_,
+      std::max(1, static_cast<int>(std::thread::hardware_concurrency())));
+  std::vector<uint64_t> ids;
+  Status s = checker.unreached(&ids);
+  if (!s.ok()) {
+    return s;
+  }
+
+  freelist_.assign(std::move(ids));
+
   return Status::OK();
 }
 
+// Replays the log of the wal mode over the file, and checkpoints the result,
+// a read only database reads the file without the log.
+Status DBImpl::recover() {
+
+  wal_.reset(new Wal());
+  Status s = wal_->open(name_ + "-wal");
+  if (!s.ok()) {
+    return s;
+  }
+
+  s = wal_->replay(fileTxID_, [this](uint64_t txID, std::string_view ops) {
+    TXImpl tx(this, true);
+    Status rs = tx.replay(txID, ops);
+    if (rs.ok()) {
+      rs = tx.commit();
+    }
+    if (!rs.ok()) {
+      tx.rollback();
+    }
+    return rs;
+  });
+  if (!s.ok()) {
+    return s;
+  }
+
+  // drops the records of the checkpoint, or the torn one
+  return latestMeta_.txID != fileTxID_ ? checkpoint() : wal_->truncate();
+}
+
+// Writes the pages committed since the last checkpoint to the file, except
+// the freed ones, in the order of the ids, with the freelist, and then the
+// meta of the latest commit into the other meta page than the one of the
+// last checkpoint, so the file stays consistent if it fails. The records of
+// the log are dropped once they are in the file. Waits for the read
+// transactions, which may be reading the pages in the memory, so it's called
+// with rwlock_ held.
+Status DBImpl::checkpoint() {
+
+  if (latestMeta_.txID == fileTxID_) {
+    return Status::OK();
+  }
+
+  Meta m = latestMeta_;
+  Status s = writeFreelist(&m);
+  if (!s.ok()) {
+    return s;
+  }
+
+  std::vector<uint64_t> ids;
+  ids.reserve(overlay_.size());
+  for (auto& e : overlay_) {
+    ids.push_back(e.first);
+  }
+  std::sort(ids.begin(), ids.end());
+
+  auto freed = freelist_.pending();
+  uint64_t written = 0, pages = 0;
+  for (auto id : ids) {
+    if (std::binary_search(freed.begin(), freed.end(), id)) {
+      continue;
+    }
+
+    Page* p = overlay_[id];
+    const char* buf = reinterpret_cast<char*>(p);
+    size_t sz = (p->overflow() + 1) * pageSize_;
+    off_t offset = id * pageSize_;
+    pages += p->overflow() + 1;
+
+    while (sz > 0) {
+      ssize_t n = pwrite(fd_, buf, sz, offset);
+      if (n == -1) {
+        return ioError();
+      }
+
+      buf += n;
+      sz -= n;
+      offset += n;
+      written += n;
+    }
+  }
+
+  recordTick(DBStats::kBytesWritten, written);
+  recordTick(DBStats::kCheckpointPages, pages);
+
+  s = sync(fd_);
+  if (!s.ok()) {
+    return s;
+  }
+
+  s = writeMeta(m, nextMetaPageID());
+  if (!s.ok()) {
+    return s;
+  }
+  fileTxID_ = m.txID;
+  recordTick(DBStats::kCheckpoints);
+
+  std::unordered_map<uint64_t, Page*> overlay;
+  {
+    std::unique_lock<std::shared_mutex> mmapLock(mmapLock_);
+    std::lock_guard<std::shared_mutex> lock(overlayLock_);
+    overlay.swap(overlay_);
+  }
+
+  for (auto& e : overlay) {
+    delete [] reinterpret_cast<char*>(e.second);
+  }
+
+  return wal_->truncate();
+}
+
+Page* DBImpl::overlayPage(uint64_t pageID) {
+
+  std::shared_lock<std::shared_mutex> lock(overlayLock_);
+  auto it = overlay_.find(pageID);
+
+  return it != overlay_.end() ? it->second : nullptr;
+}
+
 Status DBImpl::openFile() {
 
   int flags = O_RDWR;
@@ -121,8 +429,17 @@ Status DBImpl::openFile() {
     return ioError();
   }
 
+  if (options_.multiProcess) {
+    table_.reset(new ReaderTable());
+    Status s = table_->open(name_ + "-lock", !options_.readOnly);
+    if (!s.ok()) {
+      return s;
+    }
+  }
+
+  // the writer of the multiple processes is locked out by the reader table
   flags = LOCK_EX;
-  if (options_.readOnly) {
+  if (options_.readOnly || options_.multiProcess) {
     flags = LOCK_SH;
   }
 
@@ -130,6 +447,22 @@ Status DBImpl::openFile() {
     return ioError();
   }
 
+  // a reader out of the reader table holds the table file shared if there is
+  // one, which the writer of the multiple processes holds exclusively, or it
+  // would reuse the pages read
+  if (options_.readOnly && !options_.multiProcess) {
+    lockFd_ = ::open((name_ + "-lock").data(), O_RDONLY);
+    if (lockFd_ == -1 && errno != ENOENT && errno != EACCES) {
+      return ioError();
+    }
+    if (lockFd_ != -1 && flock(lockFd_, LOCK_SH | LOCK_NB) == -1) {
+      Status s = ioError();
+      ::close(lockFd_);
+      lockFd_ = -1;
+      return s;
+    }
+  }
+
   struct stat sb;
   if (fstat(fd_, &sb) == -1) {
     return ioError();
@@ -164,6 +497,7 @@ Status DBImpl::init() {
 
   size_t sz = pageSize_ * 4;
   char* buf = new char[sz];
+  memset(buf, 0, sz);
   for (uint64_t i = 0; i < 2; i++) {
     Page* p = pageOf(buf + i * pageSize_, i, Page::kMetaPageFlag);
     Meta* m = p->meta();
@@ -181,25 +515,29 @@ Status DBImpl::init() {
   }
 
   // freelist page
-  pageOf(buf, 2, Page::kFreeListPageFlag);
+  pageOf(buf + 2 * pageSize_, 2, Page::kFreeListPageFlag);
   // empty leaf page
-  pageOf(buf, 3, Page::kLeafPageFlag);
+  pageOf(buf + 3 * pageSize_, 3, Page::kLeafPageFlag);
 
   if (write(fd_, buf, sz) == -1) {
     delete [] buf;
     return ioError();
   }
+  recordTick(DBStats::kBytesWritten, sz);
 
-  if (fsync(fd_) == -1) {
+  // the first commits overwrite the initial mapping instead of extending it
+  if (options_.initialMmapSize > (int64_t) sz &&
+      fallocate(fd_, 0, 0, options_.initialMmapSize) == -1 &&
+      errno != EOPNOTSUPP) {
     delete [] buf;
     return ioError();
   }
 
   delete [] buf;
-  return Status::OK();
+  return sync(fd_);
 }
 
-Status DBImpl::mmapFile() {
+Status DBImpl::mmapFile(uint64_t minSize) {
 
   struct stat sb;
   if (fstat(fd_, &sb) == -1) {
@@ -207,8 +545,8 @@ Status DBImpl::mmapFile() {
   }
 
   uint64_t size = sb.st_size;
-  if (size < (uint64_t) options_.initialMmapSize) {
-    size = options_.initialMmapSize;
+  if (size < minSize) {
+    size = minSize;
   }
 
   auto ret = mmapSize(size);
@@ -219,11 +557,13 @@ Status DBImpl::mmapFile() {
 
   size = std::get<0>(ret);
 
-  // TODO(zenk):
-  // 1. dereference
-  // 2. munmap
+  s = munmapFile();
+  if (!s.ok()) {
+    return s;
+  }
 
-  data_ = static_cast<char*>(mmap(nullptr, size, PROT_READ, options_.mmapFlags|MAP_SHARED, fd_, 0));
+  int prot = writableMmap() ? PROT_READ|PROT_WRITE : PROT_READ;
+  data_ = static_cast<char*>(mmap(nullptr, size, prot, options_.mmapFlags|MAP_SHARED, fd_, 0));
   if (data_ == MAP_FAILED) {
     return Status::sysError(strerror(errno));
   }
@@ -233,15 +573,91 @@ Status DBImpl::mmapFile() {
   }
 
   dataSize_ = size;
+  recordTick(DBStats::kMmapRemaps);
+  recordTx(&TxStats::mmapRemaps);
 
   return Status::OK();
 }
 
+Status DBImpl::munmapFile() {
+
+  if (data_ == nullptr) {
+    return Status::OK();
+  }
+
+  if (munmap(data_, dataSize_) == -1) {
+    return Status::sysError(strerror(errno));
+  }
+
+  data_ = nullptr;
+  dataSize_ = 0;
+
+  return Status::OK();
+}
+
+// Remaps the file if the mapping is smaller than 'size', waits for the read
+// transactions since they are reading the old mapping.
+Status DBImpl::grow(uint64_t size) {
+
+  if (size <= dataSize_) {
+    return Status::OK();
+  }
+
+  std::unique_lock<std::shared_mutex> lock(mmapLock_);
+
+  return remap(size);
+}
+
+// Makes the file at least 'size' bytes by kMappedGrowthChunk at a time, so
+// the pages are written through the mapping, and maps it. Stores the end of
+// the pages both in the file and the mapping into *end. The file is only
+// extended, as the preallocator may extend it at the same time.
+Status DBImpl::extend(uint64_t size, uint64_t* end) {
+
+  struct stat sb;
+  if (fstat(fd_, &sb) == -1) {
+    return ioError();
+  }
+
+  uint64_t fileSize = sb.st_size;
+  if (fileSize < size) {
+    uint64_t target = (size + kMappedGrowthChunk - 1) / kMappedGrowthChunk * kMappedGrowthChunk;
+    if (fallocate(fd_, 0, fileSize, target - fileSize) == -1) {
+      if (errno != EOPNOTSUPP || ftruncate(fd_, target) == -1) {
+        return ioError();
+      }
+    }
+    fileSize = target;
+  }
+
+  Status s = grow(size);
+  if (s.ok()) {
+    *end = std::min(fileSize, dataSize_);
+  }
+
+  return s;
+}
+
+// Same as grow but with the mmapLock_ held.
+Status DBImpl::remap(uint64_t size) {
+
+  if (size <= dataSize_) {
+    return Status::OK();
+  }
+
+  Status s = mmapFile(size);
+  if (!s.ok()) {
+    return s;
+  }
+
+  return readMeta();
+}
+
 std::pair<uint64_t, Status> DBImpl::mmapSize(uint64_t size) {
 
-  for (uint64_t i = 15; i <= 30; i++) {
-    if (size < (uint64_t)1 << i) {
-      return std::make_pair(1<<i, Status::OK());
+  for (uint64_t sz = 1 << 15; sz <= mmapStep_; sz <<= 1) {
+    if (size < sz) {
+      return std::make_pair(sz, Status::OK());
     }
   }
 
@@ -249,9 +665,9 @@ std::pair<uint64_t, Status> DBImpl::mmapSize(uint64_t size) {
     return std::make_pair(0, Status::sysError("mmap size is over limit"));
   }
 
-  auto r = size % kMaxMapStep;
+  auto r = size % mmapStep_;
   if (r > 0) {
-    size += kMaxMapStep - r;
+    size += mmapStep_ - r;
   }
 
   if (size % pageSize_ != 0) {
@@ -277,8 +693,208 @@ Status DBImpl::readMeta() {
   return Status::OK();
 }
 
+// Returns the meta of the latest commit.
+Meta* DBImpl::meta() {
+  return deferMeta_ ? &latestMeta_ : fileMeta();
+}
+
+// Returns the valid meta with the latest transaction.
+Meta* DBImpl::fileMeta() {
+
+  Meta* a = meta0_;
+  Meta* b = meta1_;
+  if (b->txID > a->txID) {
+    std::swap(a, b);
+  }
+
+  return a->validate() ? a : b;
+}
+
+// Writes 'm' into the meta page 'pageID', and syncs the file.
+Status DBImpl::writeMeta(const Meta& m, uint64_t pageID) {
+
+  std::vector<char> buf(pageSize_);
+  Page* p = new (buf.data()) Page{pageID, static_cast<uint16_t>(Page::kMetaPageFlag)};
+  *p->meta() = m;
+  p->meta()->calcChecksum();
+
+  {
+    // the readers copy the meta with the lock
+    std::lock_guard<std::mutex> lock(metaLock_);
+    if (pwrite(fd_, buf.data(), pageSize_, pageID * pageSize_) != (ssize_t) pageSize_) {
+      return ioError();
+    }
+  }
+
+  recordTick(DBStats::kBytesWritten, pageSize_);
+  recordTx(&TxStats::bytesWritten, pageSize_);
+
+  return sync(fd_);
+}
+
+// Writes the freelist onto the pages free in the file, which the commits
+// don't write if deferMeta_, for the meta 'm' of the latest commit, which
+// frees the previous one.
+Status DBImpl::writeFreelist(Meta* m) {
+
+  uint64_t prev = m->freelistPageID;
+  uint32_t overflow = 0;
+  if (prev != kNoFreelist) {
+    overflow = page(prev)->overflow();
+    freelist_.free(m->txID, prev, overflow);
+  }
+
+  if (options_.noFreelistSync) {
+    m->freelistPageID = kNoFreelist;
+    std::lock_guard<std::mutex> lock(metaLock_);
+    latestMeta_ = *m;
+    return Status::OK();
+  }
+
+  size_t count = (freelist_.size() + pageSize_ - 1) / pageSize_;
+  uint64_t id = freelist_.allocate(count);
+  uint64_t end = m->pageID;
+  if (id == 0) {
+    id = end;
+    end += count;
+  }
+
+  std::vector<char> buf(count * pageSize_);
+  freelist_.write(new (buf.data()) Page(id, static_cast<uint32_t>(count - 1)));
+
+  for (size_t off = 0; off < buf.size();) {
+    ssize_t n = pwrite(fd_, buf.data() + off, buf.size() - off, id * pageSize_ + off);
+    if (n == -1) {
+      Status s = ioError();
+      if (end == m->pageID) {
+        freelist_.restore(id, count - 1);
+      }
+      if (prev != kNoFreelist) {
+        freelist_.unfree(m->txID, prev, overflow);
+      }
+      return s;
+    }
+    off += n;
+  }
+  recordTick(DBStats::kBytesWritten, buf.size());
+
+  m->freelistPageID = id;
+  m->pageID = end;
+  {
+    std::lock_guard<std::mutex> lock(metaLock_);
+    latestMeta_ = *m;
+  }
+
+  // the freelist is read from the mapping
+  return grow((end + 1) * pageSize_);
+}
+
+// Writes the meta of the latest commit with its freelist after syncing the
+// pages of it, for Options::kSyncPeriodic. The writers wait for the freelist
+// only.
+Status DBImpl::syncMeta() {
+
+  std::lock_guard<std::mutex> syncLock(syncLock_);
+  std::unique_lock<std::mutex> lock(rwlock_);
+  return syncMeta(&lock);
+}
+
+// With syncLock_ held, and rwlock_ held by 'lock', which is unlocked once the
+// freelist is written. If 'lock' is null, rwlock_ is held by the caller
+// throughout, so the meta written is still the latest one.
+Status DBImpl::syncMeta(std::unique_lock<std::mutex>* lock) {
+
+  Meta m = latestMeta_;
+  if (m.txID == fileTxID_) {
+    return Status::OK();
+  }
+
+  Status s = writeFreelist(&m);
+  if (!s.ok()) {
+    return s;
+  }
+  if (lock != nullptr) {
+    lock->unlock();
+  }
+
+  s = sync(fd_);
+  if (!s.ok()) {
+    return s;
+  }
+
+  uint64_t pageID;
+  {
+    // the meta pages are remapped while growing
+    std::shared_lock<std::shared_mutex> mmapLock(mmapLock_);
+    pageID = nextMetaPageID();
+  }
+
+  s = writeMeta(m, pageID);
+  if (s.ok()) {
+    fileTxID_ = m.txID;
+  }
+
+  return s;
+}
+
+// Syncs 'fd' as Options::syncMode says, by fdatasync unless it's kSyncFull.
+Status DBImpl::sync(int fd) {
+
+  if (options_.syncMode == Options::kSyncNone) {
+    return Status::OK();
+  }
+
+  StopWatch sw(DBStats::kFsyncMicros);
+  int ret = options_.syncMode == Options::kSyncFull ? fsync(fd) : fdatasync(fd);
+  if (ret == -1) {
+    return ioError();
+  }
+
+  return Status::OK();
+}
+
 Status DBImpl::close() {
 
+  if (syncer_ != nullptr) {
+    Status s = syncer_->stop();
+    if (!s.ok()) {
+      return s;
+    }
+  }
+
+  if (wal_ != nullptr) {
+    std::lock_guard<std::mutex> lock(rwlock_);
+    StatisticsScope scope(stats_);
+    Status s = checkpoint();
+    if (!s.ok()) {
+      return s;
+    }
+    s = wal_->close();
+    if (!s.ok()) {
+      return s;
+    }
+  }
+
+  preallocator_.reset();
+
+  if (table_ != nullptr) {
+    Status s = table_->close();
+    if (!s.ok()) {
+      return s;
+    }
+  }
+
+  // also unlocks it
+  if (lockFd_ != -1 && ::close(lockFd_) == -1) {
+    return ioError();
+  }
+  lockFd_ = -1;
+
+  Status s = munmapFile();
+  if (!s.ok()) {
+    return s;
+  }
+
   // unlock
   if (!options_.readOnly && flock(fd_, LOCK_UN) == -1) {
     return ioError();
@@ -291,19 +907,485 @@ Status DBImpl::close() {
   return Status::OK();
 }
 
-Status DBImpl::update(void (*f)(TX* tx)) {
+Status DBImpl::update(void (*f)(TX* tx), TxStats* stats) {
+  return update0(f, stats);
+}
+
+Status DBImpl::update0(const std::function<void(TX*)>& f, TxStats* stats) {
+
+  if (options_.readOnly) {
+    return Status::invalidArgument("database is read only");
+  }
+
+  std::lock_guard<std::mutex> lock(rwlock_);
+
+  if (stats != nullptr) {
+    *stats = TxStats{};
+  }
+  StatisticsScope scope(stats_, stats);
+  recordTick(DBStats::kWriteTXs);
+
+  // the pages freed before the oldest reader are not read any more
+  {
+    std::lock_guard<std::mutex> metaLock(metaLock_);
+    uint64_t minID = readers_.empty() ? UINT64_MAX : *readers_.begin();
+    if (table_ != nullptr) {
+      minID = std::min(minID, table_->oldest());
+    }
+    // the file refers to the pages freed since its meta
+    if (deferMeta_) {
+      minID = std::min(minID, fileTxID_ + 1);
+    }
+    if (minID > 0) {
+      freelist_.release(minID - 1);
+    }
+  }
+
+  TXImpl tx(this, true);
+  f(&tx);
+
+  Status s = tx.commit();
+  if (!s.ok()) {
+    tx.rollback();
+  } else if (table_ != nullptr) {
+    table_->commit(tx.id());
+  }
+
+  // the commit is in the log already, a failed checkpoint is retried by the
+  // next commit
+  uint64_t limit = options_.walCheckpointPages > 0 ? options_.walCheckpointPages : kWalCheckpointPages;
+  if (s.ok() && wal_ != nullptr && overlay_.size() >= limit) {
+    checkpoint();
+  }
+
+  return s;
+}
+
+Status DBImpl::view(void (*f)(TX* tx)) {
+  return view0(f);
+}
+
+Status DBImpl::view0(const std::function<void(TX*)>& f) {
+
+  StatisticsScope scope(stats_);
+  recordTick(DBStats::kReadTXs);
+
+  std::shared_lock<std::shared_mutex> mmapLock(mmapLock_);
+
+  Meta m = acquireSnapshot();
+
+  // the file is grown by the writer of another process
+  if (m.pageID * pageSize_ > dataSize_) {
+    mmapLock.unlock();
+    Status s = Status::OK();
+    {
+      std::unique_lock<std::shared_mutex> lock(mmapLock_);
+      s = remap(m.pageID * pageSize_);
+    }
+    if (!s.ok()) {
+      releaseSnapshot(m.txID);
+      return s;
+    }
+    mmapLock.lock();
+  }
+
+  TXImpl* tx = new TXImpl(this, m);
+  f(tx);
+  delete tx;
+
+  releaseSnapshot(m.txID);
 
   return Status::OK();
 }
 
-inline Page* DBImpl::page(uint64_t pageID) {
-  return reinterpret_cast<Page*>(data_ + pageID * pageSize_);
+// Registers a reader of the latest meta. A reader process publishes it to
+// the writer, and checks the meta again in case the writer committed and
+// released the pages of it before seeing the reader.
+Meta DBImpl::acquireSnapshot() {
+
+  std::lock_guard<std::mutex> metaLock(metaLock_);
+
+  while (true) {
+    Meta m = *meta();
+    readers_.insert(m.txID);
+
+    if (table_ == nullptr || !options_.readOnly) {
+      return m;
+    }
+
+    table_->publish(*readers_.begin());
+    if (meta()->txID == m.txID) {
+      return m;
+    }
+
+    readers_.erase(readers_.find(m.txID));
+  }
+}
+
+uint64_t DBImpl::backupEnd() {
+
+  std::lock_guard<std::mutex> metaLock(metaLock_);
+  return backupEnds_.empty() ? 0 : *backupEnds_.rbegin();
+}
+
+void DBImpl::releaseSnapshot(uint64_t txID) {
+
+  std::lock_guard<std::mutex> metaLock(metaLock_);
+  readers_.erase(readers_.find(txID));
+
+  if (table_ != nullptr && options_.readOnly) {
+    table_->publish(readers_.empty() ? UINT64_MAX : *readers_.begin());
+  }
+}
+
+Status DBImpl::createIndex(const std::string& bucket, const std::string& index,
+    const IndexKeyFunc& f) {
+
+  if (options_.readOnly) {
+    return Status::invalidArgument("database is read only");
+  }
+
+  if (bucket == index) {
+    return Status::invalidArgument("bucket indexes itself");
+  }
+
+  Status s = Status::OK();
+  Status us = update0([&](TX* tx) {
+    TXImpl* t = static_cast<TXImpl*>(tx);
+    BucketImpl* b = static_cast<BucketImpl*>(t->bucket(bucket));
+    if (b == nullptr) {
+      s = Status::notFound(bucket);
+      return;
+    }
+
+    if (t->bucket(index) != nullptr) {
+      return;
+    }
+
+    // nothing is created if an entry is invalid
+    WriteBatch batch;
+    std::string ik;
+    b->scan("", [&](const std::string& k, const std::string& v) {
+      if (!f(k, v, &ik)) {
+        return true;
+      }
+      std::string entry = indexEntryKey(ik, k);
+      if (entry.size() > kMaxKeySize) {
+        s = Status::invalidArgument("index key too large");
+        return false;
+      }
+      batch.put(entry, k);
+      return true;
+    });
+    if (!s.ok()) {
+      return;
+    }
+
+    Bucket* ib = t->createBucket(index);
+    if (ib == nullptr) {
+      s = Status::invalidArgument("invalid index name");
+      return;
+    }
+    s = ib->write(batch);
+  }, nullptr);
+
+  if (!s.ok()) {
+    return s;
+  }
+  if (!us.ok()) {
+    return us;
+  }
+
+  std::lock_guard<std::mutex> lock(rwlock_);
+  indexes_[bucket][index] = f;
+
+  return Status::OK();
+}
+
+uint64_t DBImpl::txID() {
+
+  uint64_t id = table_ == nullptr ? 0 : table_->txID();
+  if (id > 0) {
+    return id;
+  }
+
+  std::shared_lock<std::shared_mutex> mmapLock(mmapLock_);
+  std::lock_guard<std::mutex> metaLock(metaLock_);
+
+  return meta()->txID;
+}
+
+Status DBImpl::nextSequence(const std::string& bucket, uint64_t* seq) {
+
+  SequenceLease* lease = sequenceLease(bucket);
+
+  while (!lease->next(seq)) {
+    std::lock_guard<std::mutex> lock(lease->mutex());
+    // reserved by another thread
+    if (lease->next(seq)) {
+      break;
+    }
+
+    // a missing bucket is found by a reader, the writer would commit an
+    // empty transaction for it
+    bool found = false;
+    Status vs = view0([&](TX* tx) { found = tx->bucket(bucket) != nullptr; });
+    if (!vs.ok()) {
+      return vs;
+    }
+    if (!found) {
+      return Status::notFound(bucket);
+    }
+
+    uint64_t n = options_.sequenceLeaseSize > 0 ? options_.sequenceLeaseSize : kSequenceLeaseSize;
+    uint64_t start = 0;
+    Status s = Status::OK();
+    Status us = update0([&](TX* tx) {
+      Bucket* b = tx->bucket(bucket);
+      // deleted since the view
+      if (b == nullptr) {
+        s = Status::notFound(bucket);
+        return;
+      }
+
+      // the ids up to the sequence may be handed out by Bucket::nextSequence
+      start = std::max(b->sequence() + 1, lease->low());
+      s = b->setSequence(start + n - 1);
+    }, nullptr);
+
+    if (!s.ok()) {
+      return s;
+    }
+    if (!us.ok()) {
+      return us;
+    }
+
+    lease->reset(start, start + n);
+  }
+
+  return Status::OK();
+}
+
+// Copies the pages of the snapshot as a reader, so they are not reused by the
+// writers meanwhile. The pages free in the snapshot may be overwritten while
+// copying, but they are not referenced by it. The meta pages are written
+// first as the copies of the snapshot meta, so the backup opens on it.
+Status DBImpl::backupTo(int fd, uint64_t bytesPerSec) {
+
+  Meta m;
+  {
+    // the pages of the snapshot are copied from the file, the writers are
+    // locked out until it's acquired
+    std::unique_lock<std::mutex> syncLock(syncLock_, std::defer_lock);
+    std::unique_lock<std::mutex> lock(rwlock_, std::defer_lock);
+    if (wal_ != nullptr) {
+      lock.lock();
+      Status s = checkpoint();
+      if (!s.ok()) {
+        return s;
+      }
+    } else if (syncer_ != nullptr) {
+      // the freelist of the latest meta is the one of the last sync, where
+      // the pages allocated since are free
+      syncLock.lock();
+      lock.lock();
+      Status s = syncMeta(nullptr);
+      if (!s.ok()) {
+        return s;
+      }
+    } else {
+      lock.lock();
+    }
+
+    // the meta pages are remapped while growing
+    std::shared_lock<std::shared_mutex> mmapLock(mmapLock_);
+    m = acquireSnapshot();
+    // the free pages at the end are copied too, the commits don't truncate them
+    std::lock_guard<std::mutex> metaLock(metaLock_);
+    backupEnds_.insert(m.pageID);
+  }
+
+  std::vector<char> buf(pageSize_ * 2);
+  for (uint64_t i = 0; i < 2; i++) {
+    Page* p = new (buf.data() + i * pageSize_) Page{i, static_cast<uint16_t>(Page::kMetaPageFlag)};
+    *p->meta() = m;
+    p->meta()->calcChecksum();
+  }
+
+  Status s = Status::OK();
+  for (size_t off = 0; off < buf.size();) {
+    ssize_t n = write(fd, buf.data() + off, buf.size() - off);
+    if (n == -1) {
+      s = ioError();
+      break;
+    }
+    off += n;
+  }
+
+  if (s.ok()) {
+    s = copyTo(fd, pageSize_ * 2, (m.pageID - 2) * pageSize_, bytesPerSec);
+  }
+
+  {
+    std::lock_guard<std::mutex> metaLock(metaLock_);
+    backupEnds_.erase(backupEnds_.find(m.pageID));
+  }
+  releaseSnapshot(m.txID);
+
+  return s;
+}
+
+Status DBImpl::backupTo(const std::string& path, uint64_t bytesPerSec) {
+
+  int fd = openFileFunc(path.data(), O_CREAT|O_TRUNC|O_WRONLY, S_IROTH|S_IRGRP|S_IRUSR|S_IWUSR);
+  if (fd == -1) {
+    return ioError();
+  }
+
+  Status s = backupTo(fd, bytesPerSec);
+  if (s.ok() && fsync(fd) == -1) {
+    s = ioError();
+  }
+
+  if (closeFileFunc(fd) == -1 && s.ok()) {
+    s = ioError();
+  }
+
+  return s;
+}
+
+// Copies 'size' bytes of the file from 'offset' to the current position of
+// 'fd' in the kernel, with copy_file_range, or sendfile if 'fd' is not a
+// regular file or on another file system.
+Status DBImpl::copyTo(int fd, uint64_t offset, uint64_t size, uint64_t bytesPerSec) {
+
+  auto begin = std::chrono::steady_clock::now();
+  bool fallback = false;
+  loff_t in = offset;
+  uint64_t copied = 0;
+
+  while (copied < size) {
+    size_t chunk = std::min(size - copied, kBackupChunkSize);
+    if (bytesPerSec > 0) {
+      chunk = std::min<uint64_t>(chunk, std::max<uint64_t>(bytesPerSec / 10, pageSize_));
+    }
+
+    ssize_t n = -1;
+    if (!fallback) {
+      n = copy_file_range(fd_, &in, fd, nullptr, chunk, 0);
+      if (n == -1 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+          errno == EOPNOTSUPP || errno == EBADF)) {
+        fallback = true;
+      }
+    }
+
+    if (fallback) {
+      off_t o = in;
+      n = sendfile(fd, fd_, &o, chunk);
+      if (n > 0) {
+        in = o;
+      }
+    }
+
+    if (n == -1) {
+      return ioError();
+    }
+    if (n == 0) {
+      return Status::dataError("unexpected end of file");
+    }
+
+    copied += n;
+
+    if (bytesPerSec > 0) {
+      std::chrono::duration<double> due(static_cast<double>(copied) / bytesPerSec);
+      std::this_thread::sleep_until(begin + std::chrono::duration_cast<std::chrono::microseconds>(due));
+    }
+  }
+
+  return Status::OK();
+}
+
+Status DBImpl::compactTo(int fd, double fillPercent, CompactStats* stats) {
+
+  Status s = Status::OK();
+  view0([&](TX* tx) {
+    Compactor compactor(static_cast<TXImpl*>(tx), fd, fillPercent);
+    s = compactor.run(stats);
+  });
+
+  return s;
+}
+
+Status DBImpl::checkTo(int metaPage, int threads, CheckStats* stats) {
+
+  std::shared_lock<std::shared_mutex> lock(mmapLock_);
+
+  Meta m;
+  if (metaPage == -1) {
+    m = *meta();
+  } else {
+    m = metaPage == 0 ? *meta0_ : *meta1_;
+    if (!m.validate()) {
+      return Status::dataError("invalid meta page " + std::to_string(metaPage));
+    }
+  }
+
+  // the pages past the end of the file are not read
+  struct stat sb;
+  if (fstat(fd_, &sb) == -1) {
+    return ioError();
+  }
+  uint64_t end = std::min(static_cast<uint64_t>(sb.st_size), dataSize_) / pageSize_;
+
+  TXImpl tx(this, m);
+  Checker checker(&tx, end, threads);
+  return checker.run(stats);
+}
+
+SequenceLease* DBImpl::sequenceLease(const std::string& bucket) {
+
+  {
+    std::shared_lock<std::shared_mutex> lock(sequencesLock_);
+    auto it = sequences_.find(bucket);
+    if (it != sequences_.end()) {
+      return it->second.get();
+    }
+  }
+
+  std::lock_guard<std::shared_mutex> lock(sequencesLock_);
+  auto& lease = sequences_[bucket];
+  if (lease == nullptr) {
+    lease.reset(new SequenceLease());
+  }
+
+  return lease.get();
+}
+
+DBStats DBImpl::stats() {
+
+  DBStats stats{};
+  if (stats_ != nullptr) {
+    stats_->aggregate(&stats);
+  }
+
+  return stats;
 }
 
 DB::~DB() = default;
 
 DBImpl::~DBImpl() {
+  // the preallocating and the syncing threads record into the statistics
+  preallocator_.reset();
+  syncer_.reset();
+  delete stats_;
 
+  if (lockFd_ != -1) {
+    ::close(lockFd_);
+  }
+
+  for (auto& e : overlay_) {
+    delete [] reinterpret_cast<char*>(e.second);
+  }
 }
 
 }  // namespace dbwheel
@@ -3,47 +3,159 @@
 #ifndef DB_DB_IMPL_H_
 #define DB_DB_IMPL_H_
 
+#include <atomic>
 #include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
 #include <string>
+#include <unordered_map>
 #include <utility>
 
 #include "include/dbwheel/db.h"
+#include "db/bloom_filter.h"
+#include "db/freelist.h"
+#include "db/meta.h"
+#include "db/node.h"
+#include "db/preallocator.h"
+#include "db/reader_table.h"
+#include "db/sequence_lease.h"
+#include "db/syncer.h"
+#include "db/wal.h"
 
 namespace dbwheel {
 
-struct Meta;
 class Page;
+class Statistics;
 
 class DBImpl : public DB {
  public:
-  DBImpl(const Options& options, const std::string& dbname):
-    name_(dbname),
-    options_(options),
-    open_(true) {}
+  DBImpl(const Options& options, const std::string& dbname);
   ~DBImpl() override;
-  Status update(void (*f)(TX*)) override;
+  Status update(void (*f)(TX*), TxStats* stats = nullptr) override;
+  Status view(void (*f)(TX*)) override;
+  DBStats stats() override;
+  Status nextSequence(const std::string& bucket, uint64_t* seq) override;
+  Status backupTo(int fd, uint64_t bytesPerSec = 0) override;
+  Status backupTo(const std::string& path, uint64_t bytesPerSec = 0) override;
+  uint64_t txID() override;
+  Status createIndex(const std::string& bucket, const std::string& index,
+      const IndexKeyFunc& f) override;
+  // Writes the compacted copy of the latest snapshot into 'fd'.
+  Status compactTo(int fd, double fillPercent, CompactStats* stats);
+  // Verifies the snapshot of the meta page 'metaPage', or of the latest
+  // meta if it's -1.
+  Status checkTo(int metaPage, int threads, CheckStats* stats);
 
   Status open();
   Status close() override;
-  Page* page(uint64_t pageID);
+  Page* page(uint64_t pageID) {
+    Page* p = wal_ != nullptr ? overlayPage(pageID) : nullptr;
+    return p != nullptr ? p : reinterpret_cast<Page*>(data_ + pageID * pageSize_);
+  }
 
  private:
-  
+  friend class TXImpl;
+
+  Status update0(const std::function<void(TX*)>& f, TxStats* stats);
+  Status view0(const std::function<void(TX*)>& f);
+  SequenceLease* sequenceLease(const std::string& bucket);
+  Meta acquireSnapshot();
+  void releaseSnapshot(uint64_t txID);
+  // The largest end of the snapshots being backed up, 0 if none.
+  uint64_t backupEnd();
+
+  Status copyTo(int fd, uint64_t offset, uint64_t size, uint64_t bytesPerSec);
+
   Status openFile();
   Status init();
-  Status mmapFile();
+  Status mmapFile(uint64_t minSize);
+  Status munmapFile();
+  Status grow(uint64_t size);
+  Status extend(uint64_t size, uint64_t* end);
+  Status remap(uint64_t size);
   std::pair<uint64_t, Status> mmapSize(uint64_t size);
   Status readMeta();
+  Status readFreelist();
+  Meta* meta();
+  // The latest meta in the file, which is behind meta() if deferMeta_.
+  Meta* fileMeta();
+  // The meta page other than the one of fileMeta().
+  uint64_t nextMetaPageID() { return fileMeta() == meta0_ ? 1 : 0; }
+  Status writeMeta(const Meta& m, uint64_t pageID);
+  Status writeFreelist(Meta* m);
+  Status syncMeta();
+  Status syncMeta(std::unique_lock<std::mutex>* lock);
+  Status sync(int fd);
+  bool writableMmap() const { return options_.writableMmap && !options_.readOnly; }
+
+  Page* overlayPage(uint64_t pageID);
+  Status recover();
+  Status checkpoint();
 
   std::string name_;
   Options options_;
   bool open_;
   int fd_;
+  // the reader table file held shared by a read only database without
+  // Options::multiProcess, -1 if none
+  int lockFd_;
   int pageSize_;
   char* data_;
   uint64_t dataSize_;
+  // the mapping doubles up to this size, then grows by it
+  uint64_t mmapStep_;
   Meta* meta0_;
   Meta* meta1_;
+  // null if the statistics is disabled
+  Statistics* stats_;
+  // null if Options::fileGrowthChunk is 0 or the database is read only
+  std::unique_ptr<Preallocator> preallocator_;
+  // null unless Options::multiProcess is set
+  std::unique_ptr<ReaderTable> table_;
+
+  RebalancePolicy rebalancePolicy_;
+  Freelist freelist_;
+  // allows only one writer at a time
+  std::mutex rwlock_;
+  // protects the mmap while the read transactions are reading it
+  std::shared_mutex mmapLock_;
+  // protects the meta and the txs of the readers
+  std::mutex metaLock_;
+  std::multiset<uint64_t> readers_;
+  // the ends of the snapshots being backed up
+  std::multiset<uint64_t> backupEnds_;
+  // the leases of DB::nextSequence by the bucket names
+  std::shared_mutex sequencesLock_;
+  std::map<std::string, std::unique_ptr<SequenceLease>> sequences_;
+  // the key functions of the indexes by the names of the indexed buckets,
+  // then of the indexes, protected by rwlock_
+  std::map<std::string, std::map<std::string, IndexKeyFunc>> indexes_;
+  // the filters of the top level buckets by the names
+  std::mutex filtersLock_;
+  std::map<std::string, std::shared_ptr<BloomFilter>> filters_;
+  // null unless Options::walMode is set
+  std::unique_ptr<Wal> wal_;
+  // the pages committed since the checkpoint in the wal mode, by the ids
+  std::shared_mutex overlayLock_;
+  std::unordered_map<uint64_t, Page*> overlay_;
+  // null unless Options::syncMode is kSyncPeriodic
+  std::unique_ptr<Syncer> syncer_;
+  // serializes the writes of the meta by the periodic sync
+  std::mutex syncLock_;
+  // set if the commits don't write the meta, in the wal mode, where the
+  // checkpoints write it, or by the periodic sync
+  bool deferMeta_;
+  // the latest meta if deferMeta_, protected by metaLock_
+  Meta latestMeta_;
+  // the transaction of fileMeta() if deferMeta_
+  std::atomic<uint64_t> fileTxID_;
+  // where the defragmentation continues, protected by rwlock_
+  std::string defragBucket_;
+  std::string defragKey_;
 };
 
 }  // namespace dbwheel
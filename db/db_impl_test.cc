@@ -2,8 +2,24 @@
 //
 #include "gtest/gtest.h"
 
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "include/dbwheel/bucket.h"
+#include "include/dbwheel/comparator.h"
+#include "include/dbwheel/tx.h"
+#include "db/bucket_impl.h"
 #include "db/db_impl.h"
 #include "db/debug.h"
+#include "db/tx_impl.h"
 
 namespace dbwheel {
 
@@ -19,4 +35,2012 @@ TEST(TestDBImpl, open) {
   }
 }
 
+TEST(TestDBImpl, stats) {
+  DB *db;
+  Options options{};
+  options.enableStatistics = true;
+  unlink("testStats");
+  Status status = DB::open(options, "testStats", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  DBStats stats = db->stats();
+  ASSERT_EQ(1, stats.ticker(DBStats::kMmapRemaps));
+  ASSERT_LT(0, stats.ticker(DBStats::kBytesWritten));
+  ASSERT_EQ(1, stats.histogram(DBStats::kFsyncMicros).count);
+
+  db->close();
+  delete db;
+  unlink("testStats");
+}
+
+static std::string keyOf(int i) {
+  char buf[16];
+  snprintf(buf, sizeof(buf), "key%08d", i);
+  return buf;
+}
+
+TEST(TestDBImpl, updateAndView) {
+  DB *db;
+  unlink("testUpdate");
+  Status status = DB::open(Options{}, "testUpdate", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  TxStats stats;
+  status = db->update([](TX* tx) {
+    Bucket* b = tx->createBucket("b");
+    ASSERT_TRUE(b != nullptr);
+    ASSERT_TRUE(tx->createBucket("b") == nullptr);
+
+    for (int i = 0; i < 1000; i++) {
+      ASSERT_TRUE(b->put(keyOf(i), keyOf(i) + "v").ok());
+    }
+    ASSERT_TRUE(b->put("big", std::string(10000, 'b')).ok());
+  }, &stats);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  ASSERT_LT(0, stats.splits);
+  ASSERT_LT(0, stats.pagesAllocated);
+  ASSERT_LT(0, stats.bytesSerialized);
+  ASSERT_LT(stats.bytesSerialized, stats.bytesWritten);
+
+  status = db->update([](TX* tx) {
+    Bucket* b = tx->bucket("b");
+    ASSERT_TRUE(b != nullptr);
+    for (int i = 0; i < 1000; i += 2) {
+      ASSERT_TRUE(b->del(keyOf(i)).ok());
+    }
+    ASSERT_TRUE(b->put("big", "small").ok());
+  }, &stats);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  ASSERT_LT(0, stats.nodesDecoded);
+  ASSERT_LT(0, stats.pagesFreed);
+
+  db->close();
+  delete db;
+
+  status = DB::open(Options{}, "testUpdate", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  status = db->view([](TX* tx) {
+    ASSERT_TRUE(tx->bucket("none") == nullptr);
+    ASSERT_TRUE(tx->createBucket("c") == nullptr);
+
+    Bucket* b = tx->bucket("b");
+    ASSERT_TRUE(b != nullptr);
+
+    std::string v;
+    for (int i = 0; i < 1000; i++) {
+      Status s = b->get(keyOf(i), &v);
+      if (i % 2 == 0) {
+        ASSERT_TRUE(s.isNotFound());
+      } else {
+        ASSERT_TRUE(s.ok());
+        ASSERT_EQ(keyOf(i) + "v", v);
+      }
+    }
+
+    ASSERT_TRUE(b->get("big", &v).ok());
+    ASSERT_EQ("small", v);
+    ASSERT_TRUE(b->put("k", "v").isInvalidArgument());
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  db->close();
+  delete db;
+  unlink("testUpdate");
+}
+
+TEST(TestDBImpl, overflowValue) {
+  DB *db;
+  unlink("testOverflow");
+  Status status = DB::open(Options{}, "testOverflow", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  status = db->update([](TX* tx) {
+    Bucket* b = tx->createBucket("b");
+    ASSERT_TRUE(b->put("a", "1").ok());
+    ASSERT_TRUE(b->put("big", std::string(1 << 20, 'b')).ok());
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  status = db->view([](TX* tx) {
+    std::string v;
+    Bucket* b = tx->bucket("b");
+    ASSERT_TRUE(b->get("big", &v).ok());
+    ASSERT_EQ(std::string(1 << 20, 'b'), v);
+    ASSERT_TRUE(b->get("a", &v).ok());
+    ASSERT_EQ("1", v);
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  db->close();
+  delete db;
+  unlink("testOverflow");
+}
+
+TEST(TestDBImpl, multiGet) {
+  DB *db;
+  unlink("testMultiGet");
+  Status status = DB::open(Options{}, "testMultiGet", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  status = db->update([](TX* tx) {
+    Bucket* b = tx->createBucket("b");
+    for (int i = 0; i < 2000; i += 2) {
+      ASSERT_TRUE(b->put(keyOf(i), keyOf(i) + "v").ok());
+    }
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  status = db->update([](TX* tx) {
+    Bucket* b = tx->bucket("b");
+    // some dirty nodes in the path
+    ASSERT_TRUE(b->put(keyOf(1001), "dirty").ok());
+
+    std::vector<std::string> keys;
+    for (int i = 1999; i >= 0; i -= 3) {
+      keys.push_back(keyOf(i));
+    }
+    keys.push_back(keyOf(1001));
+    keys.push_back(keyOf(4));
+    keys.push_back("");
+
+    std::vector<std::string> values;
+    std::vector<Status> statuses;
+    b->multiGet(keys, &values, &statuses);
+    ASSERT_EQ(keys.size(), values.size());
+    ASSERT_EQ(keys.size(), statuses.size());
+
+    for (size_t i = 0; i < keys.size(); i++) {
+      std::string v;
+      Status s = b->get(keys[i], &v);
+      ASSERT_EQ(s.ok(), statuses[i].ok()) << keys[i];
+      ASSERT_EQ(v, values[i]);
+    }
+    ASSERT_EQ("dirty", values[keys.size() - 3]);
+    ASSERT_EQ(keyOf(4) + "v", values[keys.size() - 2]);
+    ASSERT_TRUE(statuses.back().isNotFound());
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  db->close();
+  delete db;
+  unlink("testMultiGet");
+}
+
+TEST(TestDBImpl, writeBatch) {
+  DB *db;
+  unlink("testWriteBatch");
+  Status status = DB::open(Options{}, "testWriteBatch", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  status = db->update([](TX* tx) {
+    Bucket* b = tx->createBucket("b");
+    WriteBatch batch;
+    for (int i = 0; i < 3000; i += 2) {
+      batch.put(keyOf(i), keyOf(i));
+    }
+    ASSERT_TRUE(b->write(batch).ok());
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  status = db->update([](TX* tx) {
+    BucketImpl* b = static_cast<BucketImpl*>(tx->bucket("b"));
+    ASSERT_NE(nullptr, b->createBucket("sub"));
+
+    // a sub bucket can't be overwritten, nothing is applied then
+    WriteBatch batch;
+    batch.put(keyOf(1), "x");
+    batch.del("sub");
+    ASSERT_TRUE(b->write(batch).isInvalidArgument());
+    std::string v;
+    ASSERT_TRUE(b->get(keyOf(1), &v).isNotFound());
+
+    batch.clear();
+    for (int i = 2999; i >= 0; i -= 3) {
+      batch.put(keyOf(i), "new");
+    }
+    for (int i = 0; i < 3000; i += 4) {
+      batch.del(keyOf(i));
+    }
+    // the later one wins
+    batch.put(keyOf(8), "again");
+    batch.del(keyOf(9));
+    batch.put(std::string(1, 'z'), std::string(4096, 'z'));
+    ASSERT_TRUE(b->write(batch).ok());
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  status = db->view([](TX* tx) {
+    Bucket* b = tx->bucket("b");
+    for (int i = 0; i < 3000; i++) {
+      std::string v;
+      Status s = b->get(keyOf(i), &v);
+      if (i == 8) {
+        ASSERT_EQ("again", v);
+      } else if (i == 9) {
+        ASSERT_TRUE(s.isNotFound());
+      } else if (i % 4 == 0) {
+        ASSERT_TRUE(s.isNotFound()) << i;
+      } else if (i % 3 == 2999 % 3) {
+        ASSERT_EQ("new", v) << i;
+      } else if (i % 2 == 0) {
+        ASSERT_EQ(keyOf(i), v) << i;
+      } else {
+        ASSERT_TRUE(s.isNotFound()) << i;
+      }
+    }
+    std::string v;
+    ASSERT_TRUE(b->get("z", &v).ok());
+    ASSERT_EQ(4096, v.size());
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  db->close();
+  delete db;
+  unlink("testWriteBatch");
+}
+
+TEST(TestDBImpl, nextSequence) {
+  DB *db;
+  unlink("testNextSequence");
+  Options options{};
+  options.sequenceLeaseSize = 100;
+  options.enableStatistics = true;
+  Status status = DB::open(options, "testNextSequence", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  // no write transaction is committed for a missing bucket
+  uint64_t seq;
+  ASSERT_TRUE(db->nextSequence("b", &seq).isNotFound());
+  ASSERT_EQ(0, db->stats().ticker(DBStats::kWriteTXs));
+
+  status = db->update([](TX* tx) {
+    Bucket* b = tx->createBucket("b");
+    uint64_t seq;
+    ASSERT_TRUE(b->nextSequence(&seq).ok());
+    ASSERT_EQ(1, seq);
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  const int kThreads = 4, kIDs = 3000;
+  std::vector<std::vector<uint64_t>> ids(kThreads);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; t++) {
+    threads.emplace_back([db, &ids, t]() {
+      for (int i = 0; i < kIDs; i++) {
+        uint64_t seq;
+        ASSERT_TRUE(db->nextSequence("b", &seq).ok());
+        ids[t].push_back(seq);
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  std::set<uint64_t> all;
+  for (auto& v : ids) {
+    all.insert(v.begin(), v.end());
+    ASSERT_TRUE(std::is_sorted(v.begin(), v.end()));
+  }
+  ASSERT_EQ(kThreads * kIDs, all.size());
+  ASSERT_LT(1, *all.begin());
+
+  // the reserved ranges are persisted
+  status = db->view([](TX* tx) {
+    ASSERT_LE(kThreads * kIDs + 1, tx->bucket("b")->sequence());
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  db->close();
+  delete db;
+
+  status = DB::open(options, "testNextSequence", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  ASSERT_TRUE(db->nextSequence("b", &seq).ok());
+  ASSERT_LT(*all.rbegin(), seq);
+
+  db->close();
+  delete db;
+  unlink("testNextSequence");
+}
+
+TEST(TestDBImpl, inlineBucket) {
+  DB *db;
+  unlink("testInlineBucket");
+  Status status = DB::open(Options{}, "testInlineBucket", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  status = db->update([](TX* tx) {
+    BucketImpl* b = static_cast<BucketImpl*>(tx->createBucket("b"));
+    for (int i = 0; i < 500; i++) {
+      Bucket* c = b->createBucket(keyOf(i));
+      for (int j = 0; j <= i % 5; j++) {
+        ASSERT_TRUE(c->put(keyOf(j), keyOf(i)).ok());
+      }
+    }
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  status = db->update([](TX* tx) {
+    BucketImpl* b = static_cast<BucketImpl*>(tx->bucket("b"));
+    ASSERT_EQ(0, b->bucket(keyOf(0))->header().rootPageID);
+
+    // promoted once it's too large, a large value is still out of line
+    Bucket* c = b->bucket(keyOf(1));
+    for (int j = 0; j < 200; j++) {
+      ASSERT_TRUE(c->put(keyOf(j), keyOf(j)).ok());
+    }
+    ASSERT_TRUE(b->bucket(keyOf(2))->put("big", std::string(8192, 'x')).ok());
+    uint64_t seq;
+    ASSERT_TRUE(b->bucket(keyOf(3))->nextSequence(&seq).ok());
+    ASSERT_NE(nullptr, b->bucket(keyOf(4))->createBucket("sub"));
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  status = db->update([](TX* tx) {
+    BucketImpl* b = static_cast<BucketImpl*>(tx->bucket("b"));
+    ASSERT_NE(0, b->bucket(keyOf(1))->header().rootPageID);
+    ASSERT_EQ(0, b->bucket(keyOf(2))->header().rootPageID);
+    ASSERT_EQ(1, b->bucket(keyOf(3))->sequence());
+    ASSERT_NE(0, b->bucket(keyOf(4))->header().rootPageID);
+
+    // demoted once it's small again
+    Bucket* c = b->bucket(keyOf(1));
+    for (int j = 2; j < 200; j++) {
+      ASSERT_TRUE(c->del(keyOf(j)).ok());
+    }
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  db->close();
+  delete db;
+
+  status = DB::open(Options{}, "testInlineBucket", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  status = db->view([](TX* tx) {
+    BucketImpl* b = static_cast<BucketImpl*>(tx->bucket("b"));
+    ASSERT_EQ(0, b->bucket(keyOf(1))->header().rootPageID);
+
+    std::string v;
+    for (int i = 0; i < 500; i++) {
+      Bucket* c = b->bucket(keyOf(i));
+      ASSERT_NE(nullptr, c) << i;
+      int n = i == 1 ? 2 : i % 5 + 1;
+      for (int j = 0; j < n; j++) {
+        ASSERT_TRUE(c->get(keyOf(j), &v).ok()) << i << " " << j;
+        ASSERT_EQ(i == 1 ? keyOf(j) : keyOf(i), v);
+      }
+      ASSERT_TRUE(c->get(keyOf(n), &v).isNotFound());
+    }
+    ASSERT_TRUE(b->bucket(keyOf(2))->get("big", &v).ok());
+    ASSERT_EQ(std::string(8192, 'x'), v);
+    ASSERT_NE(nullptr, b->bucket(keyOf(4))->bucket("sub"));
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  db->close();
+  delete db;
+  unlink("testInlineBucket");
+}
+
+TEST(TestDBImpl, backup) {
+  DB *db;
+  unlink("testBackup");
+  unlink("testBackupCopy");
+  Status status = DB::open(Options{}, "testBackup", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  status = db->update([](TX* tx) {
+    Bucket* b = tx->createBucket("b");
+    for (int i = 0; i < 5000; i++) {
+      ASSERT_TRUE(b->put(keyOf(i), std::string(100, 'a')).ok());
+    }
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  // the writers keep committing while the throttled backup is copying
+  std::atomic<bool> done(false);
+  std::atomic<int> commits(0);
+  std::thread writer([db, &done, &commits]() {
+    while (!done) {
+      Status s = db->update([](TX* tx) {
+        Bucket* b = tx->bucket("b");
+        for (int i = 0; i < 5000; i += 7) {
+          ASSERT_TRUE(b->put(keyOf(i), std::string(100, 'b')).ok());
+        }
+        ASSERT_TRUE(b->put("new", "").ok());
+      });
+      ASSERT_TRUE(s.ok()) << s.toString();
+      commits++;
+    }
+  });
+
+  while (commits == 0) {
+    std::this_thread::yield();
+  }
+  status = db->backupTo("testBackupCopy", 4 << 20);
+  int during = commits;
+  done = true;
+  writer.join();
+  ASSERT_TRUE(status.ok()) << status.toString();
+  ASSERT_LT(1, during);
+
+  db->close();
+  delete db;
+
+  status = DB::open(Options{}, "testBackupCopy", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  status = db->view([](TX* tx) {
+    Bucket* b = tx->bucket("b");
+    std::string v;
+    for (int i = 0; i < 5000; i++) {
+      ASSERT_TRUE(b->get(keyOf(i), &v).ok()) << i;
+      ASSERT_EQ(std::string(100, i % 7 == 0 ? 'b' : 'a'), v) << i;
+    }
+    ASSERT_TRUE(b->get("new", &v).ok());
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  // the backup is writable
+  status = db->update([](TX* tx) {
+    ASSERT_TRUE(tx->bucket("b")->del("new").ok());
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  db->close();
+  delete db;
+  unlink("testBackup");
+  unlink("testBackupCopy");
+}
+
+TEST(TestDBImpl, backupDefrag) {
+  DB *db;
+  unlink("testBackupDefrag");
+  unlink("testBackupDefragCopy");
+  Status status = DB::open(Options{}, "testBackupDefrag", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  // the pages of the value at the end are free, but not truncated without
+  // the defragmentation
+  status = db->update([](TX* tx) {
+    ASSERT_TRUE(tx->createBucket("b")->put("big", std::string(2 << 20, 'x')).ok());
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+  for (int i = 0; i < 3; i++) {
+    status = db->update([](TX* tx) {
+      Bucket* b = tx->bucket("b");
+      b->del("big");
+      ASSERT_TRUE(b->put("k", "v").ok());
+    });
+    ASSERT_TRUE(status.ok()) << status.toString();
+  }
+  db->close();
+  delete db;
+
+  Options options{};
+  options.defragPagesPerTx = 64;
+  status = DB::open(options, "testBackupDefrag", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  // the commit during the backup doesn't truncate the pages it copies
+  Status backup = Status::OK();
+  std::thread copier([db, &backup]() {
+    backup = db->backupTo("testBackupDefragCopy", 4 << 20);
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  status = db->update([](TX* tx) {
+    ASSERT_TRUE(tx->bucket("b")->put("k", "w").ok());
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+  copier.join();
+  ASSERT_TRUE(backup.ok()) << backup.toString();
+
+  // the next commit truncates them
+  struct stat st;
+  ASSERT_EQ(0, stat("testBackupDefrag", &st));
+  off_t size = st.st_size;
+  status = db->update([](TX* tx) {
+    ASSERT_TRUE(tx->bucket("b")->put("k", "x").ok());
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+  ASSERT_EQ(0, stat("testBackupDefrag", &st));
+  ASSERT_GT(size - (2 << 20), st.st_size);
+  db->close();
+  delete db;
+
+  CheckStats stats{};
+  status = DB::check(Options{}, "testBackupDefragCopy", -1, 2, &stats);
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  unlink("testBackupDefrag");
+  unlink("testBackupDefragCopy");
+}
+
+TEST(TestDBImpl, backupSyncPeriodic) {
+  DB *db;
+  unlink("testBackupSync");
+  unlink("testBackupSyncCopy");
+  Options options{};
+  options.syncMode = Options::kSyncPeriodic;
+  options.syncIntervalMs = 200;
+  Status status = DB::open(options, "testBackupSync", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  static char c;
+  auto rewrite = [db](char value) {
+    c = value;
+    Status s = db->update([](TX* tx) {
+      Bucket* b = tx->bucket("b") != nullptr ? tx->bucket("b") : tx->createBucket("b");
+      for (int i = 0; i < 2000; i++) {
+        ASSERT_TRUE(b->put(keyOf(i), std::string(100, c)).ok());
+      }
+    });
+    ASSERT_TRUE(s.ok()) << s.toString();
+  };
+
+  // the commits after the sync allocate the pages free in its freelist
+  for (char value : {'a', 'b', 'c'}) {
+    rewrite(value);
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(600));
+  for (char value : {'d', 'e'}) {
+    rewrite(value);
+  }
+
+  status = db->backupTo("testBackupSyncCopy", 0);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  db->close();
+  delete db;
+
+  CheckStats stats{};
+  status = DB::check(Options{}, "testBackupSyncCopy", -1, 2, &stats);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  ASSERT_EQ(1 + 2000, stats.keys);
+
+  status = DB::open(Options{}, "testBackupSyncCopy", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  status = db->view([](TX* tx) {
+    std::string v;
+    ASSERT_TRUE(tx->bucket("b")->get(keyOf(1999), &v).ok());
+    ASSERT_EQ(std::string(100, 'e'), v);
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  db->close();
+  delete db;
+  unlink("testBackupSync");
+  unlink("testBackupSyncCopy");
+}
+
+TEST(TestDBImpl, compact) {
+  DB *db;
+  unlink("testCompact");
+  unlink("testCompactCopy");
+  Status status = DB::open(Options{}, "testCompact", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  status = db->update([](TX* tx) {
+    BucketImpl* b = static_cast<BucketImpl*>(tx->createBucket("b"));
+    for (int i = 0; i < 20000; i++) {
+      ASSERT_TRUE(b->put(keyOf(i), std::string(100, 'a')).ok());
+    }
+    ASSERT_TRUE(b->put("big", std::string(20000, 'x')).ok());
+    uint64_t seq;
+    ASSERT_TRUE(b->nextSequence(&seq).ok());
+
+    BucketImpl* c = b->createBucket("c");
+    for (int i = 0; i < 3000; i++) {
+      ASSERT_TRUE(c->put(keyOf(i), keyOf(i)).ok());
+    }
+    ASSERT_TRUE(c->createBucket("small")->put("k", "v").ok());
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  status = db->update([](TX* tx) {
+    Bucket* b = tx->bucket("b");
+    for (int i = 0; i < 20000; i++) {
+      if (i % 10 != 0) {
+        ASSERT_TRUE(b->del(keyOf(i)).ok());
+      }
+    }
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  db->close();
+  delete db;
+
+  CompactStats stats{};
+  status = DB::compact("testCompact", "testCompactCopy", 0, &stats);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  ASSERT_LT(stats.dstSize * 4, stats.srcSize);
+  ASSERT_EQ(stats.dstSize / sysconf(_SC_PAGESIZE), stats.pages);
+
+  status = DB::open(Options{}, "testCompactCopy", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  status = db->view([](TX* tx) {
+    BucketImpl* b = static_cast<BucketImpl*>(tx->bucket("b"));
+    ASSERT_EQ(1, b->sequence());
+    std::string v;
+    for (int i = 0; i < 20000; i++) {
+      ASSERT_EQ(i % 10 == 0, b->get(keyOf(i), &v).ok()) << i;
+    }
+    ASSERT_TRUE(b->get("big", &v).ok());
+    ASSERT_EQ(std::string(20000, 'x'), v);
+
+    BucketImpl* c = b->bucket("c");
+    for (int i = 0; i < 3000; i++) {
+      ASSERT_TRUE(c->get(keyOf(i), &v).ok());
+      ASSERT_EQ(keyOf(i), v);
+    }
+    BucketImpl* small = c->bucket("small");
+    ASSERT_EQ(0, small->header().rootPageID);
+    ASSERT_TRUE(small->get("k", &v).ok());
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  // the compacted file is writable
+  status = db->update([](TX* tx) {
+    Bucket* b = tx->bucket("b");
+    for (int i = 1; i < 20000; i += 10) {
+      ASSERT_TRUE(b->put(keyOf(i), "again").ok());
+    }
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  db->close();
+  delete db;
+  unlink("testCompact");
+  unlink("testCompactCopy");
+}
+
+// the commit round of the tests below, update takes no capturing lambdas
+static int defragRound;
+
+TEST(TestDBImpl, defrag) {
+  DB *db;
+  unlink("testDefrag");
+  Options options{};
+  options.defragPagesPerTx = 64;
+  options.enableStatistics = true;
+  Status status = DB::open(options, "testDefrag", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  // interleaved commits scatter the leaves of both buckets over the file
+  for (defragRound = 0; defragRound < 20; defragRound++) {
+    status = db->update([](TX* tx) {
+      int r = defragRound;
+      for (auto name : {"a", "b"}) {
+        Bucket* b = r == 0 ? tx->createBucket(name) : tx->bucket(name);
+        for (int i = r; i < 20000; i += 20) {
+          ASSERT_TRUE(b->put(keyOf(i), std::string(100, 'a' + r)).ok());
+        }
+      }
+    });
+    ASSERT_TRUE(status.ok()) << status.toString();
+  }
+
+  status = db->update([](TX* tx) {
+    ASSERT_TRUE(tx->bucket("a")->put("big", std::string(1 << 20, 'x')).ok());
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+  struct stat st;
+  ASSERT_EQ(0, stat("testDefrag", &st));
+  off_t size = st.st_size;
+
+  status = db->update([](TX* tx) {
+    ASSERT_TRUE(tx->bucket("a")->del("big").ok());
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+  for (defragRound = 0; defragRound < 10; defragRound++) {
+    status = db->update([](TX* tx) {
+      ASSERT_TRUE(tx->bucket("b")->put(keyOf(defragRound), "c").ok());
+    });
+    ASSERT_TRUE(status.ok()) << status.toString();
+  }
+
+  DBStats stats = db->stats();
+  ASSERT_GT(stats.ticker(DBStats::kPagesRelocated), 0);
+  ASSERT_GT(stats.ticker(DBStats::kPagesTruncated), 0);
+  ASSERT_EQ(0, stat("testDefrag", &st));
+  ASSERT_LT(st.st_size, size);
+
+  status = db->view([](TX* tx) {
+    std::string v;
+    ASSERT_TRUE(tx->bucket("a")->get("big", &v).isNotFound());
+    for (auto name : {"a", "b"}) {
+      Bucket* b = tx->bucket(name);
+      for (int i = 0; i < 20000; i++) {
+        ASSERT_TRUE(b->get(keyOf(i), &v).ok()) << i;
+        if (name[0] == 'a' || i >= 10) {
+          ASSERT_EQ(std::string(100, 'a' + i % 20), v) << i;
+        }
+      }
+    }
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  db->close();
+  delete db;
+  unlink("testDefrag");
+}
+
+TEST(TestDBImpl, preallocate) {
+  DB *db;
+  unlink("testPreallocate");
+  Options options{};
+  options.initialMmapSize = 1 << 20;
+  options.fileGrowthChunk = 4 << 20;
+  options.mmapGrowthStep = 1 << 20;
+  options.enableStatistics = true;
+  Status status = DB::open(options, "testPreallocate", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  struct stat st;
+  ASSERT_EQ(0, stat("testPreallocate", &st));
+  ASSERT_GE(st.st_size, 1 << 20);
+
+  for (defragRound = 0; defragRound < 20; defragRound++) {
+    status = db->update([](TX* tx) {
+      Bucket* b = defragRound == 0 ? tx->createBucket("b") : tx->bucket("b");
+      for (int i = 0; i < 500; i++) {
+        ASSERT_TRUE(b->put(keyOf(defragRound * 500 + i), std::string(1000, 'a')).ok());
+      }
+    });
+    ASSERT_TRUE(status.ok()) << status.toString();
+  }
+
+  db->close();
+  ASSERT_GT(db->stats().ticker(DBStats::kBytesPreallocated), 0);
+  delete db;
+
+  status = DB::open(Options{}, "testPreallocate", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  status = db->view([](TX* tx) {
+    std::string v;
+    for (int i = 0; i < 10000; i++) {
+      ASSERT_TRUE(tx->bucket("b")->get(keyOf(i), &v).ok()) << i;
+    }
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  db->close();
+  delete db;
+  unlink("testPreallocate");
+}
+
+// Reads the commits of the writer in the parent process until "done".
+static int readCommits(const char* name) {
+
+  Options options{};
+  options.readOnly = true;
+  options.multiProcess = true;
+  DB* db;
+  if (!DB::open(options, name, &db).ok()) {
+    return 1;
+  }
+
+  static bool done, failed;
+  uint64_t seen = 0;
+  for (int i = 0; i < 100000 && !done && !failed; i++) {
+    uint64_t id = db->txID();
+    if (id == seen) {
+      usleep(100);
+      continue;
+    }
+    seen = id;
+
+    Status s = db->view([](TX* tx) {
+      std::string v;
+      Bucket* b = tx->bucket("b");
+      done = b->get("done", &v).ok();
+      // every commit rewrites the keys up to "k" times 100 with a new letter,
+      // and the writer reuses the freed pages unless it sees the reader
+      failed = !b->get("k", &v).ok();
+      int n = failed ? 0 : std::stoi(v);
+      usleep(20000);
+      for (int i = 0; i < n * 100 && !failed; i++) {
+        failed = !b->get(keyOf(i), &v).ok() || v != std::string(1000, 'a' + n % 26);
+      }
+    });
+    failed = failed || !s.ok();
+  }
+
+  db->close();
+  delete db;
+  return done && !failed ? 0 : 2;
+}
+
+TEST(TestDBImpl, multiProcess) {
+  DB *db;
+  unlink("testMultiProcess");
+  unlink("testMultiProcess-lock");
+  Options options{};
+  options.multiProcess = true;
+  Status status = DB::open(options, "testMultiProcess", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  DB* other;
+  ASSERT_FALSE(DB::open(options, "testMultiProcess", &other).ok());
+  // a reader out of the reader table would not be seen by the writer
+  Options plain{};
+  plain.readOnly = true;
+  ASSERT_FALSE(DB::open(plain, "testMultiProcess", &other).ok());
+
+  status = db->update([](TX* tx) {
+    ASSERT_TRUE(tx->createBucket("b")->put("k", "0").ok());
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    _exit(readCommits("testMultiProcess"));
+  }
+
+  // the file grows under the reader, and the freed pages are reused
+  for (defragRound = 1; defragRound <= 50; defragRound++) {
+    status = db->update([](TX* tx) {
+      Bucket* b = tx->bucket("b");
+      for (int i = 0; i < defragRound * 100; i++) {
+        ASSERT_TRUE(b->put(keyOf(i), std::string(1000, 'a' + defragRound % 26)).ok());
+      }
+      ASSERT_TRUE(b->put("k", std::to_string(defragRound)).ok());
+    });
+    ASSERT_TRUE(status.ok()) << status.toString();
+  }
+
+  status = db->update([](TX* tx) {
+    ASSERT_TRUE(tx->bucket("b")->put("done", "").ok());
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  int wstatus;
+  ASSERT_EQ(pid, waitpid(pid, &wstatus, 0));
+  ASSERT_TRUE(WIFEXITED(wstatus));
+  ASSERT_EQ(0, WEXITSTATUS(wstatus));
+
+  db->close();
+  delete db;
+
+  // nor is the writer opened next to such a reader
+  status = DB::open(plain, "testMultiProcess", &other);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  ASSERT_FALSE(DB::open(options, "testMultiProcess", &db).ok());
+  other->close();
+  delete other;
+  status = DB::open(options, "testMultiProcess", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  db->close();
+  delete db;
+
+  unlink("testMultiProcess");
+  unlink("testMultiProcess-lock");
+}
+
+// Indexes "name|city" by the city, the values without a city are skipped.
+static bool cityOf(const std::string& /*k*/, const std::string& v, std::string* city) {
+
+  auto pos = v.find('|');
+  if (pos == std::string::npos) {
+    return false;
+  }
+  *city = v.substr(pos + 1);
+
+  return true;
+}
+
+TEST(TestDBImpl, index) {
+  DB *db;
+  unlink("testIndex");
+  Status status = DB::open(Options{}, "testIndex", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  status = db->update([](TX* tx) {
+    Bucket* b = tx->createBucket("users");
+    for (int i = 0; i < 1000; i++) {
+      ASSERT_TRUE(b->put(keyOf(i), "user|city" + std::to_string(i % 10)).ok());
+    }
+    ASSERT_TRUE(b->put("nocity", "user").ok());
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  ASSERT_TRUE(db->createIndex("missing", "byCity", cityOf).isNotFound());
+  ASSERT_TRUE(db->createIndex("users", "byCity", cityOf).ok());
+
+  status = db->view([](TX* tx) {
+    std::vector<std::string> keys;
+    ASSERT_TRUE(tx->bucket("byCity")->indexLookup("city3", &keys).ok());
+    ASSERT_EQ(100, keys.size());
+    ASSERT_EQ(keyOf(3), keys[0]);
+    ASSERT_EQ(keyOf(993), keys[99]);
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  status = db->update([](TX* tx) {
+    Bucket* b = tx->bucket("users");
+    // moves 3 to city30, which shares the prefix with city3
+    ASSERT_TRUE(b->put(keyOf(3), "user|city30").ok());
+    ASSERT_TRUE(b->del(keyOf(13)).ok());
+    ASSERT_TRUE(b->put(keyOf(23), "user").ok());
+    ASSERT_TRUE(b->put(keyOf(33), "user|city3").ok());
+    WriteBatch batch;
+    batch.put(keyOf(1003), "new|city3");
+    batch.del(keyOf(43));
+    batch.put(keyOf(53), "user|city30");
+    ASSERT_TRUE(b->write(batch).ok());
+
+    // the index is read with the writes of the transaction
+    std::vector<std::string> keys;
+    ASSERT_TRUE(tx->bucket("byCity")->indexLookup("city30", &keys).ok());
+    ASSERT_EQ((std::vector<std::string>{keyOf(3), keyOf(53)}), keys);
+    ASSERT_TRUE(b->put(keyOf(63), "user|city30").ok());
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  db->close();
+  delete db;
+
+  // declared again after opening, it's not built again
+  status = DB::open(Options{}, "testIndex", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  ASSERT_TRUE(db->createIndex("users", "byCity", cityOf).ok());
+
+  status = db->update([](TX* tx) {
+    ASSERT_TRUE(tx->bucket("users")->put(keyOf(73), "user|city4").ok());
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  status = db->view([](TX* tx) {
+    Bucket* index = tx->bucket("byCity");
+    std::vector<std::string> keys;
+    ASSERT_TRUE(index->indexLookup("city30", &keys).ok());
+    ASSERT_EQ((std::vector<std::string>{keyOf(3), keyOf(53), keyOf(63)}), keys);
+    ASSERT_TRUE(index->indexLookup("city3", &keys).ok());
+    ASSERT_EQ(94, keys.size());
+    ASSERT_EQ(keyOf(33), keys[0]);
+    ASSERT_EQ(keyOf(1003), keys.back());
+    ASSERT_TRUE(index->indexLookup("city4", &keys).ok());
+    ASSERT_EQ(101, keys.size());
+    ASSERT_TRUE(index->indexLookup("", &keys).ok());
+    ASSERT_TRUE(keys.empty());
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  db->close();
+  delete db;
+  unlink("testIndex");
+}
+
+TEST(TestDBImpl, indexKeyPrefix) {
+  DB *db;
+  unlink("testIndexKeyPrefix");
+  Status status = DB::open(Options{}, "testIndexKeyPrefix", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  // "city3" and "0abc" are the bytes of "city30" and "abc"
+  status = db->update([](TX* tx) {
+    Bucket* b = tx->createBucket("users");
+    ASSERT_TRUE(b->put("0abc", "user|city3").ok());
+    ASSERT_TRUE(b->put("abc", "user|city30").ok());
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+  ASSERT_TRUE(db->createIndex("users", "byCity", cityOf).ok());
+
+  status = db->update([](TX* tx) {
+    Bucket* index = tx->bucket("byCity");
+    std::vector<std::string> keys;
+    ASSERT_TRUE(index->indexLookup("city3", &keys).ok());
+    ASSERT_EQ((std::vector<std::string>{"0abc"}), keys);
+    ASSERT_TRUE(index->indexLookup("city30", &keys).ok());
+    ASSERT_EQ((std::vector<std::string>{"abc"}), keys);
+
+    ASSERT_TRUE(tx->bucket("users")->del("abc").ok());
+    WriteBatch batch;
+    batch.put("1abc", "user|city3");
+    ASSERT_TRUE(tx->bucket("users")->write(batch).ok());
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  status = db->view([](TX* tx) {
+    Bucket* index = tx->bucket("byCity");
+    std::vector<std::string> keys;
+    ASSERT_TRUE(index->indexLookup("city3", &keys).ok());
+    ASSERT_EQ((std::vector<std::string>{"0abc", "1abc"}), keys);
+    ASSERT_TRUE(index->indexLookup("city30", &keys).ok());
+    ASSERT_TRUE(keys.empty());
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  db->close();
+  delete db;
+  unlink("testIndexKeyPrefix");
+}
+
+static std::atomic<int> filterStep;
+
+TEST(TestDBImpl, filter) {
+  DB *db;
+  unlink("testFilter");
+  Options options{};
+  options.filterBitsPerKey = 10;
+  // the mapping can't grow while the reader holds it
+  options.initialMmapSize = 16 << 20;
+  options.enableStatistics = true;
+  Status status = DB::open(options, "testFilter", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  status = db->update([](TX* tx) {
+    Bucket* b = tx->createBucket("b");
+    ASSERT_TRUE(b->put("x", "v").ok());
+    for (int i = 0; i < 100; i++) {
+      ASSERT_TRUE(b->put(keyOf(i), "v").ok());
+    }
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  // reads the snapshot with "x" after the filter is rebuilt without it
+  filterStep = 0;
+  std::thread reader([db]() {
+    Status s = db->view([](TX* tx) {
+      filterStep = 1;
+      while (filterStep != 2) {
+        std::this_thread::yield();
+      }
+      std::string v;
+      ASSERT_TRUE(tx->bucket("b")->get("x", &v).ok());
+    });
+    ASSERT_TRUE(s.ok());
+  });
+  while (filterStep != 1) {
+    std::this_thread::yield();
+  }
+
+  // fills the filter built from the first commit
+  status = db->update([](TX* tx) {
+    Bucket* b = tx->bucket("b");
+    ASSERT_TRUE(b->del("x").ok());
+    for (int i = 100; i < 3000; i++) {
+      ASSERT_TRUE(b->put(keyOf(i), "v").ok());
+    }
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  status = db->update([](TX* tx) {
+    Bucket* b = tx->bucket("b");
+    std::string v;
+    ASSERT_TRUE(b->get("x", &v).isNotFound());
+    ASSERT_TRUE(b->put(keyOf(5000), "new").ok());
+    ASSERT_TRUE(b->get(keyOf(5000), &v).ok());
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  filterStep = 2;
+  reader.join();
+
+  status = db->view([](TX* tx) {
+    Bucket* b = tx->bucket("b");
+    std::string v;
+    for (int i = 0; i < 3000; i++) {
+      ASSERT_TRUE(b->get(keyOf(i), &v).ok()) << i;
+    }
+    ASSERT_TRUE(b->get(keyOf(5000), &v).ok());
+    for (int i = 10000; i < 20000; i++) {
+      ASSERT_TRUE(b->get(keyOf(i), &v).isNotFound()) << i;
+    }
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  // about 1% are false positives
+  ASSERT_GT(db->stats().ticker(DBStats::kFilterNegatives), 9500);
+
+  db->close();
+  delete db;
+  unlink("testFilter");
+}
+
+// Orders the keys backwards.
+class ReverseComparator : public Comparator {
+ public:
+  int compare(std::string_view a, std::string_view b) const override { return b.compare(a); }
+  uint8_t id() const override { return 16; }
+};
+
+// Takes the id of the uint64 comparator.
+class ReservedComparator : public Comparator {
+ public:
+  int compare(std::string_view a, std::string_view b) const override { return a.compare(b); }
+  uint8_t id() const override { return 1; }
+};
+
+static std::string uint64Of(uint64_t v) {
+  std::string k(8, 0);
+  for (int i = 7; i >= 0; i--, v >>= 8) {
+    k[i] = (char) (v & 0xff);
+  }
+  return k;
+}
+
+TEST(TestDBImpl, comparator) {
+  DB *db;
+  unlink("testComparator");
+  static ReverseComparator reverse;
+  Options options{};
+  options.comparators.push_back(&reverse);
+  Status status = DB::open(options, "testComparator", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  status = db->update([](TX* tx) {
+    static ReservedComparator reserved;
+    ASSERT_TRUE(tx->createBucket("reserved", &reserved) == nullptr);
+    ASSERT_TRUE(tx->createFixedWidthBucket("reserved", 8, 8, &reserved) == nullptr);
+    Bucket* ids = tx->createBucket("ids", uint64Comparator());
+    Bucket* rev = tx->createBucket("rev", &reverse);
+    ASSERT_TRUE(ids->put("short", "v").isInvalidArgument());
+    WriteBatch batch;
+    batch.put(uint64Of(1), "v");
+    batch.put("short", "v");
+    ASSERT_TRUE(ids->write(batch).isInvalidArgument());
+
+    for (uint64_t i = 0; i < 3000; i++) {
+      // the integers crossing the byte boundaries
+      ASSERT_TRUE(ids->put(uint64Of(i * 257), std::to_string(i)).ok());
+      ASSERT_TRUE(rev->put(keyOf(i), std::to_string(i)).ok());
+    }
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  status = db->update([](TX* tx) {
+    Bucket* ids = tx->bucket("ids");
+    Bucket* rev = tx->bucket("rev");
+    WriteBatch batch;
+    for (uint64_t i = 0; i < 3000; i += 2) {
+      ASSERT_TRUE(rev->del(keyOf(i)).ok());
+      batch.del(uint64Of(i * 257));
+    }
+    ASSERT_TRUE(ids->write(batch).ok());
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  db->close();
+  delete db;
+
+  status = DB::open(options, "testComparator", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  status = db->view([](TX* tx) {
+    Bucket* ids = tx->bucket("ids");
+    Bucket* rev = tx->bucket("rev");
+    std::string v;
+    for (uint64_t i = 0; i < 3000; i++) {
+      ASSERT_EQ(i % 2 == 1, ids->get(uint64Of(i * 257), &v).ok()) << i;
+      ASSERT_EQ(i % 2 == 1, rev->get(keyOf(i), &v).ok()) << i;
+    }
+    ASSERT_TRUE(ids->get("short", &v).isNotFound());
+
+    std::vector<std::string> keys{uint64Of(257 * 7), "short", uint64Of(257 * 3), uint64Of(257 * 4)};
+    std::vector<std::string> values;
+    std::vector<Status> statuses;
+    ids->multiGet(keys, &values, &statuses);
+    ASSERT_EQ("7", values[0]);
+    ASSERT_TRUE(statuses[1].isNotFound());
+    ASSERT_EQ("3", values[2]);
+    ASSERT_TRUE(statuses[3].isNotFound());
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+  db->close();
+  delete db;
+
+  // the bucket is not opened without its comparator
+  status = DB::open(Options{}, "testComparator", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  status = db->view([](TX* tx) {
+    ASSERT_TRUE(tx->bucket("ids") != nullptr);
+    ASSERT_TRUE(tx->bucket("rev") == nullptr);
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  db->close();
+  delete db;
+  unlink("testComparator");
+}
+
+// Indexes the values by their parity.
+static bool parityOf(const std::string& /*k*/, const std::string& v, std::string* parity) {
+  *parity = std::stoi(v) % 2 == 0 ? "even" : "odd";
+  return true;
+}
+
+TEST(TestDBImpl, comparatorFromFirstKey) {
+  DB *db;
+  unlink("testComparatorFirst");
+  static ReverseComparator reverse;
+  Options options{};
+  options.comparators.push_back(&reverse);
+  options.filterBitsPerKey = 10;
+  Status status = DB::open(options, "testComparatorFirst", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  // "" is the last key in the reverse order, the scans from it start at the first
+  status = db->update([](TX* tx) {
+    Bucket* rev = tx->createBucket("rev", &reverse);
+    for (int i = 0; i < 3000; i++) {
+      ASSERT_TRUE(rev->put(keyOf(i), std::to_string(i)).ok());
+    }
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  // the filter is built by the writer opening the bucket
+  status = db->update([](TX* tx) {
+    std::string v;
+    ASSERT_TRUE(tx->bucket("rev")->get(keyOf(1234), &v).ok());
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+  ASSERT_TRUE(db->createIndex("rev", "byParity", parityOf).ok());
+
+  status = db->view([](TX* tx) {
+    Bucket* rev = tx->bucket("rev");
+    std::string v;
+    for (int i = 0; i < 3000; i++) {
+      ASSERT_TRUE(rev->get(keyOf(i), &v).ok()) << i;
+    }
+
+    int n = 0;
+    std::string prev;
+    static_cast<BucketImpl*>(rev)->scan("", [&](const std::string& k, const std::string&) {
+      EXPECT_TRUE(prev.empty() || k < prev);
+      prev = k;
+      return ++n > 0;
+    });
+    ASSERT_EQ(3000, n);
+
+    std::atomic<int> scanned(0);
+    ASSERT_TRUE(rev->parallelScan("", "", 4, [&](const std::string&, const std::string&) {
+      scanned++;
+      return true;
+    }).ok());
+    ASSERT_EQ(3000, scanned);
+
+    std::vector<std::string> keys;
+    ASSERT_TRUE(tx->bucket("byParity")->indexLookup("odd", &keys).ok());
+    ASSERT_EQ(1500, keys.size());
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  db->close();
+  delete db;
+  unlink("testComparatorFirst");
+}
+
+TEST(TestDBImpl, fixedWidth) {
+  DB *db;
+  unlink("testFixedWidth");
+  unlink("testFixedWidthCopy");
+  Status status = DB::open(Options{}, "testFixedWidth", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  status = db->update([](TX* tx) {
+    ASSERT_TRUE(tx->createFixedWidthBucket("none", 0, 8) == nullptr);
+    Bucket* b = tx->createFixedWidthBucket("counters", 8, 8, uint64Comparator());
+    ASSERT_TRUE(b->put(uint64Of(1), "short").isInvalidArgument());
+    ASSERT_TRUE(b->put("short", uint64Of(1)).isInvalidArgument());
+    WriteBatch batch;
+    for (uint64_t i = 0; i < 5000; i++) {
+      batch.put(uint64Of(i * 3), uint64Of(i));
+    }
+    ASSERT_TRUE(b->write(batch).ok());
+
+    Bucket* small = tx->createFixedWidthBucket("small", 4, 0);
+    ASSERT_TRUE(small->put("abcd", "").ok());
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  status = db->update([](TX* tx) {
+    Bucket* b = tx->bucket("counters");
+    for (uint64_t i = 0; i < 5000; i += 2) {
+      ASSERT_TRUE(b->del(uint64Of(i * 3)).ok());
+    }
+    ASSERT_TRUE(b->put(uint64Of(1), uint64Of(42)).ok());
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  db->close();
+  delete db;
+
+  status = DB::compact("testFixedWidth", "testFixedWidthCopy", 0, nullptr);
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  for (auto name : {"testFixedWidth", "testFixedWidthCopy"}) {
+    status = DB::open(Options{}, name, &db);
+    ASSERT_TRUE(status.ok()) << status.toString();
+    status = db->view([](TX* tx) {
+      Bucket* b = tx->bucket("counters");
+      std::string v;
+      for (uint64_t i = 0; i < 5000; i++) {
+        ASSERT_EQ(i % 2 == 1, b->get(uint64Of(i * 3), &v).ok()) << i;
+        if (i % 2 == 1) {
+          ASSERT_EQ(uint64Of(i), v);
+        }
+      }
+      ASSERT_TRUE(b->get(uint64Of(1), &v).ok());
+      ASSERT_EQ(uint64Of(42), v);
+      ASSERT_TRUE(b->get(uint64Of(2), &v).isNotFound());
+      ASSERT_TRUE(b->get("short", &v).isNotFound());
+
+      BucketImpl* small = static_cast<BucketImpl*>(tx->bucket("small"));
+      ASSERT_EQ(0, small->header().rootPageID);
+      ASSERT_TRUE(small->get("abcd", &v).ok());
+    });
+    ASSERT_TRUE(status.ok()) << status.toString();
+    db->close();
+    delete db;
+  }
+
+  unlink("testFixedWidth");
+  unlink("testFixedWidthCopy");
+}
+
+static void copyFile(const std::string& from, const std::string& to) {
+  std::ifstream in(from, std::ios::binary);
+  std::ofstream out(to, std::ios::binary);
+  out << in.rdbuf();
+}
+
+static off_t sizeOf(const std::string& name) {
+  struct stat st;
+  return stat(name.data(), &st) == 0 ? st.st_size : -1;
+}
+
+static void checkWal(TX* tx) {
+  Bucket* b = tx->bucket("b");
+  std::string v;
+  for (int i = 0; i < 2000; i++) {
+    ASSERT_EQ(i % 3 != 0, b->get(keyOf(i), &v).ok()) << i;
+    if (i % 3 != 0) {
+      ASSERT_EQ(i % 5 == 0 ? "batch" : std::string(100, 'a'), v) << i;
+    }
+  }
+  ASSERT_EQ(7, b->sequence());
+
+  Bucket* sub = static_cast<BucketImpl*>(b)->bucket("sub");
+  ASSERT_TRUE(sub->get(uint64Of(42), &v).ok());
+  ASSERT_EQ(uint64Of(1), v);
+}
+
+TEST(TestDBImpl, wal) {
+  DB *db;
+  for (auto name : {"testWal", "testWal-wal", "testWalCopy", "testWalCopy-wal"}) {
+    unlink(name);
+  }
+
+  Options options{};
+  options.walMode = true;
+  options.enableStatistics = true;
+  options.walCheckpointPages = 100000;
+  options.multiProcess = true;
+  ASSERT_TRUE(DB::open(options, "testWal", &db).isInvalidArgument());
+  delete db;
+
+  options.multiProcess = false;
+  Status status = DB::open(options, "testWal", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  off_t fileSize = sizeOf("testWal");
+
+  status = db->update([](TX* tx) {
+    Bucket* b = tx->createBucket("b");
+    for (int i = 0; i < 2000; i++) {
+      ASSERT_TRUE(b->put(keyOf(i), std::string(100, 'a')).ok());
+    }
+    Bucket* sub = static_cast<BucketImpl*>(b)->createBucket("sub", uint64Comparator(), 8, 8);
+    ASSERT_TRUE(sub->put(uint64Of(42), uint64Of(1)).ok());
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  status = db->update([](TX* tx) {
+    Bucket* b = tx->bucket("b");
+    WriteBatch batch;
+    for (int i = 0; i < 2000; i += 5) {
+      batch.put(keyOf(i), "batch");
+    }
+    ASSERT_TRUE(b->write(batch).ok());
+    for (int i = 0; i < 2000; i += 3) {
+      ASSERT_TRUE(b->del(keyOf(i)).ok());
+    }
+    ASSERT_TRUE(b->setSequence(7).ok());
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  // the pages are in the memory until the checkpoint
+  ASSERT_TRUE(db->view(checkWal).ok());
+  ASSERT_EQ(fileSize, sizeOf("testWal"));
+  DBStats stats = db->stats();
+  uint64_t walBytes = stats.ticker(DBStats::kWalBytes);
+  ASSERT_LT(0, walBytes);
+  ASSERT_LE(walBytes, sizeOf("testWal-wal"));
+  ASSERT_EQ(0, stats.ticker(DBStats::kCheckpoints));
+
+  // a crash leaves the file and the log, with a torn record at the end
+  copyFile("testWal", "testWalCopy");
+  copyFile("testWal-wal", "testWalCopy-wal");
+  {
+    std::fstream out("testWalCopy-wal", std::ios::binary | std::ios::in | std::ios::out);
+    out.seekp(walBytes);
+    out << std::string(100, 'x');
+  }
+
+  db->close();
+  ASSERT_EQ(1, db->stats().ticker(DBStats::kCheckpoints));
+  ASSERT_EQ(0, sizeOf("testWal-wal"));
+  delete db;
+
+  options.walCheckpointPages = 1;
+  status = DB::open(options, "testWalCopy", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  ASSERT_EQ(1, db->stats().ticker(DBStats::kCheckpoints));
+  ASSERT_EQ(0, sizeOf("testWalCopy-wal"));
+  ASSERT_TRUE(db->view(checkWal).ok());
+
+  // checkpoints once the pages are over the limit
+  status = db->update([](TX* tx) {
+    ASSERT_TRUE(tx->bucket("b")->put(keyOf(0), "new").ok());
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+  ASSERT_EQ(2, db->stats().ticker(DBStats::kCheckpoints));
+  ASSERT_EQ(0, sizeOf("testWalCopy-wal"));
+  db->close();
+  delete db;
+
+  // the checkpointed file opens without the log
+  status = DB::open(Options{}, "testWalCopy", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  status = db->view([](TX* tx) {
+    std::string v;
+    ASSERT_TRUE(tx->bucket("b")->get(keyOf(0), &v).ok());
+    ASSERT_EQ("new", v);
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+  db->close();
+  delete db;
+
+  for (auto name : {"testWal", "testWal-wal", "testWalCopy", "testWalCopy-wal"}) {
+    unlink(name);
+  }
+}
+
+static void putSync(TX* tx) {
+  Bucket* b = tx->bucket("b");
+  if (b == nullptr) {
+    b = tx->createBucket("b");
+  }
+  for (int i = 0; i < 2000; i++) {
+    ASSERT_TRUE(b->put(keyOf(i), std::string(1000, 'a')).ok());
+  }
+}
+
+static bool hasSync(const std::string& name) {
+  DB *db;
+  Status status = DB::open(Options{}, name, &db);
+  EXPECT_TRUE(status.ok()) << status.toString();
+  static bool found;
+  found = false;
+  db->view([](TX* tx) { found = tx->bucket("b") != nullptr; });
+  db->close();
+  delete db;
+  return found;
+}
+
+TEST(TestDBImpl, syncMode) {
+  DB *db;
+  unlink("testSyncMode");
+  unlink("testSyncModeCopy");
+  Options options{};
+  options.enableStatistics = true;
+  options.syncMode = Options::kSyncPeriodic;
+  options.multiProcess = true;
+  ASSERT_TRUE(DB::open(options, "testSyncMode", &db).isInvalidArgument());
+  delete db;
+  options.multiProcess = false;
+
+  for (auto mode : {Options::kSyncFull, Options::kSyncData, Options::kSyncPeriodic, Options::kSyncNone}) {
+    options.syncMode = mode;
+    for (auto wal : {false, true}) {
+      options.walMode = wal;
+      unlink("testSyncMode");
+      Status status = DB::open(options, "testSyncMode", &db);
+      ASSERT_TRUE(status.ok()) << status.toString();
+      status = db->update(putSync);
+      ASSERT_TRUE(status.ok()) << status.toString();
+      // the commit doesn't sync but the initialization does
+      uint64_t syncs = db->stats().histogram(DBStats::kFsyncMicros).count;
+      ASSERT_EQ(mode == Options::kSyncNone ? 0 : (mode == Options::kSyncPeriodic ? 1 : 2 + !wal), syncs);
+      db->close();
+      delete db;
+      unlink("testSyncMode-wal");
+      ASSERT_TRUE(hasSync("testSyncMode")) << mode << wal;
+    }
+  }
+
+  // the file stays on the last synced commit
+  unlink("testSyncMode");
+  options.syncMode = Options::kSyncPeriodic;
+  options.walMode = false;
+  options.syncIntervalMs = 3600 * 1000;
+  options.syncBytes = 1 << 20;
+  Status status = DB::open(options, "testSyncMode", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  status = db->update([](TX* tx) { ASSERT_TRUE(tx->createBucket("b") != nullptr); });
+  ASSERT_TRUE(status.ok()) << status.toString();
+  copyFile("testSyncMode", "testSyncModeCopy");
+  ASSERT_FALSE(hasSync("testSyncModeCopy"));
+
+  // synced once the bytes are over the limit
+  status = db->update(putSync);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  for (int i = 0; i < 500 && db->stats().histogram(DBStats::kFsyncMicros).count < 3; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  ASSERT_EQ(3, db->stats().histogram(DBStats::kFsyncMicros).count);
+  copyFile("testSyncMode", "testSyncModeCopy");
+  ASSERT_TRUE(hasSync("testSyncModeCopy"));
+
+  db->close();
+  delete db;
+  unlink("testSyncMode");
+  unlink("testSyncModeCopy");
+}
+
+static const int kBudgetKeys = 20000;
+
+// Rewrites the keys, the reads see the nodes spilled before them.
+static void rewriteBudget(TX* tx) {
+  Bucket* b = tx->bucket("big");
+  Bucket* small = tx->bucket("small");
+  std::string v;
+  for (int i = 0; i < kBudgetKeys; i++) {
+    ASSERT_TRUE(b->put(keyOf(i), std::string(100, 'b')).ok());
+    if (i % 1000 == 0) {
+      ASSERT_TRUE(small->put(keyOf(i), "s").ok());
+      ASSERT_TRUE(b->get(keyOf(i / 2), &v).ok());
+      ASSERT_EQ(std::string(100, 'b'), v);
+    }
+  }
+  for (int i = 0; i < kBudgetKeys; i += 3) {
+    ASSERT_TRUE(b->del(keyOf(i)).ok());
+  }
+  ASSERT_TRUE(b->get(keyOf(3), &v).isNotFound());
+  ASSERT_TRUE(small->get(keyOf(2000), &v).ok());
+}
+
+static void fillBudget(TX* tx) {
+  Bucket* b = tx->createBucket("big");
+  WriteBatch batch;
+  for (int i = 0; i < kBudgetKeys; i++) {
+    batch.put(keyOf(i), std::string(100, 'a'));
+  }
+  ASSERT_TRUE(b->write(batch).ok());
+  ASSERT_TRUE(tx->createBucket("small") != nullptr);
+  // the entries of the index are not 8 bytes, which fails the commits
+  ASSERT_TRUE(tx->createFixedWidthBucket("fixed", 8, 8) != nullptr);
+  ASSERT_TRUE(tx->createBucket("users") != nullptr);
+}
+
+static bool userOf(const std::string& /*k*/, const std::string& v, std::string* ik) {
+  *ik = v;
+  return true;
+}
+
+// Returns the size of the file after the rewrite, aborted before if 'abort'.
+static off_t rewriteWithBudget(bool wal, bool abort) {
+  DB* db;
+  unlink("testTxMemoryBudget");
+  unlink("testTxMemoryBudget-wal");
+  Options options{};
+  options.enableStatistics = true;
+  options.walMode = wal;
+  // the pages freed are reused after the checkpoints
+  options.walCheckpointPages = 1;
+  options.txMemoryBudget = 64 << 10;
+  Status status = DB::open(options, "testTxMemoryBudget", &db);
+  EXPECT_TRUE(status.ok()) << status.toString();
+
+  EXPECT_TRUE(db->update(fillBudget).ok());
+  EXPECT_TRUE(db->createIndex("users", "fixed", userOf).ok());
+  EXPECT_GT(db->stats().ticker(DBStats::kPagesSpilledEarly), 0);
+
+  if (abort) {
+    status = db->update([](TX* tx) {
+      rewriteBudget(tx);
+      ASSERT_TRUE(tx->bucket("users")->put("u", "user").ok());
+    });
+    EXPECT_TRUE(status.isInvalidArgument()) << status.toString();
+  }
+
+  uint64_t spilled = db->stats().ticker(DBStats::kPagesSpilledEarly);
+  EXPECT_TRUE(db->update(rewriteBudget).ok());
+  EXPECT_GT(db->stats().ticker(DBStats::kPagesSpilledEarly), spilled);
+
+  status = db->view([](TX* tx) {
+    Bucket* b = tx->bucket("big");
+    std::string v;
+    for (int i = 0; i < kBudgetKeys; i++) {
+      if (i % 3 == 0) {
+        ASSERT_TRUE(b->get(keyOf(i), &v).isNotFound());
+      } else {
+        ASSERT_TRUE(b->get(keyOf(i), &v).ok());
+        ASSERT_EQ(std::string(100, 'b'), v);
+      }
+    }
+    ASSERT_TRUE(tx->bucket("small")->get(keyOf(19000), &v).ok());
+    ASSERT_TRUE(tx->bucket("users")->get("u", &v).isNotFound());
+  });
+  EXPECT_TRUE(status.ok()) << status.toString();
+
+  db->close();
+  delete db;
+
+  off_t size = sizeOf("testTxMemoryBudget");
+  unlink("testTxMemoryBudget");
+  unlink("testTxMemoryBudget-wal");
+
+  return size;
+}
+
+TEST(TestDBImpl, txMemoryBudget) {
+  for (auto wal : {false, true}) {
+    // the aborted transaction gives its spilled pages back
+    ASSERT_EQ(rewriteWithBudget(wal, false), rewriteWithBudget(wal, true)) << wal;
+  }
+}
+
+static void putMapped(TX* tx) {
+  Bucket* b = tx->bucket("b");
+  if (b == nullptr) {
+    b = tx->createBucket("b");
+  }
+  for (int i = 0; i < 20000; i++) {
+    ASSERT_TRUE(b->put(keyOf(i), std::string(i % 1000 == 0 ? 10000 : 100, 'm')).ok());
+  }
+}
+
+static void checkMapped(TX* tx) {
+  Bucket* b = tx->bucket("b");
+  std::string v;
+  for (int i = 0; i < 20000; i++) {
+    ASSERT_TRUE(b->get(keyOf(i), &v).ok());
+    ASSERT_EQ(std::string(i % 1000 == 0 ? 10000 : 100, 'm'), v);
+  }
+}
+
+TEST(TestDBImpl, writableMmap) {
+  DB *db;
+  unlink("testWritableMmap");
+  Options options{};
+  options.writableMmap = true;
+  options.walMode = true;
+  ASSERT_TRUE(DB::open(options, "testWritableMmap", &db).isInvalidArgument());
+  delete db;
+  options.walMode = false;
+
+  Status status = DB::open(options, "testWritableMmap", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  status = db->update(putMapped);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  // the pages past the end are written through the mapping
+  ASSERT_EQ(0, sizeOf("testWritableMmap") % (16 << 20));
+  status = db->view(checkMapped);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  status = db->update(putMapped);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  db->close();
+  delete db;
+
+  status = DB::open(Options{}, "testWritableMmap", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  status = db->view(checkMapped);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  db->close();
+  delete db;
+  unlink("testWritableMmap");
+}
+
+static const int kScanKeys = 30000;
+
+static void checkParallelScan(TX* tx) {
+  Bucket* b = tx->bucket("b");
+  for (int threads : {1, 3, 8}) {
+    std::mutex mu;
+    std::set<std::string> keys;
+    ASSERT_TRUE(b->parallelScan("", "", threads, [&](const std::string& k, const std::string& v) {
+      EXPECT_EQ(k + "v", v);
+      std::lock_guard<std::mutex> lock(mu);
+      EXPECT_TRUE(keys.insert(k).second);
+      return true;
+    }).ok());
+    // the sub bucket is skipped
+    ASSERT_EQ(kScanKeys, keys.size());
+
+    std::vector<std::string> ordered;
+    ASSERT_TRUE(b->parallelScan(keyOf(100), keyOf(25000), threads,
+        [&](const std::string& k, const std::string&) {
+      ordered.push_back(k);
+      return true;
+    }, true).ok());
+    ASSERT_EQ(24900, ordered.size());
+    for (int i = 0; i < 24900; i++) {
+      ASSERT_EQ(keyOf(i + 100), ordered[i]);
+    }
+
+    // stops at the first false
+    ordered.clear();
+    ASSERT_TRUE(b->parallelScan(keyOf(5), "", threads, [&](const std::string& k, const std::string&) {
+      ordered.push_back(k);
+      return ordered.size() < 10;
+    }, true).ok());
+    ASSERT_EQ(10, ordered.size());
+    ASSERT_EQ(keyOf(14), ordered.back());
+
+    std::atomic<int> count(0);
+    ASSERT_TRUE(b->parallelScan(keyOf(7), keyOf(7), threads, [&](const std::string&, const std::string&) {
+      count++;
+      return true;
+    }).ok());
+    ASSERT_EQ(0, count);
+  }
+  ASSERT_TRUE(b->parallelScan("", "", 0, [](const std::string&, const std::string&) {
+    return true;
+  }).isInvalidArgument());
+}
+
+TEST(TestDBImpl, parallelScan) {
+  DB *db;
+  unlink("testParallelScan");
+  Status status = DB::open(Options{}, "testParallelScan", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  status = db->update([](TX* tx) {
+    Bucket* b = tx->createBucket("b");
+    WriteBatch batch;
+    for (int i = 0; i < kScanKeys; i++) {
+      batch.put(keyOf(i), keyOf(i) + "v");
+    }
+    ASSERT_TRUE(b->write(batch).ok());
+    ASSERT_TRUE(static_cast<BucketImpl*>(b)->createBucket("key00001000x") != nullptr);
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  status = db->view(checkParallelScan);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  // the nodes changed by the transaction are scanned too
+  status = db->update([](TX* tx) {
+    Bucket* b = tx->bucket("b");
+    for (int i = 0; i < kScanKeys; i += 7) {
+      ASSERT_TRUE(b->put(keyOf(i), keyOf(i) + "v").ok());
+    }
+    checkParallelScan(tx);
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  db->close();
+  delete db;
+  unlink("testParallelScan");
+}
+
+// the pages of the latest snapshot corrupted by TestDBImpl.check
+static uint64_t checkFreelistID;
+static uint64_t checkRootID;
+
+// Overwrites 'size' bytes at 'offset' of the file with 'data', returns the
+// bytes overwritten.
+static std::string patchFile(const std::string& name, off_t offset, const void* data, size_t size) {
+  std::fstream f(name, std::ios::binary | std::ios::in | std::ios::out);
+  std::string old(size, 0);
+  f.seekg(offset);
+  f.read(&old[0], size);
+  f.seekp(offset);
+  f.write(static_cast<const char*>(data), size);
+  return old;
+}
+
+TEST(TestDBImpl, check) {
+  DB *db;
+  unlink("testCheck");
+  Options options{};
+  Status status = DB::open(options, "testCheck", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  status = db->update([](TX* tx) {
+    BucketImpl* b = static_cast<BucketImpl*>(tx->createBucket("b"));
+    for (int i = 0; i < 20000; i++) {
+      ASSERT_TRUE(b->put(keyOf(i), std::string(100, 'a')).ok());
+    }
+    ASSERT_TRUE(b->put("big", std::string(20000, 'x')).ok());
+    BucketImpl* c = b->createBucket("c", uint64Comparator());
+    for (int i = 0; i < 3000; i++) {
+      ASSERT_TRUE(c->put(uint64Of(i), keyOf(i)).ok());
+    }
+    Bucket* f = tx->createFixedWidthBucket("f", 8, 8);
+    for (int i = 0; i < 3000; i++) {
+      ASSERT_TRUE(f->put(uint64Of(i), uint64Of(i)).ok());
+    }
+    ASSERT_TRUE(b->createBucket("small")->put("k", "v").ok());
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  status = db->update([](TX* tx) {
+    Bucket* b = tx->bucket("b");
+    for (int i = 0; i < 20000; i++) {
+      if (i % 10 != 0) {
+        ASSERT_TRUE(b->del(keyOf(i)).ok());
+      }
+    }
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  status = db->view([](TX* tx) {
+    checkFreelistID = static_cast<TXImpl*>(tx)->meta().freelistPageID;
+    checkRootID = static_cast<BucketImpl*>(tx->bucket("b"))->header().rootPageID;
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  db->close();
+  delete db;
+
+  // both snapshots are consistent
+  CheckStats stats{};
+  for (int meta = -1; meta <= 1; meta++) {
+    for (int threads : {1, 4}) {
+      stats = CheckStats{};
+      status = DB::check(options, "testCheck", meta, threads, &stats);
+      ASSERT_TRUE(status.ok()) << status.toString() << " " << meta << " " << threads;
+      ASSERT_EQ(0, stats.problems);
+      ASSERT_LT(0, stats.freePages);
+      ASSERT_LT(0, stats.buckets);
+    }
+  }
+
+  status = DB::check(options, "testCheck", -1, 2, &stats);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  ASSERT_EQ(2 + 2003 + 3000 + 3000 + 1, stats.keys);
+  uint64_t freePages = stats.freePages;
+  ASSERT_EQ(sizeOf("testCheck") / sysconf(_SC_PAGESIZE), stats.pages + freePages);
+
+  // the free pages are leaked without the freelist
+  size_t pageSize = sysconf(_SC_PAGESIZE);
+  uint16_t count = 0;
+  std::string old = patchFile("testCheck", checkFreelistID * pageSize + 10, &count, sizeof(count));
+  stats = CheckStats{};
+  status = DB::check(options, "testCheck", -1, 4, &stats);
+  ASSERT_FALSE(status.ok());
+  ASSERT_EQ(freePages, stats.leakedPages);
+  ASSERT_EQ(freePages, stats.problems);
+  ASSERT_EQ(0, stats.freePages);
+  patchFile("testCheck", checkFreelistID * pageSize + 10, old.data(), old.size());
+
+  // the second child of the root points to the first one
+  uint64_t child;
+  {
+    std::ifstream in("testCheck", std::ios::binary);
+    in.seekg(checkRootID * pageSize + 16 + 8);
+    in.read(reinterpret_cast<char*>(&child), sizeof(child));
+  }
+  old = patchFile("testCheck", checkRootID * pageSize + 16 + 16 + 8, &child, sizeof(child));
+  stats = CheckStats{};
+  status = DB::check(options, "testCheck", -1, 4, &stats);
+  ASSERT_FALSE(status.ok());
+  ASSERT_LT(0, stats.doubleReferencedPages);
+  ASSERT_LT(0, stats.leakedPages);
+  ASSERT_FALSE(stats.errors.empty());
+  patchFile("testCheck", checkRootID * pageSize + 16 + 16 + 8, old.data(), old.size());
+
+  // a page with the id of another one
+  old = patchFile("testCheck", checkRootID * pageSize, &child, sizeof(child));
+  status = DB::check(options, "testCheck", -1, 1, &stats);
+  ASSERT_TRUE(status.isDataError()) << status.toString();
+  patchFile("testCheck", checkRootID * pageSize, old.data(), old.size());
+
+  status = DB::check(options, "testCheck", -1, 0, &stats);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  ASSERT_TRUE(DB::check(options, "testCheck", 2, 1, &stats).isInvalidArgument());
+
+  unlink("testCheck");
+}
+
+static void putOne(TX* tx) {
+  ASSERT_TRUE(tx->bucket("b")->put(keyOf(5), "one").ok());
+}
+
+static uint64_t freelistPageOf(const std::string& name) {
+  DB* db;
+  Options options{};
+  options.readOnly = true;
+  EXPECT_TRUE(DB::open(options, name, &db).ok());
+  static uint64_t id;
+  db->view([](TX* tx) { id = static_cast<TXImpl*>(tx)->meta().freelistPageID; });
+  db->close();
+  delete db;
+  return id;
+}
+
+TEST(TestDBImpl, noFreelistSync) {
+  DB *db;
+  unlink("testNoFreelistSync");
+  Options options{};
+  Status status = DB::open(options, "testNoFreelistSync", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  status = db->update([](TX* tx) {
+    Bucket* b = tx->createBucket("b");
+    for (int i = 0; i < 40000; i++) {
+      ASSERT_TRUE(b->put(keyOf(i), std::string(200, 'a')).ok());
+    }
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+  status = db->update([](TX* tx) {
+    Bucket* b = tx->bucket("b");
+    for (int i = 0; i < 40000; i++) {
+      if (i % 10 != 0) {
+        ASSERT_TRUE(b->del(keyOf(i)).ok());
+      }
+    }
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  TxStats synced{};
+  status = db->update(putOne, &synced);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  db->close();
+  delete db;
+
+  // the commits write the leaf, its parents and the meta only
+  options.noFreelistSync = true;
+  status = DB::open(options, "testNoFreelistSync", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  TxStats unsynced{};
+  status = db->update(putOne, &unsynced);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  ASSERT_LT(unsynced.bytesWritten + 2 * sysconf(_SC_PAGESIZE), synced.bytesWritten);
+  db->close();
+  delete db;
+  ASSERT_EQ(kNoFreelist, freelistPageOf("testNoFreelistSync"));
+
+  CheckStats stats{};
+  status = DB::check(options, "testNoFreelistSync", -1, 2, &stats);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  ASSERT_LT(1000, stats.freePages);
+  off_t size = sizeOf("testNoFreelistSync");
+
+  // the free pages found at open are reused
+  status = DB::open(options, "testNoFreelistSync", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  status = db->update([](TX* tx) {
+    Bucket* b = tx->bucket("b");
+    for (int i = 0; i < 40000; i += 10) {
+      ASSERT_TRUE(b->put(keyOf(i + 1), std::string(200, 'b')).ok());
+    }
+  });
+  ASSERT_TRUE(status.ok()) << status.toString();
+  db->close();
+  delete db;
+  ASSERT_EQ(size, sizeOf("testNoFreelistSync"));
+
+  status = DB::check(options, "testNoFreelistSync", -1, 2, &stats);
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  // the commits write the freelist again without the option
+  options.noFreelistSync = false;
+  status = DB::open(options, "testNoFreelistSync", &db);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  status = db->update(putOne);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  db->close();
+  delete db;
+  ASSERT_NE(kNoFreelist, freelistPageOf("testNoFreelistSync"));
+
+  status = DB::check(options, "testNoFreelistSync", -1, 2, &stats);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  ASSERT_EQ(0, stats.leakedPages);
+
+  unlink("testNoFreelistSync");
+}
+
 }  // namespace dbwheel
@@ -0,0 +1,284 @@
+// Copyright (c) 2020
+//
+#include "db/freelist.h"
+
+#include <algorithm>
+#include <iterator>
+
+#include "db/assert.h"
+#include "db/page.h"
+
+namespace dbwheel {
+
+uint64_t Freelist::allocate(size_t n) {
+
+  if (ids_.empty()) {
+    return 0;
+  }
+
+  uint64_t initial = 0, prev = 0;
+  for (size_t i = 0, s = ids_.size(); i < s; i++) {
+    uint64_t id = ids_[i];
+    ASSERTM(id > 1, "BUG: invalid page allocation");
+
+    // reset the initial page if this is not contiguous
+    if (prev == 0 || id - prev != 1) {
+      initial = id;
+    }
+
+    if (id - initial + 1 == n) {
+      auto begin = ids_.begin() + (i + 1 - n);
+      ids_.erase(begin, begin + n);
+      return initial;
+    }
+
+    prev = id;
+  }
+
+  return 0;
+}
+
+uint64_t Freelist::allocate(size_t n, uint64_t hint) {
+
+  uint64_t id = nearest(n, hint);
+  if (id != 0) {
+    auto begin = std::lower_bound(ids_.begin(), ids_.end(), id);
+    ids_.erase(begin, begin + n);
+  }
+
+  return id;
+}
+
+// Scans the runs of the contiguous pages outwards from 'hint', stops once
+// the runs are farther than the best one found.
+uint64_t Freelist::nearest(size_t n, uint64_t hint) const {
+
+  auto distance = [hint](uint64_t id) { return id > hint ? id - hint : hint - id; };
+
+  uint64_t best = 0;
+  auto better = [&](uint64_t first, uint64_t last) {
+    if (last - first + 1 < n) {
+      return;
+    }
+    uint64_t id = std::min(std::max(hint, first), last + 1 - n);
+    if (best == 0 || distance(id) < distance(best)) {
+      best = id;
+    }
+  };
+
+  size_t s = ids_.size();
+  size_t mid = std::lower_bound(ids_.begin(), ids_.end(), hint) - ids_.begin();
+  // the start of the run containing 'mid'
+  while (mid > 0 && mid < s && ids_[mid - 1] + 1 == ids_[mid]) {
+    mid--;
+  }
+
+  for (size_t i = mid; i < s;) {
+    if (best != 0 && ids_[i] > hint && ids_[i] - hint >= distance(best)) {
+      break;
+    }
+
+    size_t j = i;
+    while (j + 1 < s && ids_[j + 1] == ids_[j] + 1) {
+      j++;
+    }
+    better(ids_[i], ids_[j]);
+    i = j + 1;
+  }
+
+  for (size_t j = mid; j > 0;) {
+    if (best != 0 && hint - ids_[j - 1] >= distance(best)) {
+      break;
+    }
+
+    size_t i = j - 1;
+    while (i > 0 && ids_[i - 1] + 1 == ids_[i]) {
+      i--;
+    }
+    better(ids_[i], ids_[j - 1]);
+    j = i;
+  }
+
+  return best;
+}
+
+uint64_t Freelist::trim(uint64_t* pageID, uint64_t min) {
+
+  uint64_t n = 0;
+  while (!ids_.empty() && ids_.back() + 1 == *pageID && *pageID > min) {
+    ids_.pop_back();
+    (*pageID)--;
+    n++;
+  }
+
+  return n;
+}
+
+void Freelist::free(uint64_t txID, uint64_t pageID, uint32_t overflow) {
+
+  ASSERTM(pageID > 1, "cannot free the meta page");
+  auto it = std::lower_bound(ids_.begin(), ids_.end(), pageID);
+  ASSERTM(it == ids_.end() || *it > pageID + overflow, "page already freed");
+
+  auto& ids = pending_[txID];
+  for (uint64_t id = pageID; id <= pageID + overflow; id++) {
+    bool inserted = pendingIDs_.insert(id).second;
+    ASSERTM(inserted, "page already freed");
+    (void) inserted;
+    ids.push_back(id);
+  }
+}
+
+void Freelist::release(uint64_t txID) {
+
+  std::vector<uint64_t> ids;
+  for (auto it = pending_.begin(); it != pending_.end() && it->first <= txID;) {
+    ids.insert(ids.end(), it->second.begin(), it->second.end());
+    it = pending_.erase(it);
+  }
+
+  if (ids.empty()) {
+    return;
+  }
+
+  for (uint64_t id : ids) {
+    pendingIDs_.erase(id);
+  }
+
+  std::sort(ids.begin(), ids.end());
+
+  std::vector<uint64_t> merged;
+  merged.reserve(ids_.size() + ids.size());
+  std::merge(ids_.begin(), ids_.end(), ids.begin(), ids.end(), std::back_inserter(merged));
+  ids_.swap(merged);
+}
+
+void Freelist::rollback(uint64_t txID) {
+
+  auto it = pending_.find(txID);
+  if (it == pending_.end()) {
+    return;
+  }
+
+  for (uint64_t id : it->second) {
+    pendingIDs_.erase(id);
+  }
+  pending_.erase(it);
+}
+
+void Freelist::restore(uint64_t pageID, uint32_t overflow) {
+
+  auto it = std::lower_bound(ids_.begin(), ids_.end(), pageID);
+  for (uint64_t id = pageID + overflow; id >= pageID; id--) {
+    it = ids_.insert(it, id);
+  }
+}
+
+void Freelist::unfree(uint64_t txID, uint64_t pageID, uint32_t overflow) {
+
+  auto it = pending_.find(txID);
+  if (it == pending_.end()) {
+    return;
+  }
+
+  auto& ids = it->second;
+  ids.erase(std::remove_if(ids.begin(), ids.end(), [=](uint64_t id) {
+    return id >= pageID && id <= pageID + overflow;
+  }), ids.end());
+
+  for (uint64_t id = pageID; id <= pageID + overflow; id++) {
+    pendingIDs_.erase(id);
+  }
+}
+
+bool Freelist::freed(uint64_t pageID) const {
+
+  return std::binary_search(ids_.begin(), ids_.end(), pageID) || pendingIDs_.count(pageID) != 0;
+}
+
+std::vector<uint64_t> Freelist::pending() const {
+
+  std::vector<uint64_t> ids;
+  for (auto& e : pending_) {
+    ids.insert(ids.end(), e.second.begin(), e.second.end());
+  }
+  std::sort(ids.begin(), ids.end());
+
+  return ids;
+}
+
+size_t Freelist::count() const {
+
+  size_t c = ids_.size();
+  for (auto& e : pending_) {
+    c += e.second.size();
+  }
+
+  return c;
+}
+
+size_t Freelist::size() const {
+
+  size_t c = count();
+  if (c >= 0xFFFF) {
+    // the first element is used to store the count
+    c++;
+  }
+
+  return Page::kPageHeaderSize + c * sizeof(uint64_t);
+}
+
+void Freelist::read(Page* page) {
+
+  ASSERTM((page->flags() & Page::kFreeListPageFlag) != 0, "not a freelist page");
+
+  auto ids = reinterpret_cast<uint64_t*>(page->ptr_);
+  size_t c = page->count();
+  if (c == 0xFFFF) {
+    c = ids[0];
+    ids++;
+  }
+
+  ids_.assign(ids, ids + c);
+  std::sort(ids_.begin(), ids_.end());
+}
+
+void Freelist::reload(Page* page) {
+
+  read(page);
+
+  std::vector<uint64_t> pending;
+  for (auto& e : pending_) {
+    pending.insert(pending.end(), e.second.begin(), e.second.end());
+  }
+  std::sort(pending.begin(), pending.end());
+
+  std::vector<uint64_t> ids;
+  std::set_difference(ids_.begin(), ids_.end(), pending.begin(), pending.end(), std::back_inserter(ids));
+  ids_.swap(ids);
+}
+
+// Writes all the free and pending pages, since the pending ones are free
+// after a restart.
+void Freelist::write(Page* page) const {
+
+  std::vector<uint64_t> all(ids_);
+  for (auto& e : pending_) {
+    all.insert(all.end(), e.second.begin(), e.second.end());
+  }
+  std::sort(all.begin(), all.end());
+
+  page->flags(Page::kFreeListPageFlag);
+
+  auto ids = reinterpret_cast<uint64_t*>(page->ptr_);
+  if (all.size() < 0xFFFF) {
+    page->count(all.size());
+  } else {
+    page->count(0xFFFF);
+    *ids++ = all.size();
+  }
+
+  std::copy(all.begin(), all.end(), ids);
+}
+
+}  // namespace dbwheel
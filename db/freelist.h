@@ -0,0 +1,76 @@
+// Copyright (c) 2020
+//
+#ifndef DB_FREELIST_H_
+#define DB_FREELIST_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include <map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace dbwheel {
+
+class Page;
+
+// Freelist tracks the pages which are free to allocate and the pages freed
+// by the transactions which may still be read by the open read transactions.
+class Freelist {
+ public:
+  // Returns the first page id of 'n' contiguous free pages, 0 if not found.
+  uint64_t allocate(size_t n);
+  // Returns the first page id of 'n' contiguous free pages closest to
+  // 'hint', 0 if not found.
+  uint64_t allocate(size_t n, uint64_t hint);
+  // Returns the page which allocate(n, hint) would return.
+  uint64_t nearest(size_t n, uint64_t hint) const;
+
+  // Drops the free pages at the end of the file, lowers *pageID, which is
+  // the high water mark, but not below 'min', returns the count of the
+  // dropped pages.
+  uint64_t trim(uint64_t* pageID, uint64_t min);
+
+  // Frees the page 'pageID' and its 'overflow' pages for the transaction 'txID'.
+  void free(uint64_t txID, uint64_t pageID, uint32_t overflow);
+
+  // Moves the pages freed by the transactions until 'txID' to the free ones.
+  void release(uint64_t txID);
+
+  // Drops the pages freed by the transaction 'txID'.
+  void rollback(uint64_t txID);
+  // Gives back the page 'pageID' and its 'overflow' pages allocated by a
+  // transaction rolled back.
+  void restore(uint64_t pageID, uint32_t overflow);
+  // Drops the page 'pageID' and its 'overflow' pages freed by the transaction
+  // 'txID'.
+  void unfree(uint64_t txID, uint64_t pageID, uint32_t overflow);
+
+  bool freed(uint64_t pageID) const;
+  // The sorted pages freed by the transactions not released yet.
+  std::vector<uint64_t> pending() const;
+
+  // The count of the free and pending pages.
+  size_t count() const;
+
+  // The size in page of the freelist.
+  size_t size() const;
+
+  // Replaces the free pages with the sorted 'ids'.
+  void assign(std::vector<uint64_t> ids) { ids_ = std::move(ids); }
+  void read(Page* page);
+  // Reads the free pages from 'page' except the pending ones.
+  void reload(Page* page);
+  void write(Page* page) const;
+
+ private:
+  std::vector<uint64_t> ids_;
+  std::map<uint64_t, std::vector<uint64_t> > pending_;
+  // all the pending ids, to catch a double free and answer freed() cheaply
+  std::unordered_set<uint64_t> pendingIDs_;
+};
+
+}  // namespace dbwheel
+
+#endif  // DB_FREELIST_H_
@@ -0,0 +1,191 @@
+// Copyright (c) 2020
+//
+#include "db/inode.h"
+
+#include <cstring>
+
+#include <utility>
+
+namespace dbwheel {
+
+// The buffer is not compacted while its garbage is smaller than this.
+static const size_t kMinGarbage = 4096;
+
+size_t Inodes::lowerBound(std::string_view key, const KeyOrder& order) const {
+
+  size_t lo = 0, hi = size();
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (order.less(this->key(mid), key)) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+size_t Inodes::upperBound(std::string_view key, const KeyOrder& order) const {
+
+  size_t lo = 0, hi = size();
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (!order.less(key, this->key(mid))) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+void Inodes::reserve(size_t count, size_t bytes) {
+
+  buf_.reserve(bytes);
+  offsets_.reserve(count);
+  ksizes_.reserve(count);
+  vsizes_.reserve(count);
+  flags_.reserve(count);
+  pageIDs_.reserve(count);
+}
+
+void Inodes::insert(size_t i, uint32_t flags, uint64_t pageID, std::string_view key,
+    std::string_view value) {
+
+  if (i == size()) {
+    push_back(flags, pageID, key, value);
+    return;
+  }
+
+  offsets_.insert(offsets_.begin() + i, store(key, value));
+  ksizes_.insert(ksizes_.begin() + i, key.size());
+  vsizes_.insert(vsizes_.begin() + i, value.size());
+  flags_.insert(flags_.begin() + i, flags);
+  pageIDs_.insert(pageIDs_.begin() + i, pageID);
+}
+
+void Inodes::push_back(uint32_t flags, uint64_t pageID, std::string_view key,
+    std::string_view value) {
+
+  offsets_.push_back(store(key, value));
+  ksizes_.push_back(key.size());
+  vsizes_.push_back(value.size());
+  flags_.push_back(flags);
+  pageIDs_.push_back(pageID);
+}
+
+void Inodes::set(size_t i, uint32_t flags, uint64_t pageID, std::string_view key,
+    std::string_view value) {
+
+  // the bytes may be overwritten or moved by compacting
+  if (inBuffer(key) || inBuffer(value)) {
+    std::string k(key), v(value);
+    set(i, flags, pageID, k, v);
+    return;
+  }
+
+  // overwritten in place if it fits
+  size_t old = kvSize(i), sz = key.size() + value.size();
+  if (sz <= old) {
+    char* p = &buf_[offsets_[i]];
+    memcpy(p, key.data(), key.size());
+    memcpy(p + key.size(), value.data(), value.size());
+    garbage_ += old - sz;
+  } else {
+    offsets_[i] = store(key, value);
+    garbage_ += old;
+  }
+
+  ksizes_[i] = key.size();
+  vsizes_[i] = value.size();
+  flags_[i] = flags;
+  pageIDs_[i] = pageID;
+
+  compactIfSparse();
+}
+
+void Inodes::erase(size_t begin, size_t end) {
+
+  for (size_t i = begin; i < end; i++) {
+    garbage_ += kvSize(i);
+  }
+
+  offsets_.erase(offsets_.begin() + begin, offsets_.begin() + end);
+  ksizes_.erase(ksizes_.begin() + begin, ksizes_.begin() + end);
+  vsizes_.erase(vsizes_.begin() + begin, vsizes_.begin() + end);
+  flags_.erase(flags_.begin() + begin, flags_.begin() + end);
+  pageIDs_.erase(pageIDs_.begin() + begin, pageIDs_.begin() + end);
+
+  if (empty()) {
+    clear();
+  } else {
+    compactIfSparse();
+  }
+}
+
+void Inodes::append(const Inodes& from, size_t begin, size_t end) {
+
+  for (size_t i = begin; i < end; i++) {
+    push_back(from.flags_[i], from.pageIDs_[i], from.key(i), from.value(i));
+  }
+}
+
+void Inodes::swap(Inodes& other) {
+
+  buf_.swap(other.buf_);
+  offsets_.swap(other.offsets_);
+  ksizes_.swap(other.ksizes_);
+  vsizes_.swap(other.vsizes_);
+  flags_.swap(other.flags_);
+  pageIDs_.swap(other.pageIDs_);
+  std::swap(garbage_, other.garbage_);
+}
+
+void Inodes::clear() {
+
+  buf_.clear();
+  offsets_.clear();
+  ksizes_.clear();
+  vsizes_.clear();
+  flags_.clear();
+  pageIDs_.clear();
+  garbage_ = 0;
+}
+
+size_t Inodes::store(std::string_view key, std::string_view value) {
+
+  // the buffer may move while growing
+  if (inBuffer(key) || inBuffer(value)) {
+    std::string k(key), v(value);
+    return store(k, v);
+  }
+
+  size_t offset = buf_.size();
+  buf_.append(key.data(), key.size());
+  buf_.append(value.data(), value.size());
+
+  return offset;
+}
+
+void Inodes::compactIfSparse() {
+
+  if (garbage_ < kMinGarbage || garbage_ * 2 < buf_.size()) {
+    return;
+  }
+
+  // in the order of the inodes, so the neighbours are read together
+  std::string buf;
+  buf.reserve(buf_.size() - garbage_);
+  for (size_t i = 0; i < size(); i++) {
+    size_t offset = buf.size();
+    buf.append(buf_.data() + offsets_[i], kvSize(i));
+    offsets_[i] = offset;
+  }
+
+  buf_.swap(buf);
+  garbage_ = 0;
+}
+
+}  // namespace dbwheel
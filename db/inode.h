@@ -3,15 +3,77 @@
 #ifndef DB_INODE_H_
 #define DB_INODE_H_
 
+#include <cstddef>
+#include <cstdint>
 #include <string>
+#include <string_view>
+#include <vector>
+
+#include "db/key_order.h"
 
 namespace dbwheel {
 
-struct inode {
-  uint32_t flags;
-  uint64_t pageID;
-  std::string key;
-  std::string value;
+// Inodes are the elements of a node as the parallel arrays of the offsets,
+// the sizes, the flags and the page ids, over one buffer owned by the node
+// where the key of an inode is followed by its value. So the sizes are
+// summed up by walking the arrays, and reading a page takes no allocation
+// per element. The bytes replaced or deleted stay in the buffer until they
+// are as many as the live ones. The keys and the values returned are valid
+// until the next change.
+class Inodes {
+ public:
+  // The bytes of the arrays per inode, besides its key and value.
+  static const size_t kOverhead = sizeof(size_t) + 3 * sizeof(uint32_t) + sizeof(uint64_t);
+
+  Inodes(): garbage_(0) {}
+
+  size_t size() const { return offsets_.size(); }
+  bool empty() const { return offsets_.empty(); }
+  std::string_view key(size_t i) const {
+    return std::string_view(buf_.data() + offsets_[i], ksizes_[i]);
+  }
+  std::string_view value(size_t i) const {
+    return std::string_view(buf_.data() + offsets_[i] + ksizes_[i], vsizes_[i]);
+  }
+  uint32_t flags(size_t i) const { return flags_[i]; }
+  uint64_t pageID(size_t i) const { return pageIDs_[i]; }
+  // The bytes of the key and the value of the inode 'i'.
+  size_t kvSize(size_t i) const { return ksizes_[i] + vsizes_[i]; }
+  // The index of the first inode whose key is not less than 'key'.
+  size_t lowerBound(std::string_view key, const KeyOrder& order) const;
+  // The index of the first inode whose key is greater than 'key'.
+  size_t upperBound(std::string_view key, const KeyOrder& order) const;
+
+  void reserve(size_t count, size_t bytes);
+  void insert(size_t i, uint32_t flags, uint64_t pageID, std::string_view key,
+      std::string_view value);
+  void push_back(uint32_t flags, uint64_t pageID, std::string_view key, std::string_view value);
+  // Replaces the inode 'i'.
+  void set(size_t i, uint32_t flags, uint64_t pageID, std::string_view key,
+      std::string_view value);
+  void erase(size_t begin, size_t end);
+  // Appends the inodes [begin, end) of 'from'.
+  void append(const Inodes& from, size_t begin, size_t end);
+  void swap(Inodes& other);
+  void clear();
+
+ private:
+  // Appends 'key' and 'value' to the buffer, returns their offset.
+  size_t store(std::string_view key, std::string_view value);
+  bool inBuffer(std::string_view s) const {
+    return s.data() >= buf_.data() && s.data() < buf_.data() + buf_.size();
+  }
+  // Drops the garbage of the buffer if it's as large as the live bytes.
+  void compactIfSparse();
+
+  std::string buf_;
+  std::vector<size_t> offsets_;
+  std::vector<uint32_t> ksizes_;
+  std::vector<uint32_t> vsizes_;
+  std::vector<uint32_t> flags_;
+  std::vector<uint64_t> pageIDs_;
+  // the bytes of the buffer no inode refers to
+  size_t garbage_;
 };
 
 }  // namespace dbwheel
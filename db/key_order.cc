@@ -0,0 +1,43 @@
+// Copyright (c) 2020
+//
+#include "db/key_order.h"
+
+namespace dbwheel {
+
+class BytewiseComparator : public Comparator {
+ public:
+  int compare(std::string_view a, std::string_view b) const override { return a.compare(b); }
+  uint8_t id() const override { return 0; }
+};
+
+class Uint64Comparator : public Comparator {
+ public:
+  int compare(std::string_view a, std::string_view b) const override {
+    uint64_t x = Uint64Less::decode(a), y = Uint64Less::decode(b);
+    return x < y ? -1 : (x > y ? 1 : 0);
+  }
+  uint8_t id() const override { return 1; }
+  bool valid(std::string_view key) const override { return key.size() == 8; }
+};
+
+const Comparator* bytewiseComparator() {
+  static BytewiseComparator c;
+  return &c;
+}
+
+const Comparator* uint64Comparator() {
+  static Uint64Comparator c;
+  return &c;
+}
+
+KeyOrder::KeyOrder(const Comparator* comparator): kind_(kComparator), comparator_(comparator) {
+
+  if (comparator == nullptr || comparator->id() == 0) {
+    kind_ = kBytewise;
+    comparator_ = nullptr;
+  } else if (comparator->id() == 1) {
+    kind_ = kUint64;
+  }
+}
+
+}  // namespace dbwheel
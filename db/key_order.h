@@ -0,0 +1,80 @@
+// Copyright (c) 2020
+//
+#ifndef DB_KEY_ORDER_H_
+#define DB_KEY_ORDER_H_
+
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#include "include/dbwheel/comparator.h"
+
+namespace dbwheel {
+
+struct BytewiseLess {
+  bool operator()(std::string_view a, std::string_view b) const { return a < b; }
+};
+
+// Compares the 8 byte big endian keys as the integers.
+struct Uint64Less {
+  static uint64_t decode(std::string_view k) {
+    uint64_t v;
+    memcpy(&v, k.data(), sizeof(v));
+    return __builtin_bswap64(v);
+  }
+
+  bool operator()(std::string_view a, std::string_view b) const { return decode(a) < decode(b); }
+};
+
+struct ComparatorLess {
+  const Comparator* comparator;
+
+  bool operator()(std::string_view a, std::string_view b) const {
+    return comparator->compare(a, b) < 0;
+  }
+};
+
+// KeyOrder is the order of the keys of a bucket. The builtin orders are
+// compared inline, the others by the virtual calls of the comparator.
+class KeyOrder {
+ public:
+  enum Kind {
+    kBytewise = 0,
+    kUint64,
+    kComparator
+  };
+
+  KeyOrder(): kind_(kBytewise), comparator_(nullptr) {}
+  // The bytewise order if 'comparator' is null.
+  explicit KeyOrder(const Comparator* comparator);
+
+  Kind kind() const { return kind_; }
+  // null if the order is bytewise
+  const Comparator* comparator() const { return comparator_; }
+  // The id stored in the flags of the bucket element.
+  uint8_t id() const { return comparator_ == nullptr ? 0 : comparator_->id(); }
+  bool valid(std::string_view key) const {
+    return kind_ == kBytewise || (kind_ == kUint64 ? key.size() == 8 : comparator_->valid(key));
+  }
+
+  bool less(std::string_view a, std::string_view b) const {
+
+    switch (kind_) {
+      case kBytewise:
+        return a < b;
+      case kUint64:
+        // the same order as the bytes, the invalid keys of a get are compared so
+        return a.size() == 8 && b.size() == 8 ? Uint64Less()(a, b) : a < b;
+      default:
+        return comparator_->compare(a, b) < 0;
+    }
+  }
+
+ private:
+  Kind kind_;
+  const Comparator* comparator_;
+};
+
+}  // namespace dbwheel
+
+#endif  // DB_KEY_ORDER_H_
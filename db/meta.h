@@ -0,0 +1,33 @@
+// Copyright (c) 2020
+//
+#ifndef DB_META_H_
+#define DB_META_H_
+
+#include <cstdint>
+
+#include "db/bucket_impl.h"
+
+namespace dbwheel {
+
+// The freelistPageID of the meta whose freelist is not written, by
+// Options::noFreelistSync.
+static const uint64_t kNoFreelist = UINT64_MAX;
+
+struct Meta {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t pageSize;
+  uint32_t flags;
+  bucket root;
+  uint64_t freelistPageID;
+  uint64_t pageID;
+  uint64_t txID;
+  uint64_t checksum;
+
+  void calcChecksum();
+  bool validate();
+};
+
+}  // namespace dbwheel
+
+#endif  // DB_META_H_
@@ -11,14 +11,18 @@
 #include "db/debug.h"
 #include "db/page_ele.h"
 #include "db/inode.h"
+#include "db/statistics.h"
 
 namespace dbwheel {
 
-struct InodeComp {
-  bool operator() (const inode* i, const string& key) {
-    return i->key < key;
-  }
-};
+// Values larger than this are stored out of line in the value pages.
+static inline size_t overflowThreshold(size_t pageSize) {
+  return pageSize / 4;
+}
+
+static inline bool isOverflowValue(uint32_t flags) {
+  return (flags & leafPageElement::kOverflowValueFlag) != 0;
+}
 
 static inline void releaseMemOfNode(const vector<Node*>& nodes) {
   for (auto n : nodes) {
@@ -27,118 +31,158 @@ static inline void releaseMemOfNode(const vector<Node*>& nodes) {
 }
 
 Node::~Node() {
-
-  for(auto i : inodes_) {
-    delete i;
-  }
-
   releaseMemOfNode(children_);
 }
 
 void Node::put(
-    const string& oldKey,
-    const string& newKey,
-    const string& value,
+    std::string_view oldKey,
+    std::string_view newKey,
+    std::string_view value,
     uint64_t pageID,
     uint32_t flags) {
 
   ASSERTM(oldKey.size()>0, "old key cannot be empty");
   ASSERTM(newKey.size()>0, "new key cannot be empty");
 
-  auto pos = lower_bound(inodes_.begin(), inodes_.end(), oldKey, InodeComp());
+  recordTx(&TxStats::inodesTouched);
 
-  if (pos == inodes_.end() || (*pos)->key != oldKey) {
-    inodes_.insert(pos, new inode{flags, pageID, newKey, value});
+  size_t pos = inodes_.lowerBound(oldKey, order_);
+  if (pos == inodes_.size() || inodes_.key(pos) != oldKey) {
+    inodes_.insert(pos, flags, pageID, newKey, value);
     return;
   }
 
-  auto n = *pos;
-  n->pageID = pageID;
-  n->flags = flags;
-  n->key = newKey;
-  n->value = value;
+  releaseValue(pos);
+  inodes_.set(pos, flags, pageID, newKey, value);
+}
+
+void Node::append(std::string_view key, std::string_view value, uint64_t pageID, uint32_t flags) {
+  inodes_.push_back(flags, pageID, key, value);
 }
 
-bool Node::del(const string& key) {
+bool Node::del(std::string_view key) {
 
-  auto i = del0(key);
-  bool ok = i != nullptr;
-  if (ok) {
-    delete i;
+  size_t i = indexOf(key);
+  if (i == inodes_.size()) {
+    return false;
   }
 
-  return ok;
+  recordTx(&TxStats::inodesTouched);
+  releaseValue(i);
+  inodes_.erase(i, i + 1);
+
+  return true;
 }
 
-inode* Node::del0(const string& key) {
+bool Node::merge(const WriteBatch::Op* const* begin, const WriteBatch::Op* const* end) {
+
+  ASSERTM(isLeaf_, "merge into branch");
 
-  inode* i = nullptr;
-  auto pos = lower_bound(inodes_.begin(), inodes_.end(), key, InodeComp());
-  if (pos != inodes_.end() && (*pos)->key == key) {
-    i = *pos;
-    inodes_.erase(pos);
+  recordTx(&TxStats::inodesTouched, end - begin);
+
+  size_t bytes = 0;
+  for (size_t i = 0, n = inodes_.size(); i < n; i++) {
+    bytes += inodes_.kvSize(i);
+  }
+  for (auto it = begin; it != end; it++) {
+    bytes += (*it)->key.size() + (*it)->value.size();
   }
 
-  return i;
-}
+  // copied into a new buffer, which drops the garbage too
+  Inodes merged;
+  merged.reserve(inodes_.size() + (end - begin), bytes);
 
-vector<Node*> Node::split(size_t pageSize, double fillPercent) {
+  bool deleted = false;
+  size_t pos = 0, n = inodes_.size();
+  for (auto it = begin; it != end; it++) {
+    auto op = *it;
+    ASSERTM(op->key.size()>0, "key cannot be empty");
 
-  vector<Node*> nodes;
-  Node* node = this;
+    size_t run = pos;
+    while (pos < n && order_.less(inodes_.key(pos), op->key)) {
+      pos++;
+    }
+    merged.append(inodes_, run, pos);
+
+    if (pos < n && inodes_.key(pos) == op->key) {
+      releaseValue(pos);
+      if (op->del) {
+        deleted = true;
+      } else {
+        merged.push_back(0, inodes_.pageID(pos), op->key, op->value);
+      }
+      pos++;
+    } else if (!op->del) {
+      merged.push_back(0, 0, op->key, op->value);
+    }
+  }
 
-  while (true) {
+  merged.append(inodes_, pos, n);
+  inodes_.swap(merged);
 
-    auto np = node->splitTwo(pageSize, fillPercent);
-    Node* a = std::get<0>(np);
-    Node* b = std::get<1>(np);
-    nodes.push_back(a);
+  return deleted;
+}
 
-    if (b == nullptr) {
-      break;
-    }
+size_t Node::indexOf(std::string_view key) const {
 
-    node = b;
+  size_t pos = inodes_.lowerBound(key, order_);
+  if (pos < inodes_.size() && inodes_.key(pos) == key) {
+    return pos;
   }
 
-  return nodes;
+  return inodes_.size();
 }
 
-std::pair<Node*, Node*> Node::splitTwo(size_t pageSize, double fillPercent) {
+vector<Node*> Node::split(size_t pageSize, double fillPercent) {
+
+  vector<Node*> nodes{this};
 
-  if (inodes_.size() < Page::kMinKeys * 2 || sizeLessThan(pageSize)) {
-    return std::make_pair(this, nullptr);
+  // the boundaries are found in one pass, splitting off one tail after another
+  // would copy the rest of the inodes for every new node
+  vector<size_t> bounds;
+  size_t begin = 0, threshold = (size_t) (fillPercent * pageSize);
+  while (inodes_.size() - begin >= Page::kMinKeys * 2 && !sizeLessThan(begin, pageSize)) {
+    begin = splitIndex(begin, threshold);
+    if (begin == inodes_.size()) {
+      break;
+    }
+    bounds.push_back(begin);
   }
 
-  auto i = splitIndex((size_t) (fillPercent * pageSize));
+  if (bounds.empty()) {
+    return nodes;
+  }
 
   if (parent_ == nullptr) {
-    parent_ = new Node();
+    parent_ = new Node(nullptr, 0, false, order_);
+    parent_->fixedWidth(keySize_, valueSize_);
     parent_->children_.push_back(this);
   }
 
-  Node* n = new Node(
-      vector<inode*>(inodes_.begin() + i, inodes_.end()),
-      isLeaf_);
-  n->parent_ = parent_;
-  parent_->children_.push_back(n);
+  bounds.push_back(inodes_.size());
+  for (size_t i = 0; i + 1 < bounds.size(); i++) {
+    Node* n = new Node(parent_, 0, isLeaf_, order_);
+    n->inodes_.append(inodes_, bounds[i], bounds[i + 1]);
+    n->fixedWidth(keySize_, valueSize_);
+    parent_->children_.push_back(n);
+    nodes.push_back(n);
+  }
 
-  inodes_.erase(inodes_.begin() + i, inodes_.end());
+  inodes_.erase(bounds[0], inodes_.size());
 
-  return std::make_pair(this, n);
-}
+  recordTick(DBStats::kSplits, nodes.size() - 1);
+  recordTx(&TxStats::splits, nodes.size() - 1);
 
-static size_t inodeSizeInPage(inode* i) {
-  return i->key.size() + i->value.size();
+  return nodes;
 }
 
-bool Node::sizeLessThan(size_t v) {
+bool Node::sizeLessThan(size_t begin, size_t v) {
 
-  size_t s = Page::kPageHeaderSize;
+  size_t s = headerSize();
   size_t elsz = elementSize();
 
-  for (auto i : inodes_) {
-    s += elsz + inodeSizeInPage(i);
+  for (size_t i = begin, n = inodes_.size(); i < n; i++) {
+    s += elsz + inodes_.kvSize(i);
     if (s >= v) {
       return false;
     }
@@ -147,23 +191,27 @@ bool Node::sizeLessThan(size_t v) {
   return true;
 }
 
+inline size_t Node::headerSize() {
+  return Page::kPageHeaderSize + (dense() ? Page::kDenseLeafHeaderSize : 0);
+}
+
 inline size_t Node::elementSize() {
 
   if (isLeaf_) {
-    return Page::kLeafPageElementSize;
+    return dense() ? 0 : Page::kLeafPageElementSize;
   }
 
   return Page::kBranchPageElementSize;
 }
 
 
-size_t Node::splitIndex(size_t threshold) {
+size_t Node::splitIndex(size_t begin, size_t threshold) {
 
-  size_t i = 0, sz = Page::kPageHeaderSize, elsz = elementSize();
+  size_t i = begin, sz = headerSize(), elsz = elementSize();
   for (size_t s = inodes_.size(); i < s; i++) {
-    sz += elsz + inodeSizeInPage(inodes_[i]);
+    sz += elsz + inodes_.kvSize(i);
 
-    if (i >= Page::kMinKeys && sz > threshold) {
+    if (i >= begin + Page::kMinKeys && sz > threshold) {
       break;
     }
   }
@@ -177,36 +225,65 @@ void Node::readPage(Page* page) {
   pageID_ = page->id();
 
   uint32_t c = page->count();
-  inodes_.reserve(c);
 
-  if (isLeaf_) {
+  recordTx(&TxStats::nodesDecoded);
+  recordTx(&TxStats::inodesTouched, c);
+
+  if (isLeaf_ && (page->flags() & Page::kDenseLeafPageFlag) != 0) {
+    auto h = page->denseLeaf();
+    fixedWidth(h->ksize, h->vsize);
+    inodes_.reserve(c, c * (h->ksize + h->vsize));
+    for (uint32_t i = 0; i < c; i++) {
+      inodes_.push_back(0, page->id(), std::string_view(page->denseKeyOf(i), h->ksize),
+          std::string_view(page->denseValueOf(i), h->vsize));
+    }
+  } else if (isLeaf_) {
     auto e = page->leafPageElements();
+    // the keys and the values are written in the order of the elements
+    inodes_.reserve(c, c == 0 ? 0 : (reinterpret_cast<char*>(e + c - 1) + e[c - 1].pos +
+        e[c - 1].ksize + e[c - 1].vsize) - (reinterpret_cast<char*>(e) + e->pos));
     for (uint32_t i = 0; i < c; i++, e++) {
-      inodes_.push_back(new inode{e->flags, page->id(), e->key(), e->value()});
+      const char* k = reinterpret_cast<char*>(e) + e->pos;
+      inodes_.push_back(e->flags, page->id(), std::string_view(k, e->ksize),
+          std::string_view(k + e->ksize, e->vsize));
+    }
+  } else {
+    auto e = page->branchPageElements();
+    inodes_.reserve(c, c == 0 ? 0 : (reinterpret_cast<char*>(e + c - 1) + e[c - 1].pos +
+        e[c - 1].ksize) - (reinterpret_cast<char*>(e) + e->pos));
+    for (uint32_t i = 0; i < c; i++, e++) {
+      inodes_.push_back(0/*ignore*/, e->pageID,
+          std::string_view(reinterpret_cast<char*>(e) + e->pos, e->ksize), std::string_view());
     }
-    return;
   }
-  auto e = page->branchPageElements();
-  for (uint32_t i = 0; i < c; i++, e++) {
-    inodes_.push_back(new inode{0/*ignore*/, e->pageID, e->key()});
+
+  // the key to find this node in the parent even if the first inode changed
+  if (c > 0) {
+    key_ = string(inodes_.key(0));
   }
 }
 
 void Node::writePage(Page* page) {
 
   page->flags(isLeaf_ ? Page::kLeafPageFlag : Page::kBranchPageFlag);
+  if (dense()) {
+    page->flags(Page::kLeafPageFlag | Page::kDenseLeafPageFlag);
+  }
   page->id(pageID_);
 
   int inodeCount = inodes_.size();
   ASSERTM(inodeCount < 0xFFFF, "inode count overflow");
 
   page->count((uint32_t) inodeCount);
+  recordTx(&TxStats::bytesSerialized, sizeInPage());
 
   if (inodeCount <= 0) {
     return;
   }
 
-  if (isLeaf_) {
+  if (dense()) {
+    writeDenseLeaf(page);
+  } else if (isLeaf_) {
     writeLeaf(page);
   } else {
     writeBranch(page);
@@ -219,42 +296,57 @@ void Node::writeLeaf(Page* page) {
   leafPageElement* elt = page->leafPageElements();
   char* kvData = reinterpret_cast<char*>(elt) + inodeCount * Page::kLeafPageElementSize;
   for (int i = 0; i < inodeCount; i++) {
-    inode* in = inodes_[i];
-    elt->flags = in->flags;
-    elt->ksize = in->key.size();
-    elt->vsize = in->value.size();
+    std::string_view key = inodes_.key(i), value = inodes_.value(i);
+    elt->flags = inodes_.flags(i);
+    elt->ksize = key.size();
+    elt->vsize = value.size();
     elt->pos = (uint32_t)(kvData - reinterpret_cast<char*>(elt));
 
-    memcpy(kvData, in->key.data(), elt->ksize);
-    kvData += elt->ksize;
-    memcpy(kvData, in->value.data(), elt->vsize);
-    kvData += elt->vsize;
+    // the key is followed by the value in the node too
+    memcpy(kvData, key.data(), elt->ksize + elt->vsize);
+    kvData += elt->ksize + elt->vsize;
 
     elt++;
   }
 }
 
+void Node::writeDenseLeaf(Page* page) {
+
+  auto h = page->denseLeaf();
+  h->ksize = keySize_;
+  h->vsize = valueSize_;
+  h->unused = 0;
+
+  for (size_t i = 0; i < inodes_.size(); i++) {
+    std::string_view key = inodes_.key(i), value = inodes_.value(i);
+    ASSERTM(key.size() == keySize_ && value.size() == valueSize_, "not fixed width");
+    memcpy(page->denseKeyOf(i), key.data(), keySize_);
+    memcpy(page->denseValueOf(i), value.data(), valueSize_);
+  }
+}
+
 void Node::writeBranch(Page* page) {
 
   int inodeCount = inodes_.size();
   branchPageElement* elt = page->branchPageElements();
   char* keyData = reinterpret_cast<char*>(elt) + inodeCount * Page::kBranchPageElementSize;
   for (int i = 0; i < inodeCount; i++) {
-    inode* in = inodes_[i];
-    elt->ksize = in->key.size();
+    std::string_view key = inodes_.key(i);
+    elt->ksize = key.size();
     elt->pos = (uint32_t)(keyData - reinterpret_cast<char*>(elt));
-    elt->pageID = in->pageID;
+    elt->pageID = inodes_.pageID(i);
 
-    memcpy(keyData, in->key.data(), elt->ksize);
+    memcpy(keyData, key.data(), elt->ksize);
     keyData += elt->ksize;
 
     elt++;
   }
 }
 
-void Node::reblance(size_t pageSize, NodeCache& nodeCache, PageFree& pageFree) {
+void Node::reblance(size_t pageSize, NodeCache& nodeCache, PageFree& pageFree,
+    const RebalancePolicy& policy) {
 
-  if (sizeInPage() > pageSize/4 && inodes_.size() > minKeys()) {
+  if (sizeInPage() > policy.lowWatermark * pageSize && inodes_.size() > minKeys()) {
     return;
   }
 
@@ -267,39 +359,50 @@ void Node::reblance(size_t pageSize, NodeCache& nodeCache, PageFree& pageFree) {
 
   Node* toBeMerged;
   Node* target;
-  vector<Node*>::iterator it;
+  size_t index;
 
   if (inodes_.empty()) {
     toBeMerged = this;
     goto FREE;
   }
 
-  it = std::find(parent_->children_.begin(), parent_->children_.end(), this);
-  ASSERTM(it != parent_->children_.end(), "BUG: current node not in the parent's children list");
+  // nothing to merge with
+  if (parent_->inodes_.size() < 2) {
+    return;
+  }
 
-  if (it == parent_->children_.begin()) {
+  index = parent_->childIndex(this);
+  if (index == 0) {
     target = this;
-    toBeMerged = *(it + 1);
+    toBeMerged = nodeCache.node(parent_->inodes_.pageID(1), parent_);
+    toBeMerged->index_ = 1;
   } else {
-    target = *(it - 1);
+    target = nodeCache.node(parent_->inodes_.pageID(index - 1), parent_);
+    target->index_ = index - 1;
     toBeMerged = this;
   }
 
-  for (auto i : toBeMerged->inodes_) {
-    auto n = nodeCache.get(i->pageID);
-    if (n == nullptr) {
-      continue;
-    }
-
-    n->parent_->removeChild(n);
-    n->parent_ = target;
-    target->children_.push_back(n);
+  // the merged one would be split soon, the parent keeps the same children
+  // after redistributing, so no need to rebalance it
+  if (target->sizeInPage() + toBeMerged->sizeInPage() - Page::kPageHeaderSize >
+      policy.highWatermark * pageSize) {
+    target->redistribute(toBeMerged, nodeCache);
+    recordTick(DBStats::kRedistributions);
+    recordTx(&TxStats::redistributions);
+    return;
   }
 
-  target->inodes_.insert(target->inodes_.end(), toBeMerged->inodes_.begin(), toBeMerged->inodes_.end());
+  target->adopt(toBeMerged, 0, toBeMerged->inodes_.size(), nodeCache);
+  target->inodes_.append(toBeMerged->inodes_, 0, toBeMerged->inodes_.size());
 
 FREE:
-  parent_->del0(toBeMerged->key());
+  recordTick(DBStats::kRebalances);
+  recordTx(&TxStats::merges);
+  toBeMerged->freeValues(pageFree);
+  index = parent_->indexOf(toBeMerged->key());
+  if (index < parent_->inodes_.size()) {
+    parent_->inodes_.erase(index, index + 1);
+  }
   parent_->removeChild(toBeMerged);
   nodeCache.remove(toBeMerged->pageID_);
   pageFree.free(toBeMerged->pageID_);
@@ -309,7 +412,88 @@ FREE:
   Node* parent = parent_;
   delete toBeMerged;
 
-  parent->reblance(pageSize, nodeCache, pageFree);
+  parent->reblance(pageSize, nodeCache, pageFree, policy);
+}
+
+// Moves the inodes between this node and its next sibling 'next' to make
+// them about the same size.
+void Node::redistribute(Node* next, NodeCache& nodeCache) {
+
+  size_t elsz = elementSize();
+  size_t size = sizeInPage(), nextSize = next->sizeInPage();
+  size_t half = (size + nextSize) / 2;
+  string oldKey(next->key());
+
+  if (size < half) {
+    // take the first inodes of next
+    size_t i = 0;
+    for (size_t s = next->inodes_.size(); s - i > minKeys(); i++) {
+      size_t sz = elsz + next->inodes_.kvSize(i);
+      if (size + sz / 2 > half) {
+        break;
+      }
+      size += sz;
+    }
+
+    adopt(next, 0, i, nodeCache);
+    inodes_.append(next->inodes_, 0, i);
+    next->inodes_.erase(0, i);
+  } else {
+    // give the last inodes to next
+    size_t i = inodes_.size();
+    for (; i > minKeys(); i--) {
+      size_t sz = elsz + inodes_.kvSize(i - 1);
+      if (nextSize + sz / 2 > half) {
+        break;
+      }
+      nextSize += sz;
+    }
+
+    next->adopt(this, i, inodes_.size(), nodeCache);
+    Inodes moved;
+    moved.append(inodes_, i, inodes_.size());
+    moved.append(next->inodes_, 0, next->inodes_.size());
+    next->inodes_.swap(moved);
+    inodes_.erase(i, inodes_.size());
+  }
+
+  // the first key of next changed
+  next->key_ = string(next->inodes_.key(0));
+  parent_->put(oldKey, next->key_, "", next->pageID_, 0);
+}
+
+// Moves the cached children of the inodes [begin, end) of 'from' to this node.
+void Node::adopt(const Node* from, size_t begin, size_t end, NodeCache& nodeCache) {
+
+  // the inodes of leaf hold the page id of itself, not the children
+  if (isLeaf_) {
+    return;
+  }
+
+  for (size_t i = begin; i < end; i++) {
+    auto n = nodeCache.get(from->inodes_.pageID(i));
+    if (n == nullptr || n->parent_ == this) {
+      continue;
+    }
+
+    n->parent_->removeChild(n);
+    n->parent_ = this;
+    children_.push_back(n);
+  }
+}
+
+// Returns the index of the inode pointing to the child 'n'.
+size_t Node::childIndex(Node* n) const {
+
+  size_t i = n->index_;
+  if (i < inodes_.size() && inodes_.pageID(i) == n->pageID_) {
+    return i;
+  }
+
+  size_t pos = inodes_.upperBound(n->key(), order_);
+  n->index_ = pos == 0 ? 0 : pos - 1;
+
+  return n->index_;
 }
 
 void Node::removeChild(Node* n) {
@@ -318,11 +502,11 @@ void Node::removeChild(Node* n) {
 
 size_t Node::sizeInPage() {
 
-  size_t s = Page::kPageHeaderSize;
+  size_t s = headerSize();
   size_t elsz = elementSize();
 
-  for (auto i : inodes_) {
-    s += elsz + inodeSizeInPage(i);
+  for (size_t i = 0, n = inodes_.size(); i < n; i++) {
+    s += elsz + inodes_.kvSize(i);
   }
 
   return s;
@@ -330,15 +514,15 @@ size_t Node::sizeInPage() {
 
 void Node::collapse(NodeCache& nodeCache, PageFree& pageFree) {
 
-  Node* child = nodeCache.get(inodes_[0]->pageID);
+  Node* child = nodeCache.node(inodes_.pageID(0), this);
   ASSERTM(child != nullptr, "child is null");
 
   isLeaf_ = child->isLeaf_;
   inodes_.swap(child->inodes_);
   children_.swap(child->children_);
 
-  for (auto i : inodes_) {
-    auto n = nodeCache.get(i->pageID);
+  for (size_t i = 0, s = isLeaf_ ? 0 : inodes_.size(); i < s; i++) {
+    auto n = nodeCache.get(inodes_.pageID(i));
     if (n != nullptr) {
       n->parent_ = this;
     }
@@ -346,13 +530,16 @@ void Node::collapse(NodeCache& nodeCache, PageFree& pageFree) {
 
   // avoid delete self twice
   child->children_.clear();
+  child->freeValues(pageFree);
   nodeCache.remove(child->pageID_);
   pageFree.free(child->pageID_);
+  recordTick(DBStats::kCollapses);
+  recordTx(&TxStats::merges);
   delete child;
 }
 
-inline const string& Node::key() const {
-  return key_ == "" ? inodes_[0]->key : key_;
+inline std::string_view Node::key() const {
+  return key_ == "" ? inodes_.key(0) : std::string_view(key_);
 }
 
 Node* Node::spill(size_t pageSize, double fillPercent, PageFree& pageFree, PageAlloc& pageAlloc) {
@@ -366,22 +553,39 @@ Node* Node::spill(size_t pageSize, double fillPercent, PageFree& pageFree, PageA
   releaseMemOfNode(children_);
   children_.clear();
 
+  if (isLeaf_) {
+    freeValues(pageFree);
+    spillValues(pageSize, pageAlloc);
+  }
+
+  // the nodes are placed next to their left siblings if possible, so
+  // the leaves spilled together stay in the key order in the file
+  uint64_t hint = allocHint_;
+  if (hint == 0 && parent_ != nullptr && !inodes_.empty()) {
+    size_t i = parent_->childIndex(this);
+    if (i > 0 && i < parent_->inodes_.size()) {
+      hint = parent_->inodes_.pageID(i - 1) + 1;
+    }
+  }
+
   for (auto n : split(pageSize, fillPercent)) {
     if (n->pageID_ > 0) {
       pageFree.free(n->pageID_);
     }
 
-    Page* page = pageAlloc.alloc(pageSize, sizeInPage() / pageSize + 1);
-    
+    size_t count = (n->sizeInPage() + pageSize - 1) / pageSize;
+    Page* page = hint > 0 ? pageAlloc.allocNear(pageSize, count, hint) : pageAlloc.alloc(pageSize, count);
+    hint = page->id() + count;
+
     n->pageID_ = page->id();
     n->writePage(page);
 
     if (n->parent_ != nullptr) {
       if (n->key_ == "") {
-        n->key_ = n->inodes_[0]->key;
+        n->key_ = string(n->inodes_.key(0));
       }
 
-      n->parent_->put(n->key_, n->inodes_[0]->key, "", n->pageID_, 0);
+      n->parent_->put(n->key_, n->inodes_.key(0), "", n->pageID_, 0);
     }
   }
 
@@ -397,12 +601,106 @@ Node* Node::spill(size_t pageSize, double fillPercent, PageFree& pageFree, PageA
   return this;
 }
 
+bool Node::inlineable(size_t pageSize, size_t maxSize) {
+
+  if (!isLeaf_) {
+    return false;
+  }
+
+  size_t threshold = overflowThreshold(pageSize);
+  size_t s = headerSize(), elsz = elementSize();
+  for (size_t i = 0, n = inodes_.size(); i < n; i++) {
+    uint32_t flags = inodes_.flags(i);
+    if ((flags & leafPageElement::kBucketLeafFlag) != 0) {
+      return false;
+    }
+
+    size_t vsize = inodes_.value(i).size();
+    if (vsize > threshold && !isOverflowValue(flags)) {
+      vsize = sizeof(overflowValue);
+    }
+    s += elsz + inodes_.key(i).size() + vsize;
+    if (s > maxSize) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void Node::spillInline(size_t pageSize, PageFree& pageFree, PageAlloc& pageAlloc, string* page) {
+
+  ASSERTM(isLeaf_ && children_.empty(), "inline node must be a leaf");
+
+  freeValues(pageFree);
+  spillValues(pageSize, pageAlloc);
+
+  if (pageID_ > 0) {
+    pageFree.free(pageID_);
+    pageID_ = 0;
+  }
+
+  // the page is accessed by the aligned fields
+  size_t sz = sizeInPage();
+  vector<uint64_t> buf((sz + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+  writePage(reinterpret_cast<Page*>(buf.data()));
+  page->assign(reinterpret_cast<char*>(buf.data()), sz);
+}
+
+// Moves the large values into the value pages, leaves the overflowValue
+// pointing to them in the inodes, so the leaf only holds small records.
+void Node::spillValues(size_t pageSize, PageAlloc& pageAlloc) {
+
+  // the fixed width values are kept in the dense leaves
+  if (dense()) {
+    return;
+  }
+
+  size_t threshold = overflowThreshold(pageSize);
+  for (size_t i = 0, n = inodes_.size(); i < n; i++) {
+    std::string_view value = inodes_.value(i);
+    if (isOverflowValue(inodes_.flags(i)) || value.size() <= threshold) {
+      continue;
+    }
+
+    size_t sz = Page::kPageHeaderSize + value.size();
+    Page* page = pageAlloc.alloc(pageSize, (sz + pageSize - 1) / pageSize);
+    page->flags(Page::kValuePageFlag);
+    page->count(0);
+    memcpy(page->ptr_, value.data(), value.size());
+
+    overflowValue ov{page->id(), value.size()};
+    inodes_.set(i, inodes_.flags(i) | leafPageElement::kOverflowValueFlag, inodes_.pageID(i),
+        inodes_.key(i), std::string_view(reinterpret_cast<char*>(&ov), sizeof(ov)));
+  }
+}
+
+void Node::freeValues(PageFree& pageFree) {
+
+  for (auto id : freedValues_) {
+    pageFree.free(id);
+  }
+
+  freedValues_.clear();
+}
+
+void Node::releaseValue(size_t i) {
+
+  if (!isOverflowValue(inodes_.flags(i))) {
+    return;
+  }
+
+  overflowValue ov;
+  memcpy(&ov, inodes_.value(i).data(), sizeof(ov));
+  freedValues_.push_back(ov.pageID);
+}
+
 const string Node::toString() {
 
   std::stringstream s;
   s << "pageID:[" << pageID_ << "],is leaf:[" << isLeaf_ << "], inodes:[";
-  for (auto i : inodes_) {
-    s << "key=" << i->key << ",value=" << i->value << ",";
+  for (size_t i = 0; i < inodes_.size(); i++) {
+    s << "key=" << inodes_.key(i) << ",value=" << inodes_.value(i) << ",";
   }
   s << "],children count:[" << children_.size() << "]";
 
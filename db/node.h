@@ -4,9 +4,13 @@
 #define DB_NODE_H_
 
 #include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
 
+#include "include/dbwheel/write_batch.h"
+#include "db/inode.h"
+#include "db/key_order.h"
 #include "db/node_cache.h"
 #include "db/page.h"
 #include "db/page_alloc.h"
@@ -17,45 +21,83 @@ namespace dbwheel {
 using std::string;
 using std::vector;
 
-struct inode;
+// RebalancePolicy keeps the nodes between the watermarks, which are the
+// fractions of the page size. A node smaller than the low one is merged with
+// its sibling, unless the merged one would be larger than the high one, then
+// it takes some inodes from the sibling instead, so it's not split again soon.
+struct RebalancePolicy {
+  double lowWatermark = 0.25;
+  double highWatermark = 0.75;
+};
 
 class Node {
  public:
   Node(): Node(nullptr, 0, false) {}
-  Node(Node* parent, uint64_t pageID, bool isLeaf): parent_(parent), pageID_(pageID), isLeaf_(isLeaf) {}
-  Node(const vector<inode*>& inodes, bool isLeaf): parent_(nullptr), inodes_(inodes), isLeaf_(isLeaf) {}
+  Node(Node* parent, uint64_t pageID, bool isLeaf, const KeyOrder& order = KeyOrder()): parent_(parent), pageID_(pageID), index_(0), isLeaf_(isLeaf), allocHint_(0), order_(order), keySize_(0), valueSize_(0) {}
   ~Node();
 
   vector<Node*> split(size_t pageSize, double fillPercent);
-  void put(const string& oldKey, const string& newKey, const string& value, uint64_t id, uint32_t flags);
-  bool del(const string& key);
+  void put(std::string_view oldKey, std::string_view newKey, std::string_view value, uint64_t id,
+      uint32_t flags);
+  bool del(std::string_view key);
+  // Adds the inode after the last one, the keys are added in the order.
+  void append(std::string_view key, std::string_view value, uint64_t pageID, uint32_t flags);
+  // Applies the puts and the deletes in [begin, end) sorted by the key to the
+  // leaf in one pass, returns whether any inode is deleted.
+  bool merge(const WriteBatch::Op* const* begin, const WriteBatch::Op* const* end);
   void readPage(Page* page);
   void writePage(Page* page);
-  void reblance(size_t pageSize, NodeCache& nodeCache, PageFree& pageFree);
+  void reblance(size_t pageSize, NodeCache& nodeCache, PageFree& pageFree,
+      const RebalancePolicy& policy = RebalancePolicy());
   Node* spill(size_t pageSize, double fillPercent, PageFree& pageFree, PageAlloc& pageAlloc);
+  // Returns whether the node is a leaf without sub buckets, which fits in
+  // 'maxSize' once its large values are moved out.
+  bool inlineable(size_t pageSize, size_t maxSize);
+  // Writes the leaf into *page instead of a page of the file, as the inline
+  // root of a bucket, and frees its page if any.
+  void spillInline(size_t pageSize, PageFree& pageFree, PageAlloc& pageAlloc, string* page);
 
   const bool isLeaf() const { return isLeaf_; }
   const int count() const { return inodes_.size(); }
   const uint64_t pageID() const { return pageID_; }
   const Node* const parent() const { return parent_; }
-  const vector<inode*>& inodes() const { return inodes_; }
+  const Inodes& inodes() const { return inodes_; }
   const vector<Node*>& children() const { return children_; }
   void children(const vector<Node*>& children) { children_ = children; }
+  void addChild(Node* n) { children_.push_back(n); }
+  void index(size_t i) { index_ = i; }
+  // Spills the node to the pages close to 'hint' rather than next to its left sibling.
+  void allocHint(uint64_t hint) { allocHint_ = hint; }
+  // Writes the leaves as the dense arrays of the keys and the values of
+  // these widths, the leaves are written with the elements if 'keySize' is 0.
+  void fixedWidth(uint16_t keySize, uint16_t valueSize) { keySize_ = keySize; valueSize_ = valueSize; }
+  uint16_t keySize() const { return keySize_; }
+  uint16_t valueSize() const { return valueSize_; }
 
  private:
-  std::pair<Node*, Node*> splitTwo(size_t pageSize, double fillPercent);
-  bool sizeLessThan(size_t v);
+  // Whether the inodes from 'begin' on fit in fewer than 'v' bytes.
+  bool sizeLessThan(size_t begin, size_t v);
+  bool dense() const { return isLeaf_ && keySize_ > 0; }
+  size_t headerSize();
   size_t elementSize();
-  size_t splitIndex(size_t threshold);
+  size_t splitIndex(size_t begin, size_t threshold);
   size_t sizeInPage();
   void writeLeaf(Page* page);
+  void writeDenseLeaf(Page* page);
   void writeBranch(Page* page);
   void collapse(NodeCache& nodeCache, PageFree& pageFree);
   void removeChild(Node* n);
+  size_t childIndex(Node* n) const;
+  void redistribute(Node* next, NodeCache& nodeCache);
+  void adopt(const Node* from, size_t begin, size_t end, NodeCache& nodeCache);
+  void spillValues(size_t pageSize, PageAlloc& pageAlloc);
+  void freeValues(PageFree& pageFree);
+  void releaseValue(size_t i);
   Node* prevSilbing();
   Node* nextSilbing();
-  const string& key() const;
-  inode* del0(const string& key);
+  std::string_view key() const;
+  // Returns the index of the inode of 'key', count() if not found.
+  size_t indexOf(std::string_view key) const;
 
   size_t minKeys() { return isLeaf_ ? 1 : 2; }
 
@@ -65,9 +107,22 @@ class Node {
   uint64_t pageID_;
   // children cache, used by spilling
   vector<Node*> children_;
-  vector<inode*> inodes_;
+  Inodes inodes_;
+  // the index of the inode pointing to this node in the parent, it's only
+  // a hint since the inodes of the parent may be changed
+  size_t index_;
   bool isLeaf_;
   string key_;
+  // the first pages of the out of line values dropped by put/del,
+  // which are freed when spilling
+  vector<uint64_t> freedValues_;
+  // 0 if not set
+  uint64_t allocHint_;
+  // the order of the keys, which the split nodes inherit
+  KeyOrder order_;
+  // the widths of the fixed width buckets, 0 if not fixed
+  uint16_t keySize_;
+  uint16_t valueSize_;
 };
 
 }  // namespace dbwheel
@@ -12,6 +12,9 @@ class Node;
 class NodeCache {
  public:
   virtual Node* get(uint64_t pageID) = 0;
+  // Returns the node of the page 'pageID', reads it as a child of 'parent'
+  // if it's not cached.
+  virtual Node* node(uint64_t pageID, Node* parent) = 0;
   virtual void remove(uint64_t pageID) = 0;
 };
 
@@ -17,6 +17,10 @@ struct MockNodeCache: public NodeCache {
     return i == cache.end() ? nullptr : i->second; 
   }
 
+  Node* node(uint64_t pageID, Node* /*parent*/) override {
+    return get(pageID);
+  }
+
   void remove(uint64_t pageID) override {
     cache.erase(pageID);
   }
@@ -1,5 +1,7 @@
 // Copyright (c) 2020
 //
+#include <cstring>
+
 #include "gtest/gtest.h"
 
 #include "db/inode.h"
@@ -7,7 +9,9 @@
 #include "db/node_cache_mock.h"
 #include "db/page.h"
 #include "db/page_alloc_mock.h"
+#include "db/page_ele.h"
 #include "db/page_free_mock.h"
+#include "db/value_reader.h"
 
 namespace dbwheel {
 
@@ -23,15 +27,12 @@ TEST(TestNode, putAndDel) {
 
   node.put("1", "2", value, 1, 1);
   EXPECT_EQ(1, node.count());
-  auto in = node.inodes()[0];
-  ASSERT_EQ("2", in->key);
+  ASSERT_EQ("2", node.inodes().key(0));
 
   node.put("3", "3", value, 1, 1);
   EXPECT_EQ(2, node.count());
-  auto in1 = node.inodes()[0];
-  auto in2 = node.inodes()[1];
-  ASSERT_EQ("2", in1->key);
-  ASSERT_EQ("3", in2->key);
+  ASSERT_EQ("2", node.inodes().key(0));
+  ASSERT_EQ("3", node.inodes().key(1));
 
   node.del("4");
   EXPECT_EQ(2, node.count());
@@ -96,35 +97,31 @@ TEST(TestNode, readWritePage) {
     node1.writePage(page);
     node2.readPage(page);
     ASSERT_EQ(2, node2.count());
-    vector<inode*> ins = node2.inodes();
-    inode* in1 = ins[0];
-    ASSERT_EQ(1, in1->pageID);
-    ASSERT_EQ(k, in1->key);
-
-    inode* in2 = ins[1];
-    ASSERT_EQ(2, in2->pageID);
-    ASSERT_EQ(k2, in2->key);
+    auto& ins = node2.inodes();
+    ASSERT_EQ(1, ins.pageID(0));
+    ASSERT_EQ(k, ins.key(0));
+
+    ASSERT_EQ(2, ins.pageID(1));
+    ASSERT_EQ(k2, ins.key(1));
   }
 
   // some kv leaf
   {
-    Node node1(vector<inode*>(), true), node2(vector<inode*>(), true);
+    Node node1(nullptr, 0, true), node2(nullptr, 0, true);
     node1.put(k, k, v, 1, 1);
     node1.put(k2, k2, v2, 2, 2);
     node1.writePage(page);
     node2.readPage(page);
 
     ASSERT_EQ(2, node2.count());
-    vector<inode*> ins = node2.inodes();
-    inode* in1 = ins[0];
-    ASSERT_EQ(1, in1->flags);
-    ASSERT_EQ(k, in1->key);
-    ASSERT_EQ(v, in1->value);
-
-    inode* in2 = ins[1];
-    ASSERT_EQ(2, in2->flags);
-    ASSERT_EQ(k2, in2->key);
-    ASSERT_EQ(v2, in2->value);
+    auto& ins = node2.inodes();
+    ASSERT_EQ(1, ins.flags(0));
+    ASSERT_EQ(k, ins.key(0));
+    ASSERT_EQ(v, ins.value(0));
+
+    ASSERT_EQ(2, ins.flags(1));
+    ASSERT_EQ(k2, ins.key(1));
+    ASSERT_EQ(v2, ins.value(1));
   }
 }
 
@@ -142,7 +139,7 @@ TEST(TestNode, noReblance) {
   ASSERT_EQ(nullptr, b.parent());
   ASSERT_EQ(3, b.count());
 
-  Node l({},  true);
+  Node l(nullptr, 0, true);
   l.put("1", "1", "1", 1, 1);
   l.reblance(10000, nodeCache, pageFree);
 }
@@ -164,12 +161,10 @@ TEST(TestNode, reblanceCollapse) {
 
   auto ins = b.inodes();
   ASSERT_EQ(2, ins.size());
-  auto i1 = ins[0];
-  ASSERT_EQ("2", i1->key);
-  ASSERT_EQ("2v", i1->value);
-  auto i2 = ins[1];
-  ASSERT_EQ("3", i2->key);
-  ASSERT_EQ("3v", i2->value);
+  ASSERT_EQ("2", ins.key(0));
+  ASSERT_EQ("2v", ins.value(0));
+  ASSERT_EQ("3", ins.key(1));
+  ASSERT_EQ("3v", ins.value(1));
 
   ASSERT_EQ(0, nodeCache.cache.count(1));
   ASSERT_EQ(1, pageFree.freed[0]);
@@ -203,12 +198,10 @@ TEST(TestNode, reblanceMergeToPrev) {
 
   auto ins = b.inodes();
   ASSERT_EQ(2, ins.size());
-  auto i1 = ins[0];
-  ASSERT_EQ("11", i1->key);
-  ASSERT_EQ("11v", i1->value);
-  auto i2 = ins[1];
-  ASSERT_EQ("2", i2->key);
-  ASSERT_EQ("21v", i2->value);
+  ASSERT_EQ("11", ins.key(0));
+  ASSERT_EQ("11v", ins.value(0));
+  ASSERT_EQ("2", ins.key(1));
+  ASSERT_EQ("21v", ins.value(1));
 
   ASSERT_EQ(0, nodeCache.cache.count(1));
   ASSERT_EQ(0, nodeCache.cache.count(2));
@@ -243,12 +236,10 @@ TEST(TestNode, reblanceMergeToSelf) {
 
   auto ins = b.inodes();
   ASSERT_EQ(2, ins.size());
-  auto i1 = ins[0];
-  ASSERT_EQ("11", i1->key);
-  ASSERT_EQ("11v", i1->value);
-  auto i2 = ins[1];
-  ASSERT_EQ("2", i2->key);
-  ASSERT_EQ("21v", i2->value);
+  ASSERT_EQ("11", ins.key(0));
+  ASSERT_EQ("11v", ins.value(0));
+  ASSERT_EQ("2", ins.key(1));
+  ASSERT_EQ("21v", ins.value(1));
 
   ASSERT_EQ(0, nodeCache.cache.count(1));
   ASSERT_EQ(0, nodeCache.cache.count(2));
@@ -257,6 +248,51 @@ TEST(TestNode, reblanceMergeToSelf) {
 
 }
 
+TEST(TestNode, reblanceRedistribute) {
+
+  MockPageFree pageFree;
+  MockNodeCache nodeCache;
+  Node b;
+  b.put("1", "1", "", 1, 0);
+  b.put("5", "5", "", 2, 0);
+
+  string v(100, 'v');
+  Node* b1 = new Node(&b, 1, true);
+  b1->put("1", "1", "1", 0, 0);
+
+  Node* b2 = new Node(&b, 2, true);
+  b2->put("5", "5", v, 0, 0);
+  b2->put("6", "6", v, 0, 0);
+  b2->put("7", "7", v, 0, 0);
+  b2->put("8", "8", v, 0, 0);
+
+  b.children({b1, b2});
+
+  nodeCache.cache[1] = b1;
+  nodeCache.cache[2] = b2;
+
+  b1->reblance(400, nodeCache, pageFree, RebalancePolicy{.25, .75});
+
+  ASSERT_EQ(0, pageFree.freed.size());
+  ASSERT_EQ(2, b.children().size());
+  ASSERT_EQ(3, b1->count());
+  ASSERT_EQ("6", b1->inodes().key(2));
+  ASSERT_EQ(2, b2->count());
+  ASSERT_EQ("7", b2->inodes().key(0));
+
+  auto ins = b.inodes();
+  ASSERT_EQ(2, ins.size());
+  ASSERT_EQ("1", ins.key(0));
+  ASSERT_EQ("7", ins.key(1));
+  ASSERT_EQ(2, ins.pageID(1));
+
+  // merges if the merged one is small enough
+  b2->reblance(1000, nodeCache, pageFree, RebalancePolicy{.75, 1});
+  ASSERT_EQ(2, pageFree.freed[0]);
+  ASSERT_TRUE(b.isLeaf());
+  ASSERT_EQ(5, b.count());
+}
+
 TEST(TestNode, spill) {
 
   Node* root = new Node(nullptr, 1, false);
@@ -282,58 +318,100 @@ TEST(TestNode, spill) {
   Node* newRoot = root->spill(40, 0.5, pageFree, pageAlloc);
   auto ins = newRoot->inodes();
   ASSERT_EQ(2, ins.size());
-  auto in0 = ins[0];
-  ASSERT_EQ("1", in0->key);
-  ASSERT_EQ("", in0->value);
-  ASSERT_EQ(8, in0->pageID);
+  ASSERT_EQ("1", ins.key(0));
+  ASSERT_EQ("", ins.value(0));
+  ASSERT_EQ(8, ins.pageID(0));
 
-  auto in1 = ins[1];
-  ASSERT_EQ("2", in1->key);
-  ASSERT_EQ("", in1->value);
-  ASSERT_EQ(9, in1->pageID);
+  ASSERT_EQ("2", ins.key(1));
+  ASSERT_EQ("", ins.value(1));
+  ASSERT_EQ(9, ins.pageID(1));
 
-  auto p = pageAlloc.alloced[in0->pageID];
+  auto p = pageAlloc.alloced[ins.pageID(0)];
   Node n;
   n.readPage(p);
   auto ins1 = n.inodes();
   ASSERT_EQ(2, ins1.size());
-  auto in10 = ins1[0];
-  ASSERT_EQ("1", in10->key);
-  ASSERT_EQ("", in10->value);
-  ASSERT_EQ(4, in10->pageID);
-  auto in11 = ins1[1];
-  ASSERT_EQ("12", in11->key);
-  ASSERT_EQ("", in11->value);
-  ASSERT_EQ(5, in11->pageID);
-
-  p = pageAlloc.alloced[in1->pageID];
+  ASSERT_EQ("1", ins1.key(0));
+  ASSERT_EQ("", ins1.value(0));
+  ASSERT_EQ(4, ins1.pageID(0));
+  ASSERT_EQ("12", ins1.key(1));
+  ASSERT_EQ("", ins1.value(1));
+  ASSERT_EQ(5, ins1.pageID(1));
+
+  p = pageAlloc.alloced[ins.pageID(1)];
   Node n2;
   n2.readPage(p);
   auto ins2 = n2.inodes();
   ASSERT_EQ(2, ins2.size());
-  auto in20 = ins2[0];
-  ASSERT_EQ("2", in20->key);
-  ASSERT_EQ("", in20->value);
-  ASSERT_EQ(6, in20->pageID);
-  auto in21 = ins2[1];
-  ASSERT_EQ("22", in21->key);
-  ASSERT_EQ("", in21->value);
-  ASSERT_EQ(7, in21->pageID);
-
-  p = pageAlloc.alloced[in21->pageID];
+  ASSERT_EQ("2", ins2.key(0));
+  ASSERT_EQ("", ins2.value(0));
+  ASSERT_EQ(6, ins2.pageID(0));
+  ASSERT_EQ("22", ins2.key(1));
+  ASSERT_EQ("", ins2.value(1));
+  ASSERT_EQ(7, ins2.pageID(1));
+
+  p = pageAlloc.alloced[ins2.pageID(1)];
   Node n3;
   n3.readPage(p);
   ASSERT_TRUE(n3.isLeaf());
   auto ins3 = n3.inodes();
   ASSERT_EQ(2, ins3.size());
-  auto in30 = ins3[0];
-  ASSERT_EQ("22", in30->key);
-  ASSERT_EQ("22", in30->value);
-  ASSERT_EQ(in21->pageID, in30->pageID);
-  auto in31 = ins3[1];
-  ASSERT_EQ("23", in31->key);
-  ASSERT_EQ("23", in31->value);
-  ASSERT_EQ(in21->pageID, in31->pageID);
+  ASSERT_EQ("22", ins3.key(0));
+  ASSERT_EQ("22", ins3.value(0));
+  ASSERT_EQ(ins2.pageID(1), ins3.pageID(0));
+  ASSERT_EQ("23", ins3.key(1));
+  ASSERT_EQ("23", ins3.value(1));
+  ASSERT_EQ(ins2.pageID(1), ins3.pageID(1));
+}
+
+TEST(TestNode, spillOverflowValue) {
+
+  string big(300, 'b');
+  Node* l = new Node(nullptr, 0, true);
+  l->put("1", "1", "1", 0, 0);
+  l->put("2", "2", big, 0, 0);
+
+  MockPageAlloc pageAlloc(4);
+  MockPageFree pageFree;
+
+  Node* root = l->spill(256, 0.5, pageFree, pageAlloc);
+  ASSERT_EQ(l, root);
+
+  // the big value goes to the value pages first
+  auto vp = pageAlloc.alloced[4];
+  ASSERT_EQ(1, vp->overflow());
+
+  Node n;
+  n.readPage(pageAlloc.alloced[l->pageID()]);
+  auto ins = n.inodes();
+  ASSERT_EQ(2, ins.size());
+  ASSERT_EQ("1", ins.value(0));
+  ASSERT_EQ(0, ins.flags(0) & leafPageElement::kOverflowValueFlag);
+  ASSERT_NE(0, ins.flags(1) & leafPageElement::kOverflowValueFlag);
+
+  // the value is not aligned in the buffer of the node
+  overflowValue ov;
+  memcpy(&ov, ins.value(1).data(), sizeof(ov));
+  ASSERT_EQ(4, ov.pageID);
+  ASSERT_EQ(big.size(), ov.size);
+
+  ValueReader r(vp, ov.size);
+  const char* data;
+  ASSERT_EQ(100, r.next(100, &data));
+  ASSERT_EQ(string(100, 'b'), string(data, 100));
+  ASSERT_EQ(200, r.remaining());
+
+  string rest;
+  r.readAll(&rest);
+  ASSERT_EQ(string(200, 'b'), rest);
+  ASSERT_EQ(0, r.next(100, &data));
+
+  // the dropped value pages are freed by the next spill
+  l->del("2");
+  l->spill(256, 0.5, pageFree, pageAlloc);
+  ASSERT_EQ(4, pageFree.freed[0]);
+
+  delete l;
 }
 
 }  // namespace dbwheel
@@ -19,7 +19,7 @@ const std::string Page::type() {
   }
 
   if ((flags_ & kLeafPageFlag) != 0) {
-    return "leaf";
+    return (flags_ & kDenseLeafPageFlag) != 0 ? "denseLeaf" : "leaf";
   }
 
   if ((flags_ & kMetaPageFlag) != 0) {
@@ -30,22 +30,19 @@ const std::string Page::type() {
     return "freeList";
   }
 
+  if ((flags_ & kValuePageFlag) != 0) {
+    return "value";
+  }
+
   std::stringstream s;
   s << "unknow<" << flags_ << '>';
   return s.str();
 }
 
-branchPageElement* Page::branchPageElementOf(uint16_t index) {
-  return reinterpret_cast<branchPageElement*>(this->ptr_) + index;
-}
-
-leafPageElement* Page::leafPageElementOf(uint16_t index) {
-  return reinterpret_cast<leafPageElement*>(this->ptr_) + index;
-}
-
 const size_t Page::kPageHeaderSize = offsetof(Page, ptr_);
 const size_t Page::kBranchPageElementSize = sizeof(branchPageElement);
 const size_t Page::kLeafPageElementSize = sizeof(leafPageElement);
+const size_t Page::kDenseLeafHeaderSize = sizeof(denseLeafHeader);
 const size_t Page::kMinKeys = 2;
 
 }  // namespace dbwheel
@@ -7,11 +7,9 @@
 
 #include <string>
 
-namespace dbwheel {
-
-struct branchPageElement;
+#include "db/page_ele.h"
 
-struct leafPageElement;
+namespace dbwheel {
 
 struct Meta;
 
@@ -20,10 +18,17 @@ class Page {
   Page(uint64_t id, uint32_t overflow): id_(id), overflow_(overflow) {}
   Page(uint64_t id, uint16_t flags): id_(id), flags_(flags), count_(0) {}
   const uint64_t id() { return id_; }
+  const uint32_t overflow() { return overflow_; }
 
  private:
-  friend class Node;
+  friend class BucketImpl;
+  friend class Checker;
+  friend class Compactor;
   friend class DBImpl;
+  friend class Freelist;
+  friend class Node;
+  friend class TXImpl;
+  friend class ValueReader;
 
   const std::string type();
 
@@ -37,13 +42,30 @@ class Page {
     return reinterpret_cast<branchPageElement*>(this->ptr_);
   }
 
-  inline branchPageElement* branchPageElementOf(uint16_t index);
+  branchPageElement* branchPageElementOf(uint16_t index) {
+    return branchPageElements() + index;
+  }
 
   leafPageElement* leafPageElements() {
     return reinterpret_cast<leafPageElement*>(this->ptr_);
   }
 
-  inline leafPageElement* leafPageElementOf(uint16_t index);
+  leafPageElement* leafPageElementOf(uint16_t index) {
+    return leafPageElements() + index;
+  }
+
+  denseLeafHeader* denseLeaf() {
+    return reinterpret_cast<denseLeafHeader*>(this->ptr_);
+  }
+
+  char* denseKeyOf(uint32_t index) {
+    return this->ptr_ + sizeof(denseLeafHeader) + index * denseLeaf()->ksize;
+  }
+
+  char* denseValueOf(uint32_t index) {
+    return this->ptr_ + sizeof(denseLeafHeader) + count_ * denseLeaf()->ksize +
+        index * denseLeaf()->vsize;
+  }
 
   Meta* meta() {
     return reinterpret_cast<Meta*>(this->ptr_);
@@ -58,13 +80,17 @@ class Page {
   static const size_t kPageHeaderSize;
   static const size_t kBranchPageElementSize;
   static const size_t kLeafPageElementSize;
+  static const size_t kDenseLeafHeaderSize;
   static const size_t kMinKeys;
 
   enum {
     kBranchPageFlag = 0x01,
     kLeafPageFlag = 0x02,
     kMetaPageFlag = 0x04,
-    kFreeListPageFlag = 0x10
+    kFreeListPageFlag = 0x10,
+    kValuePageFlag = 0x20,
+    // set with kLeafPageFlag on the leaves of the fixed width buckets
+    kDenseLeafPageFlag = 0x40
   };
 
 };
@@ -4,6 +4,7 @@
 #define DB_PAGE_ALLOC_H_
 
 #include <cstddef>
+#include <cstdint>
 
 namespace dbwheel {
 
@@ -11,6 +12,8 @@ class Page;
 
 struct PageAlloc {
   virtual Page* alloc(size_t sz, size_t count) = 0;
+  // Allocates the pages as close to the page 'hint' as possible.
+  virtual Page* allocNear(size_t sz, size_t count, uint64_t /*hint*/) { return alloc(sz, count); }
 };
 
 }  // namespace dbwheel
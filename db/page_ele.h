@@ -21,6 +21,19 @@ struct branchPageElement {
 
 
 struct leafPageElement {
+  enum {
+    // the value is the header of a sub bucket
+    kBucketLeafFlag = 0x01,
+    // the value is an overflowValue which points to the real one
+    kOverflowValueFlag = 0x02,
+    // the id of the comparator of a sub bucket is kept in these bits
+    kComparatorMask = 0xff00,
+    kComparatorShift = 8,
+    // the widths of the keys and the values of a fixed width sub bucket
+    kKeyWidthShift = 16,
+    kValueWidthShift = 24
+  };
+
   std::string key();
   std::string value();
 
@@ -30,6 +43,23 @@ struct leafPageElement {
   uint32_t vsize;
 };
 
+// denseLeafHeader leads a leaf of a fixed width bucket, which is followed by
+// the array of the keys and then the array of the values, without the
+// elements.
+struct denseLeafHeader {
+  uint16_t ksize;
+  uint16_t vsize;
+  uint32_t unused;
+};
+
+// overflowValue is stored as the value of a leaf element flagged with
+// kOverflowValueFlag. The real value lives in a contiguous extent of value
+// pages starting at "pageID", right after the header of the first page.
+struct overflowValue {
+  uint64_t pageID;
+  uint64_t size;
+};
+
 }  // namespace dbwheel
 
 #endif  // DB_PAGE_ELE_H
@@ -0,0 +1,111 @@
+// Copyright (c) 2020
+//
+#include "db/preallocator.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "db/statistics.h"
+
+namespace dbwheel {
+
+Preallocator::Preallocator(int fd, uint64_t chunk, uint64_t fileSize, Statistics* stats):
+  fd_(fd),
+  chunk_(chunk),
+  stats_(stats),
+  allocated_(fileSize),
+  wanted_(fileSize),
+  unsupported_(false),
+  stop_(false),
+  thread_(&Preallocator::run, this) {}
+
+Preallocator::~Preallocator() {
+
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    stop_ = true;
+  }
+
+  cv_.notify_one();
+  thread_.join();
+}
+
+void Preallocator::reserve(uint64_t end) {
+
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (unsupported_ || end + chunk_ / 2 <= wanted_) {
+      return;
+    }
+    wanted_ = target(end);
+  }
+
+  cv_.notify_one();
+}
+
+uint64_t Preallocator::truncate(uint64_t end) {
+
+  std::lock_guard<std::mutex> io(ioMu_);
+
+  struct stat sb;
+  uint64_t size = target(end);
+  if (fstat(fd_, &sb) == -1 || (uint64_t) sb.st_size <= size + chunk_) {
+    return 0;
+  }
+
+  if (ftruncate(fd_, size) == -1) {
+    return 0;
+  }
+
+  std::lock_guard<std::mutex> lock(mu_);
+  allocated_ = size;
+  wanted_ = size;
+
+  return sb.st_size - size;
+}
+
+void Preallocator::run() {
+
+  StatisticsScope scope(stats_);
+  std::unique_lock<std::mutex> lock(mu_);
+
+  while (true) {
+    cv_.wait(lock, [this] { return stop_ || wanted_ > allocated_; });
+    if (stop_) {
+      return;
+    }
+
+    lock.unlock();
+
+    {
+      std::lock_guard<std::mutex> io(ioMu_);
+      uint64_t from, to;
+      {
+        std::lock_guard<std::mutex> relock(mu_);
+        from = allocated_;
+        to = wanted_;
+      }
+
+      // fallocate never touches the data written past the allocated end
+      // meanwhile, a failure is not retried until the data gets beyond 'to'
+      int ret = to > from ? fallocate(fd_, 0, from, to - from) : 0;
+      int err = errno;
+
+      std::lock_guard<std::mutex> relock(mu_);
+      allocated_ = std::max(allocated_, to);
+      if (ret == 0) {
+        recordTick(DBStats::kBytesPreallocated, to - from);
+      } else {
+        unsupported_ = err == EOPNOTSUPP || err == ENOSYS;
+      }
+    }
+
+    lock.lock();
+  }
+}
+
+}  // namespace dbwheel
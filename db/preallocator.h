@@ -0,0 +1,54 @@
+// Copyright (c) 2020
+//
+#ifndef DB_PREALLOCATOR_H_
+#define DB_PREALLOCATOR_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+namespace dbwheel {
+
+class Statistics;
+
+// Preallocator keeps the file allocated at least half a chunk ahead of the
+// data with fallocate in a background thread, so the commits overwrite the
+// allocated blocks instead of extending the file.
+class Preallocator {
+ public:
+  Preallocator(int fd, uint64_t chunk, uint64_t fileSize, Statistics* stats);
+  ~Preallocator();
+
+  // Asks for the file to be allocated beyond 'end', does not wait for it.
+  void reserve(uint64_t end);
+  // Cuts the file if it is allocated more than a chunk beyond the reserved
+  // size of 'end', returns the bytes cut off.
+  uint64_t truncate(uint64_t end);
+
+ private:
+  void run();
+  uint64_t target(uint64_t end) const {
+    return (end + chunk_ * 2 - 1) / chunk_ * chunk_;
+  }
+
+  int fd_;
+  uint64_t chunk_;
+  Statistics* stats_;
+
+  // serializes fallocate and ftruncate
+  std::mutex ioMu_;
+  // protects the fields below
+  std::mutex mu_;
+  std::condition_variable cv_;
+  uint64_t allocated_;
+  uint64_t wanted_;
+  // set if the file system does not support fallocate
+  bool unsupported_;
+  bool stop_;
+  std::thread thread_;
+};
+
+}  // namespace dbwheel
+
+#endif  // DB_PREALLOCATOR_H_
@@ -0,0 +1,147 @@
+// Copyright (c) 2020
+//
+#include "db/reader_table.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace dbwheel {
+
+// The size of the table file, which holds 252 slots.
+static const size_t kReaderTableSize = 4096;
+
+inline static Status ioError() {
+    return Status::ioError(strerror(errno));
+}
+
+inline static bool alive(pid_t pid) {
+  return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+ReaderTable::ReaderTable():
+  fd_(-1),
+  data_(nullptr),
+  slotCount_((kReaderTableSize - sizeof(Header)) / sizeof(Slot)),
+  slot_(nullptr) {}
+
+ReaderTable::~ReaderTable() {
+  close();
+}
+
+Status ReaderTable::open(const std::string& path, bool writer) {
+
+  fd_ = ::open(path.data(), O_CREAT|O_RDWR, S_IROTH|S_IRGRP|S_IRUSR|S_IWUSR);
+  if (fd_ == -1) {
+    return ioError();
+  }
+
+  if (writer && flock(fd_, LOCK_EX|LOCK_NB) == -1) {
+    return ioError();
+  }
+
+  // the processes creating it at the same time truncate it to the same size
+  struct stat sb;
+  if (fstat(fd_, &sb) == -1) {
+    return ioError();
+  }
+
+  if ((size_t) sb.st_size < kReaderTableSize && ftruncate(fd_, kReaderTableSize) == -1) {
+    return ioError();
+  }
+
+  void* data = mmap(nullptr, kReaderTableSize, PROT_READ|PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (data == MAP_FAILED) {
+    return Status::sysError(strerror(errno));
+  }
+  data_ = static_cast<char*>(data);
+
+  if (writer) {
+    return Status::OK();
+  }
+
+  pid_t pid = getpid();
+  for (size_t i = 0; i < slotCount_ && slot_ == nullptr; i++) {
+    if (claim(slots() + i, pid)) {
+      slot_ = slots() + i;
+    }
+  }
+
+  if (slot_ == nullptr) {
+    return Status::sysError("too many reader processes");
+  }
+
+  return Status::OK();
+}
+
+bool ReaderTable::claim(Slot* s, pid_t pid) {
+
+  pid_t owner = s->pid.load(std::memory_order_acquire);
+  if (owner != 0 && alive(owner)) {
+    return false;
+  }
+
+  if (!s->pid.compare_exchange_strong(owner, pid)) {
+    return false;
+  }
+
+  s->txID.store(0, std::memory_order_release);
+
+  return true;
+}
+
+Status ReaderTable::close() {
+
+  if (slot_ != nullptr) {
+    slot_->txID.store(0, std::memory_order_release);
+    slot_->pid.store(0, std::memory_order_release);
+    slot_ = nullptr;
+  }
+
+  if (data_ != nullptr && munmap(data_, kReaderTableSize) == -1) {
+    return Status::sysError(strerror(errno));
+  }
+  data_ = nullptr;
+
+  // also unlocks it
+  if (fd_ != -1 && ::close(fd_) == -1) {
+    return ioError();
+  }
+  fd_ = -1;
+
+  return Status::OK();
+}
+
+void ReaderTable::publish(uint64_t txID) {
+  slot_->txID.store(txID == UINT64_MAX ? 0 : txID + 1);
+}
+
+uint64_t ReaderTable::oldest() {
+
+  uint64_t minID = UINT64_MAX;
+  for (size_t i = 0; i < slotCount_; i++) {
+    Slot* s = slots() + i;
+    uint64_t id = s->txID.load();
+    if (id == 0 || id - 1 >= minID) {
+      continue;
+    }
+
+    // a crashed reader would hold the pages forever
+    pid_t pid = s->pid.load(std::memory_order_acquire);
+    if (pid != 0 && !alive(pid)) {
+      s->txID.compare_exchange_strong(id, 0);
+      continue;
+    }
+
+    minID = id - 1;
+  }
+
+  return minID;
+}
+
+}  // namespace dbwheel
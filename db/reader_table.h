@@ -0,0 +1,67 @@
+// Copyright (c) 2020
+//
+#ifndef DB_READER_TABLE_H_
+#define DB_READER_TABLE_H_
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include "include/dbwheel/status.h"
+
+namespace dbwheel {
+
+// ReaderTable is the file shared by the processes of a database opened with
+// Options::multiProcess. The writer publishes its commits there, and every
+// reader process claims a slot for the oldest transaction it reads, so the
+// writer does not reuse the pages of it.
+class ReaderTable {
+ public:
+  ReaderTable();
+  ~ReaderTable();
+
+  // Maps the table file 'path', the writer locks it against other writers
+  // and a reader claims a slot.
+  Status open(const std::string& path, bool writer);
+  Status close();
+
+  // Publishes the oldest transaction read by this process, UINT64_MAX if
+  // there is none.
+  void publish(uint64_t txID);
+  // Returns the oldest transaction read by the reader processes, UINT64_MAX
+  // if there is none. The slots of the dead processes are freed.
+  uint64_t oldest();
+
+  // The latest transaction committed by the writer, 0 until it commits.
+  void commit(uint64_t txID) { header()->txID.store(txID, std::memory_order_release); }
+  uint64_t txID() const { return header()->txID.load(std::memory_order_acquire); }
+
+ private:
+  struct Header {
+    std::atomic<uint64_t> txID;
+    uint64_t padding[7];
+  };
+
+  // a free slot has no pid, an idle one has no txID, the txID is stored plus
+  // one so the zeros of a new file are free slots
+  struct Slot {
+    std::atomic<pid_t> pid;
+    std::atomic<uint64_t> txID;
+  };
+
+  Header* header() const { return reinterpret_cast<Header*>(data_); }
+  Slot* slots() const { return reinterpret_cast<Slot*>(data_ + sizeof(Header)); }
+  bool claim(Slot* s, pid_t pid);
+
+  int fd_;
+  char* data_;
+  size_t slotCount_;
+  // null for the writer
+  Slot* slot_;
+};
+
+}  // namespace dbwheel
+
+#endif  // DB_READER_TABLE_H_
@@ -0,0 +1,59 @@
+// Copyright (c) 2020
+//
+#ifndef DB_SEQUENCE_LEASE_H_
+#define DB_SEQUENCE_LEASE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+
+namespace dbwheel {
+
+// SequenceLease hands out the ids of the range [start, limit) reserved in
+// the bucket sequence, without locking. A range is only replaced with a
+// higher one, and the counter is never moved back, so an id taken while
+// replacing is either in the old range or the new one, or rejected.
+class SequenceLease {
+ public:
+  SequenceLease(): next_(0), start_(0), limit_(0) {}
+
+  // Takes the next id, returns false if the range is used up.
+  bool next(uint64_t* seq) {
+
+    uint64_t v = next_.fetch_add(1, std::memory_order_relaxed);
+    // the limit is published after the start
+    uint64_t limit = limit_.load(std::memory_order_acquire);
+    uint64_t start = start_.load(std::memory_order_acquire);
+    if (v < start || v >= limit) {
+      return false;
+    }
+
+    *seq = v;
+    return true;
+  }
+
+  // The start of the next range must be no less than this.
+  uint64_t low() const { return next_.load(std::memory_order_relaxed); }
+
+  // Replaces the range with [start, limit), which is higher than the current one.
+  void reset(uint64_t start, uint64_t limit) {
+
+    start_.store(start, std::memory_order_release);
+    uint64_t cur = next_.load(std::memory_order_relaxed);
+    while (cur < start && !next_.compare_exchange_weak(cur, start, std::memory_order_relaxed)) {}
+    limit_.store(limit, std::memory_order_release);
+  }
+
+  // Serializes the reservations of the ranges.
+  std::mutex& mutex() { return mutex_; }
+
+ private:
+  std::atomic<uint64_t> next_;
+  std::atomic<uint64_t> start_;
+  std::atomic<uint64_t> limit_;
+  std::mutex mutex_;
+};
+
+}  // namespace dbwheel
+
+#endif  // DB_SEQUENCE_LEASE_H_
@@ -0,0 +1,299 @@
+// Copyright (c) 2020
+//
+#include "db/statistics.h"
+
+#include <algorithm>
+#include <sstream>
+
+namespace dbwheel {
+
+thread_local StatisticsSlab* currentStatisticsSlab = nullptr;
+thread_local TxStats* currentTxStats = nullptr;
+
+static std::atomic<uint64_t> nextStatisticsID{1};
+
+// the last slab looked up by the thread, saves the lock for the same database
+struct SlabCache {
+  uint64_t owner;
+  StatisticsSlab* slab;
+};
+
+static thread_local SlabCache slabCache{0, nullptr};
+
+static inline int bucketOf(uint64_t v) {
+  return v == 0 ? 0 : 64 - __builtin_clzll(v);
+}
+
+static inline uint64_t bucketUpperBound(int b) {
+  return b >= 64 ? UINT64_MAX : ((uint64_t)1 << b) - 1;
+}
+
+StatisticsSlab::StatisticsSlab() {
+
+  for (auto& t : tickers) {
+    t.store(0, std::memory_order_relaxed);
+  }
+
+  for (auto& h : histograms) {
+    for (auto& b : h.buckets) {
+      b.store(0, std::memory_order_relaxed);
+    }
+    h.count.store(0, std::memory_order_relaxed);
+    h.sum.store(0, std::memory_order_relaxed);
+    h.min.store(UINT64_MAX, std::memory_order_relaxed);
+    h.max.store(0, std::memory_order_relaxed);
+  }
+}
+
+static inline void inc(std::atomic<uint64_t>& v, uint64_t n) {
+  v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+void StatisticsSlab::measure(DBStats::Histogram h, uint64_t v) {
+
+  auto& hist = histograms[h];
+  inc(hist.buckets[bucketOf(v)], 1);
+  inc(hist.count, 1);
+  inc(hist.sum, v);
+
+  if (v < hist.min.load(std::memory_order_relaxed)) {
+    hist.min.store(v, std::memory_order_relaxed);
+  }
+
+  if (v > hist.max.load(std::memory_order_relaxed)) {
+    hist.max.store(v, std::memory_order_relaxed);
+  }
+}
+
+Statistics::Statistics(): id_(nextStatisticsID.fetch_add(1)) {}
+
+Statistics::~Statistics() {
+
+  for (auto& e : slabs_) {
+    delete e.second;
+  }
+}
+
+StatisticsSlab* Statistics::slab() {
+
+  if (slabCache.owner == id_) {
+    return slabCache.slab;
+  }
+
+  std::lock_guard<std::mutex> lock(mu_);
+
+  auto& slab = slabs_[std::this_thread::get_id()];
+  if (slab == nullptr) {
+    slab = new StatisticsSlab();
+  }
+
+  slabCache = SlabCache{id_, slab};
+
+  return slab;
+}
+
+static uint64_t percentile(const uint64_t* buckets, uint64_t count, uint64_t max, double p) {
+
+  uint64_t rank = (uint64_t) (count * p + 0.5), sum = 0;
+  if (rank == 0) {
+    rank = 1;
+  }
+
+  for (int b = 0; b < kHistogramBuckets; b++) {
+    sum += buckets[b];
+    if (sum >= rank) {
+      return std::min(bucketUpperBound(b), max);
+    }
+  }
+
+  return max;
+}
+
+void Statistics::aggregate(DBStats* stats) {
+
+  uint64_t buckets[DBStats::kHistogramMax][kHistogramBuckets] = {};
+
+  for (int t = 0; t < DBStats::kTickerMax; t++) {
+    stats->tickers[t] = 0;
+  }
+
+  for (int h = 0; h < DBStats::kHistogramMax; h++) {
+    stats->histograms[h] = HistogramStats{0, 0, UINT64_MAX, 0, 0, 0};
+  }
+
+  std::lock_guard<std::mutex> lock(mu_);
+
+  for (auto& e : slabs_) {
+    auto slab = e.second;
+
+    for (int t = 0; t < DBStats::kTickerMax; t++) {
+      stats->tickers[t] += slab->tickers[t].load(std::memory_order_relaxed);
+    }
+
+    for (int h = 0; h < DBStats::kHistogramMax; h++) {
+      auto& from = slab->histograms[h];
+      auto& to = stats->histograms[h];
+
+      to.count += from.count.load(std::memory_order_relaxed);
+      to.sum += from.sum.load(std::memory_order_relaxed);
+      to.min = std::min(to.min, from.min.load(std::memory_order_relaxed));
+      to.max = std::max(to.max, from.max.load(std::memory_order_relaxed));
+
+      for (int b = 0; b < kHistogramBuckets; b++) {
+        buckets[h][b] += from.buckets[b].load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  for (int h = 0; h < DBStats::kHistogramMax; h++) {
+    auto& to = stats->histograms[h];
+    if (to.count == 0) {
+      to.min = 0;
+      continue;
+    }
+
+    to.p50 = percentile(buckets[h], to.count, to.max, .5);
+    to.p99 = percentile(buckets[h], to.count, to.max, .99);
+  }
+}
+
+StatisticsScope::StatisticsScope(Statistics* stats, TxStats* txStats):
+  prev_(currentStatisticsSlab),
+  prevTx_(currentTxStats) {
+
+  currentStatisticsSlab = stats == nullptr ? nullptr : stats->slab();
+  currentTxStats = txStats;
+}
+
+StatisticsScope::~StatisticsScope() {
+  currentStatisticsSlab = prev_;
+  currentTxStats = prevTx_;
+}
+
+const char* DBStats::name(Ticker t) {
+
+  switch (t) {
+    case kPagesAllocated:
+      return "pages.allocated";
+    case kPagesFreed:
+      return "pages.freed";
+    case kSplits:
+      return "node.splits";
+    case kRebalances:
+      return "node.rebalances";
+    case kRedistributions:
+      return "node.redistributions";
+    case kCollapses:
+      return "node.collapses";
+    case kBytesWritten:
+      return "bytes.written";
+    case kMmapRemaps:
+      return "mmap.remaps";
+    case kReadTXs:
+      return "tx.read";
+    case kWriteTXs:
+      return "tx.write";
+    case kPagesRelocated:
+      return "pages.relocated";
+    case kPagesTruncated:
+      return "pages.truncated";
+    case kBytesPreallocated:
+      return "bytes.preallocated";
+    case kFilterNegatives:
+      return "filter.negatives";
+    case kWalBytes:
+      return "wal.bytes";
+    case kCheckpointPages:
+      return "checkpoint.pages";
+    case kCheckpoints:
+      return "checkpoints";
+    case kPagesSpilledEarly:
+      return "pages.spilled.early";
+    default:
+      return "unknown";
+  }
+}
+
+const char* DBStats::name(Histogram h) {
+
+  switch (h) {
+    case kSpillMicros:
+      return "spill.micros";
+    case kCommitBytes:
+      return "commit.bytes";
+    case kFsyncMicros:
+      return "fsync.micros";
+    default:
+      return "unknown";
+  }
+}
+
+std::string DBStats::toString() const {
+
+  std::stringstream s;
+  for (int t = 0; t < kTickerMax; t++) {
+    s << name(Ticker(t)) << ' ' << tickers[t] << '\n';
+  }
+
+  for (int h = 0; h < kHistogramMax; h++) {
+    auto& hist = histograms[h];
+    s << name(Histogram(h))
+      << " count:" << hist.count
+      << " sum:" << hist.sum
+      << " min:" << hist.min
+      << " max:" << hist.max
+      << " avg:" << hist.average()
+      << " p50:" << hist.p50
+      << " p99:" << hist.p99 << '\n';
+  }
+
+  return s.str();
+}
+
+std::string DBStats::toJSON() const {
+
+  std::stringstream s;
+  s << '{';
+  for (int t = 0; t < kTickerMax; t++) {
+    s << '"' << name(Ticker(t)) << "\":" << tickers[t] << ',';
+  }
+
+  for (int h = 0; h < kHistogramMax; h++) {
+    auto& hist = histograms[h];
+    s << (h > 0 ? "," : "") << '"' << name(Histogram(h)) << "\":{"
+      << "\"count\":" << hist.count
+      << ",\"sum\":" << hist.sum
+      << ",\"min\":" << hist.min
+      << ",\"max\":" << hist.max
+      << ",\"avg\":" << hist.average()
+      << ",\"p50\":" << hist.p50
+      << ",\"p99\":" << hist.p99 << '}';
+  }
+  s << '}';
+
+  return s.str();
+}
+
+std::string TxStats::toString() const {
+
+  std::stringstream s;
+  s << "nodes decoded:" << nodesDecoded
+    << " inodes touched:" << inodesTouched
+    << " splits:" << splits
+    << " merges:" << merges
+    << " redistributions:" << redistributions
+    << " pages allocated:" << pagesAllocated
+    << " pages freed:" << pagesFreed
+    << " bytes serialized:" << bytesSerialized
+    << " bytes written:" << bytesWritten
+    << " mmap remaps:" << mmapRemaps
+    << " rebalance:" << rebalanceMicros << "us"
+    << " spill:" << spillMicros << "us"
+    << " write:" << writeMicros << "us"
+    << " sync:" << syncMicros << "us"
+    << " meta:" << metaMicros << "us";
+
+  return s.str();
+}
+
+}  // namespace dbwheel
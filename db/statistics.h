@@ -0,0 +1,150 @@
+// Copyright (c) 2020
+//
+#ifndef DB_STATISTICS_H_
+#define DB_STATISTICS_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include "include/dbwheel/stats.h"
+
+namespace dbwheel {
+
+static const size_t kCacheLineSize = 64;
+
+// The samples of a histogram are counted in the bucket of their bit width.
+static const int kHistogramBuckets = 65;
+
+// Every thread records into its own slab, only the owner thread writes it,
+// so an update is a relaxed load and store without any locked instruction.
+// The slabs are aligned to the cache line to keep them from false sharing.
+struct alignas(kCacheLineSize) StatisticsSlab {
+  struct Histogram {
+    std::atomic<uint64_t> buckets[kHistogramBuckets];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> min;
+    std::atomic<uint64_t> max;
+  };
+
+  StatisticsSlab();
+
+  void add(DBStats::Ticker t, uint64_t n) {
+    auto& v = tickers[t];
+    v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  void measure(DBStats::Histogram h, uint64_t v);
+
+  std::atomic<uint64_t> tickers[DBStats::kTickerMax];
+  Histogram histograms[DBStats::kHistogramMax];
+};
+
+// Statistics owns the slabs of all the threads recording to a database,
+// they are aggregated only when reading.
+class Statistics {
+ public:
+  Statistics();
+  ~Statistics();
+
+  Statistics(const Statistics&) = delete;
+  Statistics& operator=(const Statistics&) = delete;
+
+  // Returns the slab of the calling thread.
+  StatisticsSlab* slab();
+  void aggregate(DBStats* stats);
+
+ private:
+  const uint64_t id_;
+  std::mutex mu_;
+  std::map<std::thread::id, StatisticsSlab*> slabs_;
+};
+
+// StatisticsScope binds the statistics and the transaction report to the
+// calling thread during its lifetime, the engine code records into the bound
+// ones by recordTick, measure and recordTx. Nothing is recorded if nothing
+// is bound, a null one unbinds the current one.
+class StatisticsScope {
+ public:
+  explicit StatisticsScope(Statistics* stats, TxStats* txStats = nullptr);
+  ~StatisticsScope();
+
+ private:
+  StatisticsSlab* prev_;
+  TxStats* prevTx_;
+};
+
+extern thread_local StatisticsSlab* currentStatisticsSlab;
+extern thread_local TxStats* currentTxStats;
+
+inline void recordTick(DBStats::Ticker t, uint64_t n = 1) {
+  auto slab = currentStatisticsSlab;
+  if (slab != nullptr) {
+    slab->add(t, n);
+  }
+}
+
+inline void measure(DBStats::Histogram h, uint64_t v) {
+  auto slab = currentStatisticsSlab;
+  if (slab != nullptr) {
+    slab->measure(h, v);
+  }
+}
+
+inline void recordTx(uint64_t TxStats::*field, uint64_t n = 1) {
+  auto stats = currentTxStats;
+  if (stats != nullptr) {
+    stats->*field += n;
+  }
+}
+
+inline uint64_t nowMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// StopWatch measures the elapsed micros of its lifetime into the histogram,
+// the clock is not read if no statistics is bound.
+class StopWatch {
+ public:
+  explicit StopWatch(DBStats::Histogram h):
+    histogram_(h),
+    start_(currentStatisticsSlab == nullptr ? 0 : nowMicros()) {}
+
+  ~StopWatch() {
+    if (start_ > 0) {
+      measure(histogram_, nowMicros() - start_);
+    }
+  }
+
+ private:
+  DBStats::Histogram histogram_;
+  uint64_t start_;
+};
+
+// TxStopWatch adds the elapsed micros of its lifetime to the field of the
+// bound transaction report.
+class TxStopWatch {
+ public:
+  explicit TxStopWatch(uint64_t TxStats::*field):
+    field_(field),
+    start_(currentTxStats == nullptr ? 0 : nowMicros()) {}
+
+  ~TxStopWatch() {
+    if (start_ > 0) {
+      recordTx(field_, nowMicros() - start_);
+    }
+  }
+
+ private:
+  uint64_t TxStats::*field_;
+  uint64_t start_;
+};
+
+}  // namespace dbwheel
+
+#endif  // DB_STATISTICS_H_
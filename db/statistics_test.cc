@@ -0,0 +1,90 @@
+// Copyright (c) 2020
+//
+#include "gtest/gtest.h"
+
+#include <thread>
+#include <vector>
+
+#include "db/statistics.h"
+
+namespace dbwheel {
+
+TEST(TestStatistics, aggregate) {
+
+  Statistics stats;
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; i++) {
+    threads.emplace_back([&stats] {
+      StatisticsScope scope(&stats);
+      for (int j = 0; j < 1000; j++) {
+        recordTick(DBStats::kSplits);
+      }
+      measure(DBStats::kFsyncMicros, 100);
+    });
+  }
+
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  // not bound
+  recordTick(DBStats::kSplits);
+
+  DBStats s;
+  stats.aggregate(&s);
+  ASSERT_EQ(4000, s.ticker(DBStats::kSplits));
+  ASSERT_EQ(0, s.ticker(DBStats::kCollapses));
+
+  auto& h = s.histogram(DBStats::kFsyncMicros);
+  ASSERT_EQ(4, h.count);
+  ASSERT_EQ(400, h.sum);
+  ASSERT_EQ(100, h.min);
+  ASSERT_EQ(100, h.max);
+  ASSERT_EQ(100, h.p99);
+  ASSERT_EQ(0, s.histogram(DBStats::kSpillMicros).count);
+}
+
+TEST(TestStatistics, nestedScope) {
+
+  Statistics a, b;
+  {
+    StatisticsScope sa(&a);
+    recordTick(DBStats::kReadTXs);
+    {
+      StatisticsScope sb(&b);
+      recordTick(DBStats::kReadTXs, 2);
+    }
+    recordTick(DBStats::kReadTXs);
+  }
+
+  DBStats s;
+  a.aggregate(&s);
+  ASSERT_EQ(2, s.ticker(DBStats::kReadTXs));
+  b.aggregate(&s);
+  ASSERT_EQ(2, s.ticker(DBStats::kReadTXs));
+}
+
+TEST(TestStatistics, dump) {
+
+  Statistics stats;
+  {
+    StatisticsScope scope(&stats);
+    recordTick(DBStats::kPagesAllocated, 3);
+    measure(DBStats::kCommitBytes, 4096);
+  }
+
+  DBStats s;
+  stats.aggregate(&s);
+
+  auto text = s.toString();
+  ASSERT_NE(std::string::npos, text.find("pages.allocated 3\n"));
+
+  auto json = s.toJSON();
+  ASSERT_EQ('{', json.front());
+  ASSERT_EQ('}', json.back());
+  ASSERT_NE(std::string::npos, json.find("\"pages.allocated\":3,"));
+  ASSERT_NE(std::string::npos, json.find("\"commit.bytes\":{\"count\":1,\"sum\":4096"));
+}
+
+}  // namespace dbwheel
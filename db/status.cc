@@ -21,6 +21,12 @@ std::string Status::toString() const {
     case kDataError:
       s << "data error:";
       break;
+    case kNotFound:
+      s << "not found:";
+      break;
+    case kInvalidArgument:
+      s << "invalid argument:";
+      break;
     default:
       s << "uknown code:" << code_;
       ASSERTM(false, s.str());
@@ -0,0 +1,75 @@
+// Copyright (c) 2020
+//
+#include "db/syncer.h"
+
+#include <chrono>
+
+#include "db/statistics.h"
+
+namespace dbwheel {
+
+Syncer::Syncer(const std::function<Status()>& sync, uint64_t intervalMs, uint64_t bytes,
+    Statistics* stats):
+  sync_(sync),
+  intervalMs_(intervalMs),
+  bytes_(bytes),
+  stats_(stats),
+  written_(0),
+  stop_(false),
+  thread_(&Syncer::run, this) {}
+
+Syncer::~Syncer() {
+  stop();
+}
+
+void Syncer::written(uint64_t bytes) {
+
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    written_ += bytes;
+    if (bytes_ == 0 || written_ < bytes_) {
+      return;
+    }
+  }
+
+  cv_.notify_one();
+}
+
+Status Syncer::stop() {
+
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (stop_) {
+      return Status::OK();
+    }
+    stop_ = true;
+  }
+
+  cv_.notify_one();
+  thread_.join();
+
+  StatisticsScope scope(stats_);
+  return sync_();
+}
+
+void Syncer::run() {
+
+  StatisticsScope scope(stats_);
+  std::unique_lock<std::mutex> lock(mu_);
+
+  while (true) {
+    cv_.wait_for(lock, std::chrono::milliseconds(intervalMs_),
+        [this] { return stop_ || (bytes_ > 0 && written_ >= bytes_); });
+    if (stop_) {
+      return;
+    }
+    written_ = 0;
+
+    // a failure is retried by the next round, and returned by stop
+    lock.unlock();
+    sync_();
+    lock.lock();
+  }
+}
+
+}  // namespace dbwheel
@@ -0,0 +1,51 @@
+// Copyright (c) 2020
+//
+#ifndef DB_SYNCER_H_
+#define DB_SYNCER_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "include/dbwheel/status.h"
+
+namespace dbwheel {
+
+class Statistics;
+
+// Syncer calls 'sync' in a background thread every 'intervalMs', or once
+// 'bytes' are written since the last call if it's not 0, so the commits of
+// Options::kSyncPeriodic return without syncing.
+class Syncer {
+ public:
+  Syncer(const std::function<Status()>& sync, uint64_t intervalMs, uint64_t bytes,
+      Statistics* stats);
+  ~Syncer();
+
+  // Counts the bytes written by a commit, does not wait for the sync.
+  void written(uint64_t bytes);
+  // Stops the thread after syncing once more, returns the status of it.
+  Status stop();
+
+ private:
+  void run();
+
+  std::function<Status()> sync_;
+  uint64_t intervalMs_;
+  uint64_t bytes_;
+  Statistics* stats_;
+
+  // protects the fields below
+  std::mutex mu_;
+  std::condition_variable cv_;
+  // the bytes written since the last sync
+  uint64_t written_;
+  bool stop_;
+  std::thread thread_;
+};
+
+}  // namespace dbwheel
+
+#endif  // DB_SYNCER_H_
@@ -1,4 +1,685 @@
 // Copyright (c) 2020
 //
-#include "include/dbwheel/tx.h"
+#include "db/tx_impl.h"
 
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <unistd.h>
+
+#include "db/assert.h"
+#include "db/db_impl.h"
+#include "db/node.h"
+#include "db/page.h"
+#include "db/statistics.h"
+
+namespace dbwheel {
+
+// The least number of the keys a bucket filter is sized for.
+static const size_t kMinFilterKeys = 1024;
+
+// The most top level buckets visited by the defragmentation per commit.
+static const size_t kDefragBucketsPerTx = 16;
+
+// The leaves scanned per leaf moved by the defragmentation.
+static const size_t kDefragScanFactor = 16;
+
+inline static Status ioError() {
+    return Status::ioError(strerror(errno));
+}
+
+TXImpl::TXImpl(DBImpl* db, bool writable):
+  db_(db),
+  writable_(writable),
+  meta_(*db->meta()),
+  root_(this, meta_.root),
+  dirtyBytes_(0),
+  spilling_(false),
+  mappedEnd_(0),
+  mappedBytes_(0) {
+
+  if (writable_) {
+    meta_.txID++;
+    if (db->wal_ != nullptr) {
+      walBatch_.reset(new WalBatch());
+    }
+  }
+}
+
+TXImpl::TXImpl(DBImpl* db, const Meta& meta):
+  db_(db),
+  writable_(false),
+  meta_(meta),
+  root_(this, meta_.root),
+  dirtyBytes_(0),
+  spilling_(false),
+  mappedEnd_(0),
+  mappedBytes_(0) {}
+
+TXImpl::~TXImpl() {
+
+  for (auto& e : pages_) {
+    delete [] reinterpret_cast<char*>(e.second);
+  }
+}
+
+Bucket* TXImpl::createBucket(const std::string& name, const Comparator* comparator) {
+  return createBucket0(name, comparator, 0, 0);
+}
+
+Bucket* TXImpl::createFixedWidthBucket(const std::string& name, uint8_t keySize,
+    uint8_t valueSize, const Comparator* comparator) {
+  return keySize == 0 ? nullptr : createBucket0(name, comparator, keySize, valueSize);
+}
+
+Bucket* TXImpl::createBucket0(const std::string& name, const Comparator* comparator,
+    uint8_t keySize, uint8_t valueSize) {
+
+  // the ids below 16 are reserved by the builtin comparators
+  if (comparator != nullptr && comparator->id() < 16 && comparator != bytewiseComparator() &&
+      comparator != uint64Comparator()) {
+    return nullptr;
+  }
+
+  BucketImpl* b = root_.createBucket(name, comparator, keySize, valueSize);
+  if (b != nullptr) {
+    attachIndexes(name, b);
+    attachFilter(name, b);
+  }
+
+  return b;
+}
+
+Bucket* TXImpl::bucket(const std::string& name) {
+
+  // the index is read with the entries of this transaction, an invalid entry
+  // fails the commit instead
+  auto it = indexWriters_.find(name);
+  if (it != indexWriters_.end()) {
+    flushIndex(it->second.get());
+  }
+
+  return openBucket(name);
+}
+
+// Opens the top level bucket 'name' with its indexes and its filter.
+BucketImpl* TXImpl::openBucket(const std::string& name) {
+
+  BucketImpl* b = root_.bucket(name);
+  if (b == nullptr) {
+    return nullptr;
+  }
+
+  if (writable_) {
+    attachIndexes(name, b);
+  }
+  attachFilter(name, b);
+
+  return b;
+}
+
+// Lets the bucket 'name' skip the absent keys by its filter, which is built
+// from the leaves on first use, and again once it's full. Only the writer
+// builds it, from the bucket not changed yet, and adds the keys put later,
+// so it holds the keys of the snapshots since. A read only database has no
+// writer, so the readers build it there.
+void TXImpl::attachFilter(const std::string& name, BucketImpl* b) {
+
+  auto& options = db_->options_;
+  // the filters of the reader processes miss the keys of the writer
+  if (options.filterBitsPerKey == 0 || (options.readOnly && options.multiProcess)) {
+    return;
+  }
+
+  std::shared_ptr<BloomFilter> filter;
+  {
+    std::lock_guard<std::mutex> lock(db_->filtersLock_);
+    auto it = db_->filters_.find(name);
+    if (it != db_->filters_.end()) {
+      filter = it->second;
+    }
+  }
+
+  bool builder = writable_ || options.readOnly;
+  if (!builder || b->changed() || (filter != nullptr && !filter->full())) {
+    if (filter != nullptr && meta_.txID >= filter->minTxID()) {
+      b->filter(filter);
+    }
+    return;
+  }
+
+  // sized by the counts of the leaves, and built from the keys without the
+  // values
+  std::vector<BucketImpl::pageOrNode> leaves;
+  size_t count = b->leaves(&leaves);
+
+  // the snapshot the writer began on
+  uint64_t since = writable_ ? meta_.txID - 1 : meta_.txID;
+  filter = std::make_shared<BloomFilter>(
+      std::max(count * 2, kMinFilterKeys), options.filterBitsPerKey, since);
+  for (auto& pn : leaves) {
+    for (size_t i = 0, n = pn.count(); i < n; i++) {
+      if ((pn.flags(i) & leafPageElement::kBucketLeafFlag) == 0) {
+        filter->add(pn.key(i));
+      }
+    }
+  }
+  b->filter(filter);
+
+  std::lock_guard<std::mutex> lock(db_->filtersLock_);
+  db_->filters_[name] = filter;
+}
+
+// Lets the writes of the bucket 'name' collect the entries of its indexes.
+void TXImpl::attachIndexes(const std::string& name, BucketImpl* b) {
+
+  auto it = db_->indexes_.find(name);
+  if (it == db_->indexes_.end()) {
+    return;
+  }
+
+  std::vector<IndexWriter*> writers;
+  for (auto& index : it->second) {
+    auto& w = indexWriters_[index.first];
+    if (w == nullptr) {
+      w.reset(new IndexWriter{index.first, &index.second, WriteBatch()});
+    }
+    writers.push_back(w.get());
+  }
+
+  b->indexes(writers);
+}
+
+// Merges the collected entries into the index with one sorted pass.
+Status TXImpl::flushIndex(IndexWriter* w) {
+
+  if (w->batch.count() == 0) {
+    return Status::OK();
+  }
+
+  BucketImpl* index = openBucket(w->index);
+  if (index == nullptr) {
+    return Status::notFound(w->index);
+  }
+
+  Status s = index->write(w->batch);
+  if (s.ok()) {
+    w->batch.clear();
+  }
+
+  return s;
+}
+
+Status TXImpl::spillIfOverBudget() {
+
+  uint64_t budget = db_->options_.txMemoryBudget;
+  // the index writes of the spill don't spill again
+  if (budget == 0 || dirtyBytes_ <= budget || spilling_) {
+    return Status::OK();
+  }
+
+  spilling_ = true;
+  Status s = spillEarly();
+  spilling_ = false;
+
+  return s;
+}
+
+// Spills the buckets as the commit does, and writes the dirty pages without
+// syncing, they are free in the file until the meta points to them. A page
+// failing to be written is kept in the memory.
+Status TXImpl::spillEarly() {
+
+  for (auto& e : indexWriters_) {
+    Status s = flushIndex(e.second.get());
+    if (!s.ok()) {
+      return s;
+    }
+  }
+
+  {
+    TxStopWatch sw(&TxStats::rebalanceMicros);
+    root_.rebalance();
+  }
+
+  {
+    StopWatch sw(DBStats::kSpillMicros);
+    TxStopWatch txsw(&TxStats::spillMicros);
+    root_.spill();
+  }
+  root_.unload();
+  dirtyBytes_ = 0;
+
+  size_t pageSize = db_->pageSize_;
+  Status s = db_->grow((meta_.pageID + 1) * pageSize);
+  if (!s.ok()) {
+    return s;
+  }
+
+  uint64_t written = 0, count = 0;
+  {
+    TxStopWatch sw(&TxStats::writeMicros);
+
+    for (auto it = pages_.begin(); it != pages_.end();) {
+      Page* p = it->second;
+      s = writePage(p, &written);
+      if (!s.ok()) {
+        break;
+      }
+
+      spilled_.emplace_back(p->id(), p->overflow());
+      count += p->overflow() + 1;
+      delete [] reinterpret_cast<char*>(p);
+      it = pages_.erase(it);
+    }
+  }
+
+  recordTick(DBStats::kBytesWritten, written);
+  recordTick(DBStats::kPagesSpilledEarly, count);
+  recordTx(&TxStats::bytesWritten, written);
+
+  return s;
+}
+
+Page* TXImpl::alloc(size_t sz, size_t count) {
+  return allocNear(sz, count, 0);
+}
+
+Page* TXImpl::allocNear(size_t sz, size_t count, uint64_t hint) {
+
+  ASSERTM(writable_, "allocate in the read only transaction");
+
+  recordTick(DBStats::kPagesAllocated, count);
+  recordTx(&TxStats::pagesAllocated, count);
+
+  uint64_t id = hint > 0 ? db_->freelist_.allocate(count, hint) : db_->freelist_.allocate(count);
+  if (id == 0) {
+    id = meta_.pageID;
+    meta_.pageID += count;
+
+    Page* p = db_->writableMmap() ? allocMapped(id, count) : nullptr;
+    if (p != nullptr) {
+      return p;
+    }
+  }
+
+  char* buf = new char[sz * count];
+  memset(buf, 0, sz * count);
+
+  Page* p = new (buf) Page(id, static_cast<uint32_t>(count - 1));
+  pages_[id] = p;
+
+  return p;
+}
+
+// Returns the page past the end of the data in the writable mapping, which
+// no snapshot reads, or null if the file can't be extended for it. The
+// pointer is valid until the next allocation, which may remap the file.
+Page* TXImpl::allocMapped(uint64_t id, size_t count) {
+
+  size_t pageSize = db_->pageSize_;
+  uint64_t end = (id + count) * pageSize;
+  if (end > mappedEnd_ && !db_->extend(end, &mappedEnd_).ok()) {
+    return nullptr;
+  }
+
+  char* data = db_->data_ + id * pageSize;
+  memset(data, 0, count * pageSize);
+  Page* p = new (data) Page(id, static_cast<uint32_t>(count - 1));
+  mappedBytes_ += count * pageSize;
+
+  return p;
+}
+
+void TXImpl::free(uint64_t pageID) {
+
+  ASSERTM(writable_, "free in the read only transaction");
+
+  uint32_t overflow = page(pageID)->overflow();
+  db_->freelist_.free(meta_.txID, pageID, overflow);
+
+  recordTick(DBStats::kPagesFreed, overflow + 1);
+  recordTx(&TxStats::pagesFreed, overflow + 1);
+}
+
+Page* TXImpl::page(uint64_t pageID) {
+
+  auto it = pages_.find(pageID);
+  if (it != pages_.end()) {
+    return it->second;
+  }
+
+  return db_->page(pageID);
+}
+
+size_t TXImpl::pageSize() const {
+  return db_->pageSize_;
+}
+
+const RebalancePolicy& TXImpl::rebalancePolicy() const {
+  return db_->rebalancePolicy_;
+}
+
+const Comparator* TXImpl::comparator(uint8_t id) const {
+
+  if (id == bytewiseComparator()->id()) {
+    return bytewiseComparator();
+  }
+
+  if (id == uint64Comparator()->id()) {
+    return uint64Comparator();
+  }
+
+  for (auto c : db_->options_.comparators) {
+    if (c->id() == id) {
+      return c;
+    }
+  }
+
+  return nullptr;
+}
+
+Status TXImpl::replay(uint64_t txID, std::string_view ops) {
+
+  ASSERTM(writable_, "replay in the read only transaction");
+
+  if (txID < meta_.txID) {
+    return Status::dataError("wal out of order");
+  }
+  meta_.txID = txID;
+  walBatch_.reset();
+
+  WalBatch::Op op;
+  while (!ops.empty()) {
+    if (!WalBatch::next(&ops, &op)) {
+      return Status::dataError("corrupted wal");
+    }
+
+    BucketImpl* b = &root_;
+    std::string_view path = op.path, name;
+    while (b != nullptr && !path.empty()) {
+      if (!WalBatch::nextName(&path, &name)) {
+        return Status::dataError("corrupted wal");
+      }
+      b = b->bucket(std::string(name));
+    }
+    if (b == nullptr) {
+      return Status::dataError("wal bucket not found");
+    }
+
+    Status s = Status::OK();
+    switch (op.type) {
+      case WalBatch::kPut:
+        s = b->put(std::string(op.key), std::string(op.value));
+        break;
+      case WalBatch::kDel:
+        s = b->del(std::string(op.key));
+        break;
+      case WalBatch::kCreateBucket: {
+        const Comparator* c = comparator(op.comparator);
+        if (c == nullptr || b->createBucket(std::string(op.key), c, op.keySize, op.valueSize) == nullptr) {
+          s = Status::dataError("wal bucket not created");
+        }
+        break;
+      }
+      case WalBatch::kSequence:
+        s = b->setSequence(op.sequence);
+        break;
+    }
+
+    if (!s.ok()) {
+      return s;
+    }
+  }
+
+  return Status::OK();
+}
+
+// Moves some leaves of the top level buckets towards the key order, from
+// where the previous commit stopped.
+void TXImpl::defrag() {
+
+  auto& name = db_->defragBucket_;
+  auto& key = db_->defragKey_;
+  size_t budget = db_->options_.defragPagesPerTx;
+  size_t moved = 0;
+
+  for (size_t i = 0; i < kDefragBucketsPerTx && moved < budget; i++) {
+    std::string next;
+    if (name.empty()) {
+      if (!root_.nextBucket("", &next)) {
+        break;
+      }
+      name = next;
+      key.clear();
+    }
+
+    BucketImpl* b = root_.bucket(name);
+    if (b != nullptr) {
+      moved += b->defrag(db_->freelist_, &key, budget - moved, budget * kDefragScanFactor);
+      // stopped in the middle of the bucket
+      if (!key.empty()) {
+        break;
+      }
+    }
+
+    if (!root_.nextBucket(name, &next)) {
+      next.clear();
+    }
+    name = next;
+    key.clear();
+  }
+
+  recordTick(DBStats::kPagesRelocated, moved);
+}
+
+Status TXImpl::commit() {
+
+  ASSERTM(writable_, "commit the read only transaction");
+
+  size_t pageSize = db_->pageSize_;
+  bool defrag = db_->options_.defragPagesPerTx > 0;
+
+  for (auto& e : indexWriters_) {
+    Status s = flushIndex(e.second.get());
+    if (!s.ok()) {
+      return s;
+    }
+  }
+
+  if (defrag) {
+    this->defrag();
+  }
+
+  {
+    TxStopWatch sw(&TxStats::rebalanceMicros);
+    root_.rebalance();
+  }
+
+  {
+    StopWatch sw(DBStats::kSpillMicros);
+    TxStopWatch txsw(&TxStats::spillMicros);
+    root_.spill();
+  }
+  meta_.root = root_.header();
+
+  // the checkpoint writes the end of the file in the wal mode, and the
+  // backups copy up to the ends of their snapshots
+  bool wal = db_->wal_ != nullptr;
+  uint64_t truncated = defrag && !wal ? db_->freelist_.trim(&meta_.pageID, db_->backupEnd()) : 0;
+
+  // the freelist is written with the meta if it's deferred
+  if (!db_->deferMeta_) {
+    if (meta_.freelistPageID != kNoFreelist) {
+      free(meta_.freelistPageID);
+    }
+
+    if (db_->options_.noFreelistSync) {
+      meta_.freelistPageID = kNoFreelist;
+    } else {
+      // the freelist includes the pages freed by this transaction
+      Page* p = alloc(pageSize, (db_->freelist_.size() + pageSize - 1) / pageSize);
+      db_->freelist_.write(p);
+      meta_.freelistPageID = p->id();
+    }
+  }
+
+  Status s = db_->grow((meta_.pageID + 1) * pageSize);
+  if (!s.ok()) {
+    return s;
+  }
+
+  s = wal ? writeWal() : write();
+  if (!s.ok()) {
+    return s;
+  }
+
+  s = writeMeta();
+  if (!s.ok()) {
+    return s;
+  }
+
+  // the pages are not read by anyone, the file just stays larger if it fails
+  uint64_t end = meta_.pageID * pageSize;
+  auto preallocator = db_->preallocator_.get();
+  if (preallocator != nullptr) {
+    // keeps the preallocated chunk instead of the exact end
+    truncated = truncated > 0 ? preallocator->truncate(end) / pageSize : 0;
+    preallocator->reserve(end);
+  } else if (truncated > 0 && ftruncate(db_->fd_, end) == -1) {
+    truncated = 0;
+  }
+
+  recordTick(DBStats::kPagesTruncated, truncated);
+
+  return s;
+}
+
+// Drops the dirty pages and gives back the pages allocated from the freelist.
+void TXImpl::rollback() {
+
+  if (!writable_) {
+    return;
+  }
+
+  auto& freelist = db_->freelist_;
+  freelist.rollback(meta_.txID);
+
+  // the freelist page is behind if the meta is deferred, or missing, the
+  // pages below the end of the file are from the freelist
+  if (db_->deferMeta_ || db_->meta()->freelistPageID == kNoFreelist) {
+    uint64_t end = db_->meta()->pageID;
+    for (auto& e : pages_) {
+      if (e.first < end) {
+        freelist.restore(e.first, e.second->overflow());
+      }
+    }
+    for (auto& e : spilled_) {
+      if (e.first < end) {
+        freelist.restore(e.first, e.second);
+      }
+    }
+    return;
+  }
+
+  freelist.reload(db_->page(db_->meta()->freelistPageID));
+}
+
+Status TXImpl::writePage(Page* p, uint64_t* written) {
+
+  size_t pageSize = db_->pageSize_;
+  const char* buf = reinterpret_cast<char*>(p);
+  size_t sz = (p->overflow() + 1) * pageSize;
+  off_t offset = p->id() * pageSize;
+
+  while (sz > 0) {
+    ssize_t n = pwrite(db_->fd_, buf, sz, offset);
+    if (n == -1) {
+      return ioError();
+    }
+
+    buf += n;
+    sz -= n;
+    offset += n;
+    *written += n;
+  }
+
+  return Status::OK();
+}
+
+// Writes the dirty pages in the memory, the ones in the mapping are written
+// by the sync.
+Status TXImpl::write() {
+
+  uint64_t written = mappedBytes_;
+  size_t pageSize = db_->pageSize_;
+
+  {
+    TxStopWatch sw(&TxStats::writeMicros);
+
+    for (auto& e : pages_) {
+      Status s = writePage(e.second, &written);
+      if (!s.ok()) {
+        return s;
+      }
+    }
+  }
+
+  recordTick(DBStats::kBytesWritten, written);
+  recordTx(&TxStats::bytesWritten, written);
+  measure(DBStats::kCommitBytes, written + pageSize);
+
+  if (db_->syncer_ != nullptr) {
+    db_->syncer_->written(written);
+    return Status::OK();
+  }
+
+  TxStopWatch sw(&TxStats::syncMicros);
+  return db_->sync(db_->fd_);
+}
+
+// Logs the writes, and hands the dirty pages over to the database, where
+// they are read until the checkpoint writes them.
+Status TXImpl::writeWal() {
+
+  if (walBatch_ != nullptr && !walBatch_->empty()) {
+    auto mode = db_->options_.syncMode;
+    bool sync = mode == Options::kSyncFull || mode == Options::kSyncData;
+    Status s = db_->wal_->append(meta_.txID, walBatch_->data(), sync);
+    if (!s.ok()) {
+      return s;
+    }
+    measure(DBStats::kCommitBytes, walBatch_->data().size());
+    if (db_->syncer_ != nullptr) {
+      db_->syncer_->written(walBatch_->data().size());
+    }
+  }
+
+  std::lock_guard<std::shared_mutex> lock(db_->overlayLock_);
+  for (auto& e : pages_) {
+    auto& p = db_->overlay_[e.first];
+    // the pages freed since the checkpoint are not allocated again until it
+    ASSERTM(p == nullptr, "page rewritten before the checkpoint");
+    p = e.second;
+  }
+  pages_.clear();
+
+  return Status::OK();
+}
+
+Status TXImpl::writeMeta() {
+
+  TxStopWatch sw(&TxStats::metaMicros);
+
+  if (db_->deferMeta_) {
+    // the readers copy the meta with the lock
+    std::lock_guard<std::mutex> lock(db_->metaLock_);
+    db_->latestMeta_ = meta_;
+    return Status::OK();
+  }
+
+  return db_->writeMeta(meta_, db_->nextMetaPageID());
+}
+
+}  // namespace dbwheel
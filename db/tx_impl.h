@@ -3,20 +3,103 @@
 #ifndef DBWHEEL_DB_TX_IMPL_H_
 #define DBWHEEL_DB_TX_IMPL_H_
 
+#include <cstdint>
+#include <map>
+#include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
+#include "include/dbwheel/status.h"
 #include "include/dbwheel/tx.h"
+#include "db/bucket_impl.h"
+#include "db/meta.h"
+#include "db/page_alloc.h"
+#include "db/page_free.h"
+#include "db/wal.h"
 
 namespace dbwheel {
 
 class Bucket;
+class DBImpl;
+class Page;
+struct RebalancePolicy;
 
-class TXImpl : public TX {
+// TXImpl works on the snapshot of the meta when it begins. The writable one
+// allocates the pages into the memory and writes them to the file in commit.
+class TXImpl : public TX, public PageAlloc, public PageFree {
  public:
-  Bucket* createBucket(const std::string& name) override;
+  TXImpl(DBImpl* db, bool writable);
+  // A read only transaction on the snapshot of 'meta'.
+  TXImpl(DBImpl* db, const Meta& meta);
+  ~TXImpl();
+
+  Bucket* createBucket(const std::string& name, const Comparator* comparator = nullptr) override;
+  Bucket* createFixedWidthBucket(const std::string& name, uint8_t keySize,
+      uint8_t valueSize, const Comparator* comparator = nullptr) override;
+  Bucket* bucket(const std::string& name) override;
+
+  Page* alloc(size_t sz, size_t count) override;
+  Page* allocNear(size_t sz, size_t count, uint64_t hint) override;
+  void free(uint64_t pageID) override;
+
+  Status commit();
+  void rollback();
+  // Applies the logged writes 'ops' of the transaction 'txID' again, which
+  // are not logged by this transaction.
+  Status replay(uint64_t txID, std::string_view ops);
+
+  Page* page(uint64_t pageID);
+  bool writable() const { return writable_; }
+  uint64_t id() const { return meta_.txID; }
+  const Meta& meta() const { return meta_; }
+  size_t pageSize() const;
+  const RebalancePolicy& rebalancePolicy() const;
+  // Returns the comparator of the id kept in a bucket, null if unknown.
+  const Comparator* comparator(uint8_t id) const;
+  // The writes logged by Options::walMode, null if not logged.
+  WalBatch* wal() { return walBatch_.get(); }
+  // Adds the memory taken by the nodes changed.
+  void charge(size_t bytes) { dirtyBytes_ += bytes; }
+  // Writes the changed nodes to the file if they are over
+  // Options::txMemoryBudget, which are read from it again. Called before
+  // the writes, as the nodes are dropped.
+  Status spillIfOverBudget();
+
+ private:
+  void defrag();
+  Bucket* createBucket0(const std::string& name, const Comparator* comparator,
+      uint8_t keySize, uint8_t valueSize);
+  BucketImpl* openBucket(const std::string& name);
+  void attachIndexes(const std::string& name, BucketImpl* b);
+  void attachFilter(const std::string& name, BucketImpl* b);
+  Status flushIndex(IndexWriter* w);
+  Page* allocMapped(uint64_t id, size_t count);
+  Status spillEarly();
+  Status writePage(Page* p, uint64_t* written);
+  Status write();
+  Status writeWal();
+  Status writeMeta();
+
+  DBImpl* db_;
+  bool writable_;
+  Meta meta_;
+  BucketImpl root_;
+  // the dirty pages
+  std::map<uint64_t, Page*> pages_;
+  // the entries of the indexes by the index names
+  std::map<std::string, std::unique_ptr<IndexWriter>> indexWriters_;
+  std::unique_ptr<WalBatch> walBatch_;
+  // the bytes of the nodes changed since the last spill
+  uint64_t dirtyBytes_;
+  bool spilling_;
+  // the pages written before the commit, by the ids and the overflows
+  std::vector<std::pair<uint64_t, uint32_t>> spilled_;
+  // the end of the pages known to be writable through the mapping
+  uint64_t mappedEnd_;
+  uint64_t mappedBytes_;
 };
 
 }  // namespace dbwheel
 
 #endif  // DBWHEEL_DB_TX_IMPL_H_
-
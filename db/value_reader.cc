@@ -0,0 +1,47 @@
+// Copyright (c) 2020
+//
+#include "db/value_reader.h"
+
+#include <cstring>
+
+#include <algorithm>
+
+#include "db/assert.h"
+#include "db/page.h"
+
+namespace dbwheel {
+
+ValueReader::ValueReader(Page* page, uint64_t size):
+  data_(page->ptr_),
+  size_(size),
+  offset_(0) {
+
+  ASSERTM((page->flags() & Page::kValuePageFlag) != 0, "not a value page");
+}
+
+size_t ValueReader::next(size_t n, const char** data) {
+
+  n = std::min<uint64_t>(n, remaining());
+  *data = data_ + offset_;
+  offset_ += n;
+
+  return n;
+}
+
+size_t ValueReader::read(char* buf, size_t n) {
+
+  const char* data;
+  n = next(n, &data);
+  memcpy(buf, data, n);
+
+  return n;
+}
+
+void ValueReader::readAll(std::string* v) {
+
+  const char* data;
+  size_t n = next(remaining(), &data);
+  v->append(data, n);
+}
+
+}  // namespace dbwheel
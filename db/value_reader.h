@@ -0,0 +1,45 @@
+// Copyright (c) 2020
+//
+#ifndef DB_VALUE_READER_H_
+#define DB_VALUE_READER_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include <string>
+
+namespace dbwheel {
+
+class Page;
+
+// ValueReader streams a value stored out of line in the extent of value pages.
+// The chunks point straight into the page memory, which is the mmap for the
+// committed pages, so a large value is never copied as a whole.
+class ValueReader {
+ public:
+  ValueReader(Page* page, uint64_t size);
+
+  uint64_t size() const { return size_; }
+  uint64_t remaining() const { return size_ - offset_; }
+
+  // Stores the pointer to the next at most 'n' bytes in *data,
+  // returns the length of the chunk, 0 means the end of the value.
+  size_t next(size_t n, const char** data);
+
+  // Copies the next at most 'n' bytes into 'buf', returns the copied length.
+  size_t read(char* buf, size_t n);
+
+  // Appends the rest of the value to 'v'.
+  void readAll(std::string* v);
+
+  void reset() { offset_ = 0; }
+
+ private:
+  const char* data_;
+  uint64_t size_;
+  uint64_t offset_;
+};
+
+}  // namespace dbwheel
+
+#endif  // DB_VALUE_READER_H_
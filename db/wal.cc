@@ -0,0 +1,296 @@
+// Copyright (c) 2020
+//
+#include "db/wal.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "db/crc32c.h"
+#include "db/statistics.h"
+
+namespace dbwheel {
+
+// size, crc32c and txID
+static const size_t kRecordHeaderSize = 16;
+
+// Larger records are taken as corrupted sizes.
+static const uint32_t kMaxRecordSize = 0x7FFFFFFF;
+
+// The size the file is allocated by at a time.
+static const uint64_t kWalChunkSize = 4 << 20;
+
+inline static Status ioError() {
+  return Status::ioError(strerror(errno));
+}
+
+static void putVarint(std::string* dst, uint64_t v) {
+
+  while (v >= 0x80) {
+    dst->push_back(static_cast<char>(v | 0x80));
+    v >>= 7;
+  }
+  dst->push_back(static_cast<char>(v));
+}
+
+static bool getVarint(std::string_view* src, uint64_t* v) {
+
+  *v = 0;
+  for (int shift = 0; shift < 64 && !src->empty(); shift += 7) {
+    uint8_t b = static_cast<uint8_t>(src->front());
+    src->remove_prefix(1);
+    *v |= static_cast<uint64_t>(b & 0x7F) << shift;
+    if ((b & 0x80) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static void putBytes(std::string* dst, std::string_view v) {
+  putVarint(dst, v.size());
+  dst->append(v.data(), v.size());
+}
+
+static bool getBytes(std::string_view* src, std::string_view* v) {
+
+  uint64_t n;
+  if (!getVarint(src, &n) || n > src->size()) {
+    return false;
+  }
+
+  *v = src->substr(0, n);
+  src->remove_prefix(n);
+
+  return true;
+}
+
+static bool getByte(std::string_view* src, uint8_t* v) {
+
+  if (src->empty()) {
+    return false;
+  }
+
+  *v = static_cast<uint8_t>(src->front());
+  src->remove_prefix(1);
+
+  return true;
+}
+
+Wal::~Wal() {
+  close();
+}
+
+Status Wal::open(const std::string& path) {
+
+  fd_ = ::open(path.data(), O_CREAT|O_RDWR, S_IROTH|S_IRGRP|S_IRUSR|S_IWUSR);
+  if (fd_ == -1) {
+    return ioError();
+  }
+
+  struct stat sb;
+  if (fstat(fd_, &sb) == -1) {
+    return ioError();
+  }
+  allocated_ = sb.st_size;
+
+  return Status::OK();
+}
+
+Status Wal::close() {
+
+  if (fd_ != -1 && ::close(fd_) == -1) {
+    fd_ = -1;
+    return ioError();
+  }
+  fd_ = -1;
+
+  return Status::OK();
+}
+
+Status Wal::append(uint64_t txID, const std::string& ops, bool sync) {
+
+  std::string record(kRecordHeaderSize, 0);
+  uint32_t size = ops.size();
+  memcpy(&record[0], &size, sizeof(size));
+  memcpy(&record[8], &txID, sizeof(txID));
+  record.append(ops);
+
+  uint32_t crc = crc32c::Mask(crc32c::Value(record.data() + 8, record.size() - 8));
+  memcpy(&record[4], &crc, sizeof(crc));
+
+  // the file is extended by the write if it can't be allocated
+  if (size_ + record.size() > allocated_) {
+    uint64_t chunk = std::max<uint64_t>(kWalChunkSize, record.size());
+    if (fallocate(fd_, 0, allocated_, chunk) == 0) {
+      allocated_ += chunk;
+    } else if (errno != EOPNOTSUPP) {
+      return ioError();
+    }
+  }
+
+  {
+    TxStopWatch sw(&TxStats::writeMicros);
+
+    for (size_t off = 0; off < record.size();) {
+      ssize_t n = pwrite(fd_, record.data() + off, record.size() - off, size_ + off);
+      if (n == -1) {
+        return ioError();
+      }
+      off += n;
+    }
+  }
+
+  recordTick(DBStats::kWalBytes, record.size());
+  recordTx(&TxStats::bytesWritten, record.size());
+
+  if (sync) {
+    TxStopWatch sw(&TxStats::syncMicros);
+    Status s = this->sync();
+    if (!s.ok()) {
+      return s;
+    }
+  }
+
+  size_ += record.size();
+  allocated_ = std::max(allocated_, size_);
+
+  return Status::OK();
+}
+
+Status Wal::sync() {
+
+  StopWatch sw(DBStats::kFsyncMicros);
+  if (fdatasync(fd_) == -1) {
+    return ioError();
+  }
+
+  return Status::OK();
+}
+
+Status Wal::replay(uint64_t txID,
+    const std::function<Status(uint64_t txID, std::string_view ops)>& f) {
+
+  std::vector<char> buf(allocated_);
+  for (size_t off = 0; off < buf.size();) {
+    ssize_t n = pread(fd_, buf.data() + off, buf.size() - off, off);
+    if (n == -1) {
+      return ioError();
+    }
+    if (n == 0) {
+      buf.resize(off);
+    }
+    off += n;
+  }
+
+  std::string_view log(buf.data(), buf.size());
+  while (log.size() >= kRecordHeaderSize) {
+    uint32_t size, crc;
+    uint64_t id;
+    memcpy(&size, log.data(), sizeof(size));
+    memcpy(&crc, log.data() + 4, sizeof(crc));
+    memcpy(&id, log.data() + 8, sizeof(id));
+
+    if (size > kMaxRecordSize || size > log.size() - kRecordHeaderSize ||
+        crc32c::Unmask(crc) != crc32c::Value(log.data() + 8, size + 8)) {
+      break;
+    }
+
+    if (id > txID) {
+      Status s = f(id, log.substr(kRecordHeaderSize, size));
+      if (!s.ok()) {
+        return s;
+      }
+    }
+
+    log.remove_prefix(kRecordHeaderSize + size);
+    size_ += kRecordHeaderSize + size;
+  }
+
+  return Status::OK();
+}
+
+Status Wal::truncate() {
+
+  if (ftruncate(fd_, 0) == -1) {
+    return ioError();
+  }
+  size_ = 0;
+  allocated_ = 0;
+
+  return Status::OK();
+}
+
+void WalBatch::header(Type type, const std::string& path) {
+  data_.push_back(static_cast<char>(type));
+  putBytes(&data_, path);
+}
+
+void WalBatch::put(const std::string& path, const std::string& k, const std::string& v) {
+  header(kPut, path);
+  putBytes(&data_, k);
+  putBytes(&data_, v);
+}
+
+void WalBatch::del(const std::string& path, const std::string& k) {
+  header(kDel, path);
+  putBytes(&data_, k);
+}
+
+void WalBatch::createBucket(const std::string& path, const std::string& name,
+    uint8_t comparator, uint8_t keySize, uint8_t valueSize) {
+  header(kCreateBucket, path);
+  putBytes(&data_, name);
+  data_.push_back(static_cast<char>(comparator));
+  data_.push_back(static_cast<char>(keySize));
+  data_.push_back(static_cast<char>(valueSize));
+}
+
+void WalBatch::sequence(const std::string& path, uint64_t v) {
+  header(kSequence, path);
+  putVarint(&data_, v);
+}
+
+std::string WalBatch::subPath(const std::string& path, const std::string& name) {
+
+  std::string p = path;
+  putBytes(&p, name);
+
+  return p;
+}
+
+bool WalBatch::nextName(std::string_view* path, std::string_view* name) {
+  return getBytes(path, name);
+}
+
+bool WalBatch::next(std::string_view* ops, Op* op) {
+
+  uint8_t type;
+  if (!getByte(ops, &type) || !getBytes(ops, &op->path)) {
+    return false;
+  }
+  op->type = static_cast<Type>(type);
+
+  switch (op->type) {
+    case kPut:
+      return getBytes(ops, &op->key) && getBytes(ops, &op->value);
+    case kDel:
+      return getBytes(ops, &op->key);
+    case kCreateBucket:
+      return getBytes(ops, &op->key) && getByte(ops, &op->comparator) &&
+          getByte(ops, &op->keySize) && getByte(ops, &op->valueSize);
+    case kSequence:
+      return getVarint(ops, &op->sequence);
+    default:
+      return false;
+  }
+}
+
+}  // namespace dbwheel
@@ -0,0 +1,101 @@
+// Copyright (c) 2020
+//
+#ifndef DB_WAL_H_
+#define DB_WAL_H_
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+
+#include "include/dbwheel/status.h"
+
+namespace dbwheel {
+
+// Wal is the write-ahead log of Options::walMode. Every commit appends one
+// record of its logical writes, and syncs only the log, as the sync mode says:
+//
+//   size (4 bytes) | crc32c (4 bytes) | txID (8 bytes) | ops (size bytes)
+//
+// where the checksum covers the txID and the ops. A record torn by a crash
+// fails its checksum, and the log is read up to it. The file is allocated
+// ahead by chunks, so the syncs of the appends don't write its size, the
+// zeros after the records end the log too.
+class Wal {
+ public:
+  Wal(): fd_(-1), size_(0), allocated_(0) {}
+  ~Wal();
+
+  Status open(const std::string& path);
+  Status close();
+
+  // Appends the record, and syncs the log if 'sync' is set, which the next
+  // record overwrites if it fails.
+  Status append(uint64_t txID, const std::string& ops, bool sync);
+  // Syncs the records appended.
+  Status sync();
+  // Calls 'f' with the records of the transactions after 'txID' in the order,
+  // until it fails. The records are appended after the ones read.
+  Status replay(uint64_t txID, const std::function<Status(uint64_t txID, std::string_view ops)>& f);
+  // Empties the log once its records are checkpointed.
+  Status truncate();
+
+  uint64_t size() const { return size_; }
+
+ private:
+  int fd_;
+  // the end of the records
+  uint64_t size_;
+  // the size of the file
+  uint64_t allocated_;
+};
+
+// WalBatch encodes the writes of a transaction into the ops of a record,
+// each is the type, the path of the bucket, and the arguments.
+class WalBatch {
+ public:
+  enum Type : uint8_t {
+    kPut = 1,
+    kDel,
+    kCreateBucket,
+    kSequence
+  };
+
+  // Op is a decoded op, the views point into the record.
+  struct Op {
+    Type type;
+    std::string_view path;
+    std::string_view key;
+    std::string_view value;
+    uint8_t comparator;
+    uint8_t keySize;
+    uint8_t valueSize;
+    uint64_t sequence;
+  };
+
+  void put(const std::string& path, const std::string& k, const std::string& v);
+  void del(const std::string& path, const std::string& k);
+  void createBucket(const std::string& path, const std::string& name,
+      uint8_t comparator, uint8_t keySize, uint8_t valueSize);
+  void sequence(const std::string& path, uint64_t v);
+
+  const std::string& data() const { return data_; }
+  bool empty() const { return data_.empty(); }
+
+  // Returns the path of the sub bucket 'name' of the bucket of 'path', the
+  // root bucket is the empty path.
+  static std::string subPath(const std::string& path, const std::string& name);
+  // Removes the first name from *path into *name, false if it's corrupted.
+  static bool nextName(std::string_view* path, std::string_view* name);
+  // Decodes the first op of *ops into *op, false if it's corrupted.
+  static bool next(std::string_view* ops, Op* op);
+
+ private:
+  void header(Type type, const std::string& path);
+
+  std::string data_;
+};
+
+}  // namespace dbwheel
+
+#endif  // DB_WAL_H_
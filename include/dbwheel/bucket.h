@@ -3,17 +3,60 @@
 #ifndef DBWHEEL_INCLUDE_BUCKET_H_
 #define DBWHEEL_INCLUDE_BUCKET_H_
 
+#include <cstdint>
+#include <functional>
 #include <string>
+#include <vector>
 
 #include "include/dbwheel/status.h"
+#include "include/dbwheel/write_batch.h"
 
 namespace dbwheel {
 
+// ScanFunc is called with the entries of a scan, which stops once it
+// returns false.
+using ScanFunc = std::function<bool(const std::string& key, const std::string& value)>;
+
 class Bucket {
  public:
+  virtual ~Bucket() = default;
+
   virtual Status put(const std::string& k, const std::string& v) = 0;
   virtual Status get(const std::string& k, std::string* v) = 0;
   virtual Status del(const std::string& k) = 0;
+
+  // Returns the sequence of the bucket, which is the last id handed out.
+  virtual uint64_t sequence() = 0;
+  // Sets the sequence, the ids may repeat if it's lowered.
+  virtual Status setSequence(uint64_t v) = 0;
+  // Increments the sequence and stores it into *v, it's persisted when the
+  // transaction commits. See DB::nextSequence for the ids without commits.
+  virtual Status nextSequence(uint64_t* v) = 0;
+
+  // Gets the values of 'keys' with one descent of the tree, stores the value
+  // and the status of keys[i] into (*values)[i] and (*statuses)[i].
+  virtual void multiGet(
+      const std::vector<std::string>& keys,
+      std::vector<std::string>* values,
+      std::vector<Status>* statuses) = 0;
+
+  // Applies the puts and the deletes of 'batch', nothing is applied if any
+  // of them is invalid.
+  virtual Status write(const WriteBatch& batch) = 0;
+  // Stores the keys indexed under 'indexKey' into *keys in the key order,
+  // if the bucket is an index declared by DB::createIndex.
+  virtual Status indexLookup(const std::string& indexKey, std::vector<std::string>* keys) = 0;
+
+  // Scans the keys in ['begin', 'end') by 'threads' threads in the snapshot
+  // of the transaction, an empty 'end' scans to the end of the bucket. The
+  // range is split into about equal partitions at the keys of the upper
+  // branch pages, and 'f' is called from the threads at once, in the key
+  // order within a partition. If 'ordered' is set, the threads collect the
+  // partitions instead, and 'f' is called in the key order by the calling
+  // thread. The sub buckets are skipped. The transaction must not write
+  // until it returns.
+  virtual Status parallelScan(const std::string& begin, const std::string& end, int threads,
+      const ScanFunc& f, bool ordered = false) = 0;
 };
 
 }  // namespace dbwheel
@@ -0,0 +1,36 @@
+// Copyright (c) 2020
+//
+#ifndef DBWHEEL_INCLUDE_COMPARATOR_H_
+#define DBWHEEL_INCLUDE_COMPARATOR_H_
+
+#include <cstdint>
+#include <string_view>
+
+namespace dbwheel {
+
+// Comparator orders the keys of a bucket created by TX::createBucket with it.
+class Comparator {
+ public:
+  virtual ~Comparator() {}
+
+  // Returns a negative number if 'a' is before 'b', a positive one if it's
+  // after, or 0 only if they are the same bytes.
+  virtual int compare(std::string_view a, std::string_view b) const = 0;
+  // Identifies the order in the bucket, so the bucket is opened with the
+  // comparator of the same id in Options::comparators. 0 is the order of
+  // the bytes, and 1 to 15 are reserved by the builtin ones, so the other
+  // comparators of these ids are rejected by TX::createBucket.
+  virtual uint8_t id() const = 0;
+  // Whether 'key' can be put into the bucket.
+  virtual bool valid(std::string_view /*key*/) const { return true; }
+};
+
+// Orders the keys by the bytes, as the buckets without a comparator.
+const Comparator* bytewiseComparator();
+// Orders the 8 byte big endian unsigned integers, the keys of the other
+// sizes are invalid. They are compared as the integers when searching.
+const Comparator* uint64Comparator();
+
+}  // namespace dbwheel
+
+#endif  // DBWHEEL_INCLUDE_COMPARATOR_H_
@@ -3,13 +3,23 @@
 #ifndef DBWHEEL_INCLUDE_DB_H_
 #define DBWHEEL_INCLUDE_DB_H_
 
+#include <cstdint>
+#include <functional>
+#include <string>
+
 #include "include/dbwheel/options.h"
+#include "include/dbwheel/stats.h"
 #include "include/dbwheel/status.h"
 
 namespace dbwheel {
 
 class TX;
 
+// IndexKeyFunc stores the index key of 'key' and 'value' into *indexKey,
+// returns false if the value is not indexed.
+using IndexKeyFunc = std::function<bool(
+    const std::string& key, const std::string& value, std::string* indexKey)>;
+
 class DB {
  public:
   // Open the database with the specified 'name'
@@ -21,12 +31,69 @@ class DB {
   // Caller should delete *dbptr when it is no longer needed.
   static Status open(const Options& options, const std::string& dbname, DB** dbptr);
 
+  // Rewrites the database 'src' into the new file 'dst' which is dense and
+  // has the leaves of every bucket in the key order, filled to 'fillPercent'
+  // of the page, 1.0 if it's 0. 'src' must not be opened by a writer.
+  // Fills the sizes and the speed into *stats if it's not null.
+  static Status compact(const std::string& src, const std::string& dst,
+      double fillPercent, CompactStats* stats = nullptr);
+
+  // Verifies the database 'path' from the meta page 'metaPage', 0 or 1, or
+  // from the latest one if it's -1, by 'threads' threads, one per core if
+  // it's 0. Every page reached is checked for its id, flags, extent and the
+  // order of its keys, the keys of the buckets whose comparators are not in
+  // options.comparators are not compared. The pages reached twice, or
+  // neither reached nor free, are reported too, the pages not reached are
+  // free if the freelist is not written by Options::noFreelistSync. Returns
+  // a data error with the first problem if any, fills the counts into
+  // *stats if it's not null.
+  // 'path' must not be opened by a writer.
+  static Status check(const Options& options, const std::string& path, int metaPage,
+      int threads, CheckStats* stats = nullptr);
+
   DB() = default;
 
   virtual ~DB();
 
   virtual Status close() = 0;
-  virtual Status update(void (*f)(TX*)) = 0;
+  // Executes 'f' in a writable transaction and commits it.
+  // Fills the cost of the transaction into *stats if it's not null.
+  virtual Status update(void (*f)(TX*), TxStats* stats = nullptr) = 0;
+
+  // Executes 'f' in a read only transaction.
+  virtual Status view(void (*f)(TX*)) = 0;
+
+  // Returns the statistics collected since open, all zeros unless
+  // Options::enableStatistics is set.
+  virtual DBStats stats() = 0;
+
+  // Stores the next id of the sequence of the top level 'bucket' into *seq.
+  // The ids are reserved in ranges by a writable transaction, which persists
+  // the end of the range as the bucket sequence, then handed out from the
+  // memory, so they never repeat even after a crash, but some ids may be
+  // skipped. Thread safe, must not be called inside a transaction.
+  virtual Status nextSequence(const std::string& bucket, uint64_t* seq) = 0;
+
+  // Writes a consistent copy of the latest committed snapshot into 'fd'
+  // from its current position, which may be a file, a pipe or a socket.
+  // The writers are not blocked, and the copy is limited to 'bytesPerSec'
+  // unless it's 0.
+  virtual Status backupTo(int fd, uint64_t bytesPerSec = 0) = 0;
+  // Creates the file 'path' and backs up into it as above.
+  virtual Status backupTo(const std::string& path, uint64_t bytesPerSec = 0) = 0;
+  // Returns the id of the latest committed write transaction. It's a load
+  // from the shared memory with Options::multiProcess, cheap enough for the
+  // reader processes to poll for the commits of the writer.
+  virtual uint64_t txID() = 0;
+  // Maintains the top level bucket 'index' as the secondary index of the top
+  // level bucket 'bucket' by 'f', which is built from the existing values
+  // if the index does not exist. The entries are collected by the writes of
+  // 'bucket' and merged into the index sorted when the transaction commits,
+  // or when the index is opened in it. 'f' is not persisted, so the index
+  // must be declared again after opening before writing 'bucket'.
+  // See Bucket::indexLookup for reading it.
+  virtual Status createIndex(const std::string& bucket, const std::string& index,
+      const IndexKeyFunc& f) = 0;
 };
 
 }  // namespace dbwheel
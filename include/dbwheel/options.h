@@ -3,12 +3,104 @@
 #ifndef DBWHEEL_INCLUDE_OPTIONS_H_
 #define DBWHEEL_INCLUDE_OPTIONS_H_
 
+#include <cstdint>
+#include <vector>
+
 namespace dbwheel {
 
+class Comparator;
+
 struct Options {
+  enum SyncMode {
+    // syncs the file and its metadata by fsync at every commit
+    kSyncFull = 0,
+    // syncs only the data and the size of the file by fdatasync
+    kSyncData,
+    // the commits don't sync, a background thread syncs the data every
+    // syncIntervalMs, or once syncBytes are written, and then writes the
+    // meta of the latest commit, so a crash loses the commits since, but
+    // the file opens on the latest synced one
+    kSyncPeriodic,
+    // never syncs, the meta is written right after the data, the file is
+    // consistent after the process crashes, not after the system does
+    kSyncNone
+  };
+
+  // The size mapped at open, a new file is also preallocated to it.
   int initialMmapSize;
   int mmapFlags;
+  // Maps the file writable, so the commits serialize the pages allocated
+  // past the end of the data straight into the mapping instead of copying
+  // them from the memory by the writes, the sync of the commit writes them.
+  // The file is extended ahead for them. Every such page takes a page fault
+  // instead, which may cost more than the copy. It can't be set with walMode,
+  // and is ignored if readOnly.
+  bool writableMmap;
   bool readOnly;
+  // Collects the statistics returned by DB::stats.
+  bool enableStatistics;
+  // A node smaller than this fraction of the page is rebalanced, 0.25 if 0.
+  double rebalanceLowWatermark;
+  // A node is merged with its sibling only if the merged one is not larger
+  // than this fraction of the page, otherwise it takes some inodes from the
+  // sibling. 0.75 if 0, and no less than twice the low watermark.
+  double rebalanceHighWatermark;
+  // The number of the ids reserved at a time by DB::nextSequence, 1024 if 0.
+  uint64_t sequenceLeaseSize;
+  // The number of the leaves moved next to their neighbours in the key order
+  // per commit, which also cuts the free pages off the end of the file.
+  // 0 disables the defragmentation.
+  uint32_t defragPagesPerTx;
+  // The file is kept allocated this many bytes ahead of the data by
+  // fallocate in a background thread, so the commits do not extend it.
+  // 0 disables the preallocation.
+  uint64_t fileGrowthChunk;
+  // The mapping doubles until it reaches this size, and then grows by this
+  // much at a time. 1 GiB if 0.
+  uint64_t mmapGrowthStep;
+  // Lets read only processes open the database while one process writes it.
+  // The processes share the file named with the "-lock" suffix, where the
+  // reader processes register their transactions and the writer publishes
+  // its commits, every view of a reader sees the latest commit. A read only
+  // database opened without it locks the "-lock" file too if it exists, so
+  // it's not opened along with such a writer.
+  bool multiProcess;
+  // Keeps a bloom filter of the keys of every top level bucket in the memory
+  // with this many bits per key, so the gets of the absent keys return
+  // without reading the pages. 0 disables it, as do the reader processes.
+  uint32_t filterBitsPerKey;
+  // The comparators of the buckets created with them, other than the
+  // builtin ones, which are found by Comparator::id when opening them.
+  std::vector<const Comparator*> comparators;
+  // Commits append their writes to the log file named with the "-wal" suffix
+  // and sync only it, the dirty pages are kept in the memory and written to
+  // the file by a checkpoint, once they are walCheckpointPages or more, or at
+  // close. The log is replayed at open, a read only database reads the file
+  // without it. It can't be set with multiProcess.
+  bool walMode;
+  // 4096 if 0.
+  uint32_t walCheckpointPages;
+  // kSyncFull by default. The log of walMode is synced as the data, the
+  // checkpoints always sync unless it's kSyncNone. kSyncPeriodic can't be
+  // set with multiProcess.
+  SyncMode syncMode;
+  // 100 if 0.
+  uint32_t syncIntervalMs;
+  // 0 syncs by the interval only.
+  uint64_t syncBytes;
+  // A write transaction whose dirty nodes take about more bytes than this
+  // writes them to the newly allocated pages before its next write, and
+  // reads them from the file again, so its memory doesn't grow with its
+  // size. The pages are in no snapshot until the commit, and are given back
+  // if it fails. 0 keeps the nodes until the commit.
+  uint64_t txMemoryBudget;
+  // The commits don't write the freelist, the meta marks it missing instead,
+  // and the open finds the free pages by walking the tree by a thread per
+  // core, as the pages not reached from the meta. It saves the writes of a
+  // large freelist per commit, for the time of the walk at open. A database
+  // written so is opened without it too, whose commits write the freelist
+  // again.
+  bool noFreelistSync;
 };
 
 }  // namespace dbwheel
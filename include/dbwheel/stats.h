@@ -0,0 +1,138 @@
+// Copyright (c) 2020
+//
+#ifndef DBWHEEL_INCLUDE_STATS_H_
+#define DBWHEEL_INCLUDE_STATS_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace dbwheel {
+
+// HistogramStats summarizes the samples of one histogram, the percentiles
+// are estimated from power-of-two buckets.
+struct HistogramStats {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
+  uint64_t p50;
+  uint64_t p99;
+
+  double average() const { return count == 0 ? 0 : (double) sum / count; }
+};
+
+// DBStats is a snapshot of the statistics of a database.
+struct DBStats {
+  enum Ticker {
+    kPagesAllocated = 0,
+    kPagesFreed,
+    kSplits,
+    kRebalances,
+    kRedistributions,
+    kCollapses,
+    kBytesWritten,
+    kMmapRemaps,
+    kReadTXs,
+    kWriteTXs,
+    // leaves moved next to their left neighbours by the defragmentation
+    kPagesRelocated,
+    // free pages cut off the end of the file
+    kPagesTruncated,
+    // bytes allocated ahead of the data by Options::fileGrowthChunk
+    kBytesPreallocated,
+    // gets of absent keys answered by the bucket filters
+    kFilterNegatives,
+    // bytes appended to the log by Options::walMode
+    kWalBytes,
+    // pages written to the file by the checkpoints
+    kCheckpointPages,
+    kCheckpoints,
+    // pages written before the commits by Options::txMemoryBudget
+    kPagesSpilledEarly,
+    kTickerMax
+  };
+
+  enum Histogram {
+    kSpillMicros = 0,
+    kCommitBytes,
+    kFsyncMicros,
+    kHistogramMax
+  };
+
+  static const char* name(Ticker t);
+  static const char* name(Histogram h);
+
+  uint64_t ticker(Ticker t) const { return tickers[t]; }
+  const HistogramStats& histogram(Histogram h) const { return histograms[h]; }
+
+  // One "name value" line per ticker and histogram.
+  std::string toString() const;
+  std::string toJSON() const;
+
+  uint64_t tickers[kTickerMax];
+  HistogramStats histograms[kHistogramMax];
+};
+
+// TxStats is the cost report of a write transaction filled by DB::update.
+struct TxStats {
+  // nodes decoded from the pages
+  uint64_t nodesDecoded;
+  // inodes decoded, inserted, updated or deleted
+  uint64_t inodesTouched;
+  uint64_t splits;
+  // nodes merged into their siblings or collapsed into their parents
+  uint64_t merges;
+  // nodes taking inodes from their siblings instead of merging
+  uint64_t redistributions;
+  uint64_t pagesAllocated;
+  uint64_t pagesFreed;
+  // bytes serialized into the pages by the nodes
+  uint64_t bytesSerialized;
+  // bytes written to the file, including the freelist and meta
+  uint64_t bytesWritten;
+  uint64_t mmapRemaps;
+
+  // wall time of the commit phases
+  uint64_t rebalanceMicros;
+  uint64_t spillMicros;
+  uint64_t writeMicros;
+  uint64_t syncMicros;
+  uint64_t metaMicros;
+
+  std::string toString() const;
+};
+
+// CompactStats is the report of DB::compact.
+struct CompactStats {
+  uint64_t srcSize;
+  uint64_t dstSize;
+  // pages written into the new file
+  uint64_t pages;
+  uint64_t micros;
+
+  double pagesPerSec() const { return micros == 0 ? 0 : pages * 1e6 / micros; }
+};
+
+// CheckStats is the report of DB::check.
+struct CheckStats {
+  // pages reached from the meta, the meta pages and the freelist included
+  uint64_t pages;
+  uint64_t freePages;
+  // pages neither reached nor free
+  uint64_t leakedPages;
+  // pages reached more than once, or reached and free
+  uint64_t doubleReferencedPages;
+  uint64_t keys;
+  uint64_t buckets;
+  // all the problems found, the first ones are described in 'errors'
+  uint64_t problems;
+  std::vector<std::string> errors;
+  uint64_t micros;
+
+  double pagesPerSec() const { return micros == 0 ? 0 : pages * 1e6 / micros; }
+};
+
+}  // namespace dbwheel
+
+#endif  // DBWHEEL_INCLUDE_STATS_H_
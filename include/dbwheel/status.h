@@ -12,11 +12,16 @@ class Status {
   static Status ioError(const std::string& msg) { return Status{kIOError, msg}; }
   static Status sysError(const std::string& msg) { return Status{kSysError, msg}; }
   static Status dataError(const std::string& msg) { return Status{kDataError, msg}; }
+  static Status notFound(const std::string& msg) { return Status{kNotFound, msg}; }
+  static Status invalidArgument(const std::string& msg) { return Status{kInvalidArgument, msg}; }
   static Status OK() { return Status{kOk, ""}; }
 
   bool ok() const { return code_ == kOk; }
   bool isIOError() const { return code_ == kIOError; }
   bool isSysError() const { return code_ == kSysError; }
+  bool isDataError() const { return code_ == kDataError; }
+  bool isNotFound() const { return code_ == kNotFound; }
+  bool isInvalidArgument() const { return code_ == kInvalidArgument; }
 
   std::string toString() const;
 
@@ -26,6 +31,8 @@ class Status {
     kIOError = 1,
     kSysError = 2,
     kDataError = 3,
+    kNotFound = 4,
+    kInvalidArgument = 5,
   };
 
   Status(Code code, const std::string& msg): code_(code), msg_(msg) {}
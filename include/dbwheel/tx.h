@@ -3,15 +3,31 @@
 #ifndef DBWHEEL_INCLUDE_TX_H_
 #define DBWHEEL_INCLUDE_TX_H_
 
+#include <cstdint>
 #include <string>
 
 namespace dbwheel {
 
 class Bucket;
+class Comparator;
 
 class TX {
  public:
-  virtual Bucket* createBucket(const std::string& name) = 0;
+  virtual ~TX() = default;
+
+  // Returns null if the key exists, the transaction is read only, or
+  // 'comparator' is not builtin but has a reserved id. The keys are ordered
+  // by 'comparator', which is kept in the bucket, or by the bytes if it's
+  // null.
+  virtual Bucket* createBucket(const std::string& name, const Comparator* comparator = nullptr) = 0;
+  // Creates the bucket of the keys of 'keySize' bytes and the values of
+  // 'valueSize' bytes, whose leaves are stored as the dense arrays of them.
+  // Returns null if 'keySize' is 0, or as createBucket.
+  virtual Bucket* createFixedWidthBucket(const std::string& name, uint8_t keySize,
+      uint8_t valueSize, const Comparator* comparator = nullptr) = 0;
+  // Returns null if the bucket does not exist, or its comparator is not
+  // builtin or in Options::comparators.
+  virtual Bucket* bucket(const std::string& name) = 0;
 };
 
 }  // namespace dbwheel
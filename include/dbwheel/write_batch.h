@@ -0,0 +1,34 @@
+// Copyright (c) 2020
+//
+#ifndef DBWHEEL_INCLUDE_WRITE_BATCH_H_
+#define DBWHEEL_INCLUDE_WRITE_BATCH_H_
+
+#include <string>
+#include <vector>
+
+namespace dbwheel {
+
+// WriteBatch collects the puts and the deletes applied by Bucket::write
+// together, the later one wins if a key is written more than once.
+class WriteBatch {
+ public:
+  struct Op {
+    bool del;
+    std::string key;
+    std::string value;
+  };
+
+  void put(const std::string& k, const std::string& v) { ops_.push_back(Op{false, k, v}); }
+  void del(const std::string& k) { ops_.push_back(Op{true, k, std::string()}); }
+  void clear() { ops_.clear(); }
+
+  size_t count() const { return ops_.size(); }
+  const std::vector<Op>& ops() const { return ops_; }
+
+ private:
+  std::vector<Op> ops_;
+};
+
+}  // namespace dbwheel
+
+#endif  // DBWHEEL_INCLUDE_WRITE_BATCH_H
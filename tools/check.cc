@@ -0,0 +1,43 @@
+// Copyright (c) 2020
+//
+// Usage: dbwheel_check <db> [threads] [metaPage]
+//
+// Verifies the pages of the database 'db', see DB::check.
+#include <cstdio>
+#include <cstdlib>
+
+#include "include/dbwheel/db.h"
+
+int main(int argc, char** argv) {
+
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <db> [threads] [metaPage]\n", argv[0]);
+    return 2;
+  }
+
+  int threads = argc > 2 ? atoi(argv[2]) : 0;
+  int metaPage = argc > 3 ? atoi(argv[3]) : -1;
+
+  dbwheel::CheckStats stats{};
+  dbwheel::Status s = dbwheel::DB::check(dbwheel::Options{}, argv[1], metaPage, threads, &stats);
+  for (auto& e : stats.errors) {
+    fprintf(stderr, "%s\n", e.c_str());
+  }
+  if (stats.problems > stats.errors.size()) {
+    fprintf(stderr, "... %llu more\n", (unsigned long long) (stats.problems - stats.errors.size()));
+  }
+
+  printf("%llu pages, %llu free, %llu leaked, %llu double referenced, %llu keys, %llu buckets "
+      "in %.3f s (%.0f pages/sec)\n",
+      (unsigned long long) stats.pages, (unsigned long long) stats.freePages,
+      (unsigned long long) stats.leakedPages, (unsigned long long) stats.doubleReferencedPages,
+      (unsigned long long) stats.keys, (unsigned long long) stats.buckets, stats.micros / 1e6,
+      stats.pagesPerSec());
+
+  if (!s.ok()) {
+    fprintf(stderr, "check: %s\n", s.toString().c_str());
+    return 1;
+  }
+
+  return 0;
+}
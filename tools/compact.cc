@@ -0,0 +1,33 @@
+// Copyright (c) 2020
+//
+// Usage: dbwheel_compact <src> <dst> [fillPercent]
+//
+// Rewrites the database 'src' into the dense file 'dst', see DB::compact.
+#include <cstdio>
+#include <cstdlib>
+
+#include "include/dbwheel/db.h"
+
+int main(int argc, char** argv) {
+
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s <src> <dst> [fillPercent]\n", argv[0]);
+    return 2;
+  }
+
+  double fillPercent = argc > 3 ? atof(argv[3]) : 1.0;
+
+  dbwheel::CompactStats stats{};
+  dbwheel::Status s = dbwheel::DB::compact(argv[1], argv[2], fillPercent, &stats);
+  if (!s.ok()) {
+    fprintf(stderr, "compact: %s\n", s.toString().c_str());
+    return 1;
+  }
+
+  double reduction = stats.srcSize == 0 ? 0 : 100.0 * (1 - (double) stats.dstSize / stats.srcSize);
+  printf("%llu -> %llu bytes (%.1f%% smaller), %llu pages in %.3f s (%.0f pages/sec)\n",
+      (unsigned long long) stats.srcSize, (unsigned long long) stats.dstSize, reduction,
+      (unsigned long long) stats.pages, stats.micros / 1e6, stats.pagesPerSec());
+
+  return 0;
+}